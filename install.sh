@@ -27,4 +27,9 @@ fi
 
 set -x
 CFLAGS=${CFLAGS:--flto -O3 -g0}
-$CC $CPPFLAGS $CFLAGS -D_XOPEN_SOURCE=700 -D_BSD_SOURCE -I. -o $1/ptar ptar.c
+# link with zlib (for -z) if its header is found; set LIBS to an empty
+# string and add -DNO_ZLIB to CFLAGS to build without -z anyway
+if [ -z "${LIBS+set}" ]; then
+  LIBS=$(printf '#include <zlib.h>\n' | $CC $CPPFLAGS $CFLAGS -x c -E - >/dev/null 2>&1 && echo -lz)
+fi
+$CC $CPPFLAGS $CFLAGS -D_XOPEN_SOURCE=700 -D_BSD_SOURCE -I. -pthread -o $1/ptar ptar.c $LIBS
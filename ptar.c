@@ -11,72 +11,662 @@
  * <http://creativecommons.org/publicdomain/zero/1.0/>.
  */
 
-#include <ctype.h>
+#ifdef	__linux__
+#define	_GNU_SOURCE	/* for copy_file_range(2), splice(2), and SEEK_DATA */
+#endif	/* __linux__ */
+
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fnmatch.h>
-#include <ftw.h>
 #include <grp.h>
+#include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef	__linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif	/* __linux__ */
+
+/* Define NO_SIMD to parse metadata keys and compute checksums with portable
+   C only. */
+#if	!defined(NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define	SIMD_SCAN
+#ifdef	__x86_64__
+#define	HARDWARE_CRC32C
+#endif	/* __x86_64__ */
+#include <immintrin.h>
+#elif	!defined(NO_SIMD) && defined(__ARM_FEATURE_CRC32)
+#define	HARDWARE_CRC32C
+#include <arm_acle.h>
+#endif	/* SIMD_SCAN */
+
+/* Define NO_ZLIB to build without -z (and link without -lz).  It's left
+   out anyway if the compiler can tell that <zlib.h> is missing, which is
+   what the Makefile and install.sh check before they link with -lz. */
+#ifndef	NO_ZLIB
+#if	!defined(__has_include)
+#define	GZIP_SUPPORT
+#elif	__has_include(<zlib.h>)
+#define	GZIP_SUPPORT
+#endif	/* __has_include */
+#endif	/* NO_ZLIB */
+#ifdef	GZIP_SUPPORT
+#include <zlib.h>
+#endif	/* GZIP_SUPPORT */
+
+/* Define NO_IO_URING to stat and read walked files and to write extracted
+   files with ordinary system calls only. */
+#if	!defined(NO_IO_URING) && defined(__linux__) && defined(__has_include)
+#if	__has_include(<linux/io_uring.h>)
+#define	IO_URING_SUPPORT
+#include <linux/io_uring.h>
+#endif	/* __has_include(<linux/io_uring.h>) */
+#endif	/* IO_URING_SUPPORT */
 
 #ifndef	WRITE_BLOCKSIZE
 #define	WRITE_BLOCKSIZE	32768
 #endif	/* WRITE_BLOCKSIZE */
 
+/* the size of the archive output buffer, which batches metadata and small
+   files' contents into large writes */
+#ifndef	OUTPUT_BUFSIZE
+#define	OUTPUT_BUFSIZE	(256 * 1024)
+#endif	/* OUTPUT_BUFSIZE */
+
+/* regular files smaller than this are copied through the output buffer
+   even when a zero-copy method is available */
+#ifndef	ZEROCOPY_MIN_SIZE
+#define	ZEROCOPY_MIN_SIZE	65536
+#endif	/* ZEROCOPY_MIN_SIZE */
+
+/* the maximum number of bytes moved by a single zero-copy system call */
+#ifndef	ZEROCOPY_BLOCKSIZE
+#define	ZEROCOPY_BLOCKSIZE	(1 << 30)
+#endif	/* ZEROCOPY_BLOCKSIZE */
+
+/* the number of bytes of a mapped file that are checksummed and then
+   written at a time */
+#ifndef	CHECKSUM_BLOCKSIZE
+#define	CHECKSUM_BLOCKSIZE	131072
+#endif	/* CHECKSUM_BLOCKSIZE */
+
+/* the number of bytes requested from standard input at a time */
+#ifndef	READ_BLOCKSIZE
+#define	READ_BLOCKSIZE	65536
+#endif	/* READ_BLOCKSIZE */
+
+/* the number of archive bytes compressed into each gzip member with -z;
+   members are compressed independently by separate threads */
+#ifndef	COMPRESS_BLOCKSIZE
+#define	COMPRESS_BLOCKSIZE	(1024 * 1024)
+#endif	/* COMPRESS_BLOCKSIZE */
+
+/* the buffer that getdents64(2) reads directory entries into */
+#ifndef	DIRENTS_BUFSIZE
+#define	DIRENTS_BUFSIZE	(256 * 1024)
+#endif	/* DIRENTS_BUFSIZE */
+
+/* the number of files that are statted at once while walking directories,
+   which is also the size of the io_uring rings */
+#ifndef	URING_ENTRIES
+#define	URING_ENTRIES	256
+#endif	/* URING_ENTRIES */
+#define	URING_OP(op)	(1ULL << (op))
+
+/* regular files no larger than this are read (while walking a directory)
+   or written (while extracting) along with their neighbors by io_uring, up
+   to URING_BUDGET bytes at once */
+#ifndef	URING_MAX_FILE_SIZE
+#define	URING_MAX_FILE_SIZE	65536
+#endif	/* URING_MAX_FILE_SIZE */
+#ifndef	URING_BUDGET
+#define	URING_BUDGET	(4 * 1024 * 1024)
+#endif	/* URING_BUDGET */
+
+/* the default limit on regular file contents held in memory by -j threads */
+#ifndef	PREFETCH_BUDGET
+#define	PREFETCH_BUDGET	(64 * 1024 * 1024)
+#endif	/* PREFETCH_BUDGET */
+
+/* -j threads don't read regular files larger than this */
+#ifndef	PREFETCH_MAX_FILE_SIZE
+#define	PREFETCH_MAX_FILE_SIZE	(1024 * 1024)
+#endif	/* PREFETCH_MAX_FILE_SIZE */
+
+/* the maximum number of file entries waiting to be written with -j */
+#ifndef	PREFETCH_MAX_ENTRIES
+#define	PREFETCH_MAX_ENTRIES	4096
+#endif	/* PREFETCH_MAX_ENTRIES */
+
+/* the width of the index extension's final Index Offset value */
+#define	INDEX_OFFSET_DIGITS	20
+#define	INDEX_TRAILER_PREFIX	"Index Offset:\t"
+#define	INDEX_TRAILER_SIZE	(sizeof (INDEX_TRAILER_PREFIX) - 1 + INDEX_OFFSET_DIGITS + 1)
+
+/* the initial number of slots in each owner name cache (a power of two) */
+#ifndef	OWNER_CACHE_SIZE
+#define	OWNER_CACHE_SIZE	64
+#endif	/* OWNER_CACHE_SIZE */
+
+/* hardware CRC-32C computes three interleaved streams of these sizes (in
+   bytes; powers of two) so that the instruction's latency is hidden */
+#ifndef	CRC32C_LONG
+#define	CRC32C_LONG	8192
+#endif	/* CRC32C_LONG */
+#ifndef	CRC32C_SHORT
+#define	CRC32C_SHORT	256
+#endif	/* CRC32C_SHORT */
+
+/* the smallest regular file whose contents are deduplicated (the reference
+   costs about as much as a short file's contents) */
+#ifndef	DEDUP_MIN_SIZE
+#define	DEDUP_MIN_SIZE	128
+#endif	/* DEDUP_MIN_SIZE */
+
+/* the number of bytes at the beginning of a regular file's contents that
+   select the earlier file whose contents it's compared with for --dedup */
+#ifndef	DEDUP_HEAD_SIZE
+#define	DEDUP_HEAD_SIZE	4096
+#endif	/* DEDUP_HEAD_SIZE */
+
+/* the number of parent directories kept open while extracting */
+#ifndef	DIRFD_CACHE_SIZE
+#define	DIRFD_CACHE_SIZE	64
+#endif	/* DIRFD_CACHE_SIZE */
+
+/* the initial capacity of pattern lists (--exclude and the 'x' command's
+   PATHs), which doubles as needed */
 #ifndef   REQUESTED_FILES_GROWTH
 #define   REQUESTED_FILES_GROWTH   8
 #endif    /* REQUESTED_FILES_GROWTH */
 
 static char linkpath[8192], verbose, extracttostdout;
-static long openmax;
 
 /* file type IDs */
-enum { UNKNOWN, REGULARFILE, DIRECTORY, SYMLINK, CHARDEVICE, BLOCKDEVICE, FIFO, SOCKET };
+enum { UNKNOWN, REGULARFILE, DIRECTORY, SYMLINK, CHARDEVICE, BLOCKDEVICE, FIFO, SOCKET, DELETED, HARDLINK };
+
+/* metadata key IDs; KEY_NONE means that a line has no key */
+enum {
+	KEY_NONE, KEY_UNKNOWN, KEY_PATH, KEY_TYPE, KEY_FILESIZE, KEY_LINKTARGET, KEY_MAJOR, KEY_MINOR,
+	KEY_USERNAME, KEY_USERID, KEY_GROUPNAME, KEY_GROUPID, KEY_PERMISSIONS, KEY_MODIFICATIONTIME,
+	KEY_METADATAENCODING, KEY_EXTENSIONS, KEY_ARCHIVECREATIONDATE, KEY_INDEXENTRY, KEY_INDEXOFFSET,
+	KEY_DEVICE, KEY_INODE, KEY_CONTENTCHECKSUM, KEY_SAMECONTENTSAS, KEY_SPARSESIZE, KEY_SPARSEMAP
+};
+
+/* format extensions (bitwise OR-ed in extensions and writeextensions);
+   extension 1 << n is named extensionnames[n] */
+#define	EXTENSION_INDEX	0x01	/* trailing index of file entries */
+#define	EXTENSION_INCREMENTAL	0x02	/* inode numbers and deleted files */
+#define	EXTENSION_CHECKSUM	0x04	/* CRC-32C of regular files' contents */
+#define	EXTENSION_DEDUP	0x08	/* references to identical earlier contents */
+#define	EXTENSION_HARDLINK	0x10	/* hard links to earlier entries */
+#define	EXTENSION_SPARSE	0x20	/* regular files' data extents without holes */
+static const char *extensionnames[] = { "index", "incremental", "checksum", "dedup", "hardlink", "sparse" };
+#define	NUM_EXTENSIONS	(sizeof (extensionnames) / sizeof (*extensionnames))
+static unsigned int extensions;	/* extensions declared by the archive being read */
+static unsigned int writeextensions;	/* extensions used by the archive being created */
+
+/* the number of bytes and non-file-contents lines written to stdout so far */
+static unsigned long long outoffset;
+static size_t outlines;
+
+/* archive output that hasn't been written to stdout yet (see output_bytes()) */
+static char *outbuf;
+static size_t outlen;
+static char unbuffered;	/* nonzero if -u was given */
+
+/* an index extension record: where a file entry's metadata begins */
+typedef struct index_record {
+	char *path;
+	unsigned long long offset;	/* from the beginning of the archive */
+	size_t lineno;
+	unsigned long long size;	/* for regular files only */
+	int type;	/* see the file type IDs above */
+} index_record_t;
+static index_record_t *indexrecords;
+static size_t numindexrecords, indexrecordscap;
+static off_t archivestart;	/* stdin's offset before reading the archive */
+
+/* caches of user and group names by ID (for 'c' command) and of IDs by
+   name (for 'x' command), so that the password and group databases are
+   consulted once per owner; open addressing with linear probing */
+typedef struct owner_name {
+	unsigned long id;
+	char *name;	/* NULL if the slot is empty */
+	char known;	/* for IDs by name: 0 if the name doesn't exist here */
+} owner_name_t;
+typedef struct owner_cache {
+	owner_name_t *slots;
+	size_t cap, count;	/* cap is 0 or a power of two */
+	unsigned long hits, misses;
+} owner_cache_t;
+static owner_cache_t usernames, groupnames, userids, groupids;
+
+/* the first archived regular file with each combination of size and
+   CRC-32C of the first DEDUP_HEAD_SIZE bytes (for 'c' command with
+   --dedup); open addressing with linear probing.  Different contents can
+   have the same size and beginning, so a candidate's contents are compared
+   with the file's, and they're only referred to if the candidate hasn't
+   changed since it was archived. */
+typedef struct dedup_file {
+	char *path;	/* NULL if the slot is empty */
+	uint64_t size;
+	uint32_t headcrc;
+	struct stat sb;	/* from before the file's contents were archived */
+} dedup_file_t;
+static dedup_file_t *dedupfiles;
+static size_t dedupfilescap, numdedupfiles;	/* dedupfilescap is 0 or a power of two */
+static unsigned long deduphits, dedupmisses;
+
+/* the first archived path of each file with several hard links, keyed by
+   its device and inode numbers (for 'c' command with --hard-links);
+   candidates are checked with lstat(2) because different files can have
+   the same key */
+static owner_cache_t hardlinks;
+
+/* files described by earlier archive entries: those in the archives named by
+   --since-archive (for 'c' command), which are applied in order, or those
+   whose contents later entries of the dedup extension can refer to (for
+   'x' command); open addressing with linear probing by path */
+typedef struct base_file {
+	char *path;	/* NULL if the slot is empty */
+	int type;	/* DELETED if a later archive deleted it; UNKNOWN if the
+			   slot only records a root or a pruned path */
+	unsigned long long size;	/* for regular files only */
+	long major, minor;	/* for devices only */
+	uid_t uid;
+	gid_t gid;
+	mode_t mode;
+	time_t mtime;
+	dev_t dev;
+	ino_t ino;
+	off_t offset;	/* for 'x': the contents' offset in standard input or -1 */
+	uint32_t checksum;	/* for 'x': the contents' checksum... */
+	char checksummed;	/* ...if this is nonzero */
+	char *linktarget;	/* for 'x': a symlink's target, for hard links */
+	char *linkedpath;	/* for 'x': the first hard link to the file if the
+				   file wasn't extracted and the link restored it */
+	char extracted;	/* for 'x': nonzero if the file was extracted */
+	char hasinode;	/* nonzero if dev and ino were archived */
+	char seen;	/* nonzero if the file was found while archiving */
+	char root;	/* nonzero if the path was given to the 'c' command */
+	char pruned;	/* nonzero if the walk skipped the path and its contents */
+} base_file_t;
+static base_file_t *basefiles;
+static size_t basefilescap, numbasefiles;	/* basefilescap is 0 or a power of two */
+static char differential;	/* nonzero if a --since-archive archive was read */
+
+/* how extracted files' owners are restored (for 'x' command) */
+enum { OWNER_DEFAULT, OWNER_SAME, OWNER_NONE };
+static int ownermode = OWNER_DEFAULT;
+static char numericowner;	/* nonzero to ignore User Name and Group Name */
+static uid_t euid;
+static gid_t egid;
+
+/* a string that isn't necessarily NUL-terminated, such as a line of an
+   archive in inbuf */
+typedef struct slice {
+	const char *ptr;
+	size_t len;
+} slice_t;
+
+/* the longest transformed key or file type that the parser compares;
+   transformkey() truncates longer strings, which never match */
+#define	KEY_MAX	31
 
 /* stdout identifying info (from fstat(2)) */
 static dev_t stdoutdev;
 static ino_t stdoutino;
 
-/* fseek(3) optimization (for 't' command) */
-int skip_file_data_fread(size_t lineno);
-int skip_file_data_fseek(size_t lineno);
-int (*skip_file_data)(size_t) = skip_file_data_fseek;
+/* archive input buffer (standard input); bytes inbuf[inpos..inend) have
+   been read from file descriptor 0 but not consumed yet */
+static char *inbuf;
+static size_t inbufcap, inpos, inend;
+static char ineof;
+static char inmapped;	/* nonzero if inbuf is stdin mapped with mmap(2) */
+static int inerrno;	/* errno of the last failed read(2); 0 if none */
+static int infd = STDIN_FILENO;	/* the archive being read */
+static const char *inname = "stdin";	/* infd's name for error messages */
+static char compressedinput;	/* nonzero if infd is gzip-compressed: stdin
+				   with -z or a file with a gzip header */
+
+/* lseek(2) optimization (for 't' command) */
+int skip_file_data_read(size_t lineno);
+int skip_file_data_seek(size_t lineno);
+int (*skip_file_data)(size_t) = skip_file_data_seek;
+
+/* zero-copy file contents input (for 'x' command) */
+ssize_t copy_input_read(int fd, size_t count);
+#ifdef	__linux__
+ssize_t copy_input_copy_range(int fd, size_t count);
+ssize_t copy_input_sendfile(int fd, size_t count);
+ssize_t copy_input_splice(int fd, size_t count);
+#endif	/* __linux__ */
+ssize_t (*copy_input)(int, size_t) = copy_input_read;
+
+/* zero-copy file contents output (for 'c' command) */
+int write_file_contents_read(const char *fname, int fd, off_t size, uint32_t *crc);
+int write_file_contents_mapped(const char *fname, int fd, off_t size, uint32_t *crc);
+#ifdef	__linux__
+int write_file_contents_copy_range(const char *fname, int fd, off_t size, uint32_t *crc);
+int write_file_contents_sendfile(const char *fname, int fd, off_t size, uint32_t *crc);
+int write_file_contents_splice(const char *fname, int fd, off_t size, uint32_t *crc);
+#endif	/* __linux__ */
+int (*write_file_contents)(const char *, int, off_t, uint32_t *) = write_file_contents_read;
+
+/* directory traversal (for 'c' command); each directory's entries are
+   archived in readdir order, by name, or by inode number (--sort) */
+enum { SORT_NONE, SORT_NAME, SORT_INODE };
+static int sortorder = SORT_NONE;
+static char *direntsbuf;	/* DIRENTS_BUFSIZE bytes */
+
+/* a data region of a file with holes (for the sparse extension) */
+typedef struct sparse_extent {
+	off_t offset;
+	off_t length;
+} sparse_extent_t;
+
+/* a file that is being added to the archive (for 'c' command) */
+typedef struct archive_entry {
+	char *path;
+	struct stat sb;
+	char *linktarget;	/* for symlinks only; 0 if readlink(2) failed */
+	char *hardlink;	/* an earlier path of the same file, or 0 */
+	char *contents;	/* for prefetched regular files only */
+	size_t contentslen;
+	size_t charge;	/* bytes counted against prefetchbudget */
+	int errnum;	/* errno from preparing the entry; 0 if none */
+	uint32_t checksum;	/* contents' CRC-32C (for checksum and dedup) */
+	sparse_extent_t *extents;	/* for sparse regular files only */
+	size_t numextents;
+	off_t datasize;	/* the extents' total length */
+	char sparse;	/* nonzero if extents describes the file's data */
+	char prefetch;	/* nonzero if a -j thread should read the contents */
+	char prefetched;	/* nonzero if contents holds the file's contents */
+	char prepared;	/* nonzero once prepare_entry() is done */
+	struct archive_entry *next;
+} archive_entry_t;
+
+/* parallel file reading (for 'c' command with -j); entries are written
+   from the head of the queue in traversal order while -j threads prepare
+   entries starting at queuenext */
+static long numjobs;	/* 0 if -j wasn't given */
+static size_t prefetchbudget = PREFETCH_BUDGET;
+static pthread_t *jobthreads;
+static pthread_mutex_t queuelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queuework = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queueprepared = PTHREAD_COND_INITIALIZER;
+static archive_entry_t *queuehead, *queuetail, *queuenext;
+static size_t queuelength, queuebytes;
+static char queueclosed;
+
+#ifdef	GZIP_SUPPORT
+/* archive compression (for -z); standard output is replaced by a stream
+   whose blocks are compressed by compression threads into independent gzip
+   members, which are written in order.  Each member's header has an extra
+   field ("PT") holding the member's length so that readers can find member
+   boundaries without decompressing anything. */
+#define	GZIP_HEADER_SIZE	20
+#define	GZIP_TRAILER_SIZE	8
+typedef struct compress_block {
+	char *data;
+	size_t len;
+	unsigned char *member;	/* the gzip member once done is set */
+	size_t memberlen;
+	char done;
+	struct compress_block *next;
+} compress_block_t;
+static char gzipoption;	/* nonzero if -z was given */
+static long numcompressjobs;
+static pthread_t *compressthreads;
+static pthread_mutex_t compresslock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compresswork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t compressdone = PTHREAD_COND_INITIALIZER;
+static compress_block_t *compresshead, *compresstail, *compressnext, *compresscurrent;
+static size_t compresslength;
+static char compressclosed, compressstarted;
+
+/* decompression of the archive being read (see compressedinput) */
+static z_stream instream;
+static unsigned char *inraw;	/* compressed bytes read from infd */
+static char inraweof;	/* nonzero once infd reached end-of-file */
+static char inmember;	/* nonzero if a gzip member is incomplete */
+static unsigned long long inoffset;	/* the decompressed offset of inend */
+
+/* the gzip members of a compressed regular file written by ptar, which
+   permit seeking: each one's offset in the file and the decompressed
+   offset of its first byte, followed by the end of the file and the
+   decompressed size; empty if the input can't seek */
+typedef struct gzip_member {
+	off_t offset;
+	unsigned long long start;
+} gzip_member_t;
+static gzip_member_t *inmembers;
+static size_t numinmembers;
+
+int write_fully(int fd, const char *buffer, size_t count);
+int skip_input(size_t lineno, size_t count);
+void write_compressed(const char *buffer, size_t size);
+size_t consume_buffered_input(size_t count);
+#endif	/* GZIP_SUPPORT */
+
+/* a directory entry read by read_directory() */
+typedef struct walk_entry {
+	char *path;
+	unsigned long long ino;
+	char maybedir;	/* zero if the directory says it's another type */
+} walk_entry_t;
+
+/* a file found by walk_directory() */
+typedef struct walk_node {
+	char *path;
+	struct stat sb;
+	int errnum;	/* from lstat(2) or statx(2) */
+	int fd;	/* -1 unless the file was opened to read its contents */
+	int result;	/* of the node's last io_uring operation */
+	char *contents;	/* if the file was read */
+} walk_node_t;
+
+#ifdef	__linux__
+/* the records that getdents64(2) reads */
+typedef struct linux_dirent64 {
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+} linux_dirent64_t;
+#endif	/* __linux__ */
+
+#ifdef	IO_URING_SUPPORT
+
+/* the io_uring rings used by walk_directory() and extract_batched_files() */
+static char walkuring;	/* nonzero if walk_directory() can use io_uring */
+static int uringfd = -1;
+static unsigned long long uringops;	/* a bit for each supported opcode */
+static char *uringrings;
+static size_t uringringslen;
+static struct io_uring_sqe *uringsqes;
+static struct io_uring_cqe *uringcqes;
+static unsigned *uringsqtail, *uringsqmask, *uringsqarray, *uringcqhead, *uringcqtail, *uringcqmask;
+static unsigned uringpending;	/* entries prepared but not yet submitted */
+static struct statx uringstatx[URING_ENTRIES];
+#endif	/* IO_URING_SUPPORT */
+
+/* a file that is being extracted (for 'x' command) */
+typedef struct extract_entry {
+	char *path;
+	int type;	/* see the file type IDs above */
+	char *linktarget;	/* for symlinks and hard links only */
+	long major, minor;	/* for devices only */
+	uid_t uid;
+	gid_t gid;
+	mode_t mode;
+	time_t mtime;
+	size_t size;	/* for regular files only */
+	size_t lineno;	/* the line number of the file contents marker */
+	char *contents;	/* regular file contents held in memory, or... */
+	off_t offset;	/* ...their offset in standard input; -1 if they're
+			   streamed from standard input by extract_file_contents() */
+	uint32_t checksum;	/* the contents' expected CRC-32C, if... */
+	char checksummed;	/* ...this is nonzero */
+	const char *source;	/* or an extracted file with the same contents */
+	sparse_extent_t *extents;	/* where the contents go if the file is
+					   sparse; NULL otherwise */
+	size_t numextents;
+	off_t sparsesize;	/* the sparse file's size */
+	char mapped;	/* nonzero if contents points into the mapped inbuf */
+	char chown;	/* nonzero if the file's owner must be set */
+	size_t charge;	/* bytes counted against prefetchbudget */
+	struct extract_entry *next;	/* the next entry in the queue */
+	struct extract_entry *nextbusy;	/* the next entry in the busy bucket */
+} extract_entry_t;
+
+/* parallel extraction (for 'x' command with -j); entries are queued in
+   archive order and restored in any order by -j threads, but an entry
+   isn't queued while its path or one of its ancestors is busy */
+#ifndef	BUSY_BUCKETS
+#define	BUSY_BUCKETS	1024
+#endif	/* BUSY_BUCKETS */
+static extract_entry_t *extracthead, *extracttail;
+static extract_entry_t *busypaths[BUSY_BUCKETS];
+static char extractfailed;
+static char seekableinput;	/* nonzero if -j threads can pread(2) stdin */
+
+/* directories whose modification times are set after extraction because
+   extracting their contents would change them */
+typedef struct deferred_directory {
+	char *path;
+	time_t mtime;
+} deferred_directory_t;
+static deferred_directory_t *deferreddirs;
+static size_t numdeferreddirs, deferreddirscap;
+
+/* open parent directories of extracted files (for 'x' command); a
+   directory is closed when its slot is needed and no thread is using it */
+typedef struct dir_handle {
+	char *path;	/* NULL if the slot is unused */
+	size_t len;
+	int fd;
+	int users;	/* the number of restore_file() calls using fd */
+	char stale;	/* nonzero if fd must be closed once it's unused */
+	char uncached;	/* nonzero if this isn't a dirhandles slot */
+	unsigned long lastuse;
+} dir_handle_t;
+static dir_handle_t dirhandles[DIRFD_CACHE_SIZE];
+static unsigned long dirclock;
+static pthread_mutex_t dirlock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef	IO_URING_SUPPORT
+/* small regular files that are extracted together by io_uring when -j
+   isn't given (see extract_batched_files()) */
+typedef struct batch_file {
+	extract_entry_t *e;
+	size_t hash;	/* of e->path */
+	dir_handle_t *handle;
+	int dirfd;
+	const char *name;	/* within e->path */
+	int unlinked;	/* unlinkat(2)'s result */
+	int result;	/* the last operation's result */
+	int fd;
+	int errnum;	/* the first error, which is reported in archive order */
+} batch_file_t;
+#define	BATCH_MAX_FILES	(URING_ENTRIES / 2)
+static batch_file_t batchfiles[BATCH_MAX_FILES];
+static size_t numbatchfiles, batchbytes;
+static char batchextract;	/* nonzero if io_uring can extract files */
+static char iouringoption;	/* nonzero if --io-uring was given */
+static char nouringoption;	/* nonzero if --no-io-uring was given */
+#endif	/* IO_URING_SUPPORT */
+
+/* a set of shell wildcard patterns compiled by compile_patterns(): patterns
+   without special characters are in a hash set, and the rest are grouped
+   by the literal prefix that comes before their first special character */
+typedef struct pattern {
+	char *text;
+	size_t prefixlen;	/* the length before the first special character */
+	char found;	/* for requested files */
+} pattern_t;
+typedef struct pattern_prefix {
+	const char *prefix;	/* the start of a pattern (not terminated) */
+	size_t len;
+	size_t parent;	/* the longest shorter prefix of this one */
+	size_t firstpattern, numpatterns;	/* in prefixpatterns */
+} pattern_prefix_t;
+#define	NO_PREFIX	((size_t)-1)
+typedef struct pattern_set {
+	pattern_t *patterns;	/* in the order they were given */
+	size_t count, cap;
+	pattern_t **literalslots;	/* NULL if the slot is empty */
+	size_t literalcap;
+	pattern_prefix_t *prefixes;	/* sorted by prefix */
+	size_t numprefixes;
+	pattern_t **prefixpatterns;	/* by prefix, then order */
+} pattern_set_t;
 
 /* file selection (for 'x' command) */
-typedef struct requested_file {
-	char *path_pattern;
-	char found;
-} requested_file_t;
 int extract_if_requested_file(const char *file_path);
 int (*should_extract_file)(const char *);
-requested_file_t *requested_files;
-size_t num_requested_files;
-size_t requested_files_cap;
+static pattern_set_t requestedfiles;
+static size_t lastrequestedline;	/* the last requested entry's first line
+					   if the index lists them, or 0 */
 
-/* file entry metadata */
+/* files that aren't archived (for 'c' command) */
+static pattern_set_t excludes;
+static char onefilesystem;	/* nonzero if --one-file-system was given */
+static dev_t walkdev;	/* the file system that's being walked */
+static char filesremoved;	/* nonzero if files vanished while they were
+				   being archived */
+
+/* file entry metadata; the strings' buffers are reused by later entries */
 static char *fpath;
 static int ftype = UNKNOWN;	/* see the enum above */
 static size_t fsize;	/* for regular files only */
-static char *flinktarget;	/* for symlinks only; 0 if not given */
+static char *flinktarget;	/* for symlinks only */
 static long fmajor = -1;	/* for devices only; -1 if not given */
 static long fminor = -1;	/* for devices only; -1 if not given */
-static char *fusername;	/* 0 if not given */
-static char *fgroupname;	/* 0 if not given */
+static char *fusername;
+static char *fgroupname;
 static uid_t fuid;
 static gid_t fgid;
 static mode_t fmode;
 static time_t fmtime;
+static dev_t fdev;	/* for the incremental extension only */
+static ino_t fino;	/* for the incremental extension only */
+static uint32_t fchecksum;	/* for the checksum extension only */
+static char *fsamecontents;	/* for the dedup extension only */
+static off_t fsparsesize;	/* for the sparse extension only */
+static sparse_extent_t *fextents;	/* for the sparse extension only */
+static size_t fnumextents, fextentscap;
+static size_t fpathcap, flinktargetcap, fusernamecap, fgroupnamecap, fsamecontentscap;
 
 /* nonzero if specified, 0 otherwise */
-static char fsizegiven, fuidgiven, fgidgiven, fmodegiven, fmtimegiven;
+static char fpathgiven, flinktargetgiven, fusernamegiven, fgroupnamegiven, fsamecontentsgiven;
+static char fsizegiven, fuidgiven, fgidgiven, fmodegiven, fmtimegiven, fdevgiven, finogiven, fchecksumgiven;
+static char fsparsesizegiven, fsparsemapgiven;
+
+/* the checksum extension's Content Checksum line normally follows an
+   entry's contents.  If it couldn't be read before them (from a pipe or
+   compressed input), then checksumfollows is set, and the CRC-32C of the
+   contents that were read from the stream is saved in contentscrc to be
+   checked once it is. */
+static char checksumfollows, contentscrcknown;
+static uint32_t contentscrc;
 
 char *safe_strdup(const char *s) {
 	char *ret;
@@ -88,30 +678,30 @@ char *safe_strdup(const char *s) {
 	return ret;
 }
 
-long open_max(void) {
-	if (openmax == 0) {
-		errno = 0;
-		if ((openmax = sysconf(_SC_OPEN_MAX)) < 0) {
-			if (errno == 0) {
-				openmax = 256;
-			} else {
-				perror("error: couldn't determine maximum number of open files");
-				exit(EXIT_FAILURE);
-			}
-		}
-	}
-	return openmax;
+/* The metadata format is ASCII-based, so metadata is classified with these
+   rather than with <ctype.h>, whose results depend on the locale (and
+   would disagree with the scan_key_*() vector versions). */
+int isasciialnum(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+int isasciispace(char c) {
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+char toasciilower(char c) {
+	return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
 }
 
 int isvalidkeychar(char c) {
-	return isalnum((unsigned char)c) || c == ' ' || c == '-' || c == '_';
+	return isasciialnum(c) || c == ' ' || c == '-' || c == '_';
 }
 
-int isvalidkey(const char *start) {
-	if (!isalnum((unsigned char)*start)) {
+int isvalidkey(const char *start, size_t len) {
+	if (len == 0 || !isasciialnum(*start)) {
 		return 0;
 	}
-	for (start++; *start != ':' && *start != '\0'; start++) {
+	for (start++, len--; len > 0; start++, len--) {
 		if (!isvalidkeychar(*start)) {
 			return 0;
 		}
@@ -119,709 +709,5381 @@ int isvalidkey(const char *start) {
 	return 1;
 }
 
-int haskey(const char *line) {
-	return strchr(line, ':') != NULL && isvalidkey(line);
-}
+/* Store str without spaces and in lowercase in key, which must hold
+   KEY_MAX + 1 bytes.  Returns the length of key. */
+size_t transformkey(slice_t str, char *key) {
+	size_t len;
 
-void transformkey(char *start) {
-	char *next;
-	for (next = start; *start != '\0'; start++, next++) {
-		while (isspace((unsigned char)*next) && *next != '\0') {
-			next++;
+	for (len = 0; str.len > 0 && len < KEY_MAX; str.ptr++, str.len--) {
+		if (!isasciispace(*str.ptr)) {
+			key[len++] = toasciilower(*str.ptr);
 		}
-		*start = tolower(*next);
 	}
+	key[len] = '\0';
+	return len;
 }
 
-char *trim(char *str) {
-	size_t len;
+/* the transformed metadata key names, indexed by key ID */
+static const char *keynames[] = {
+	NULL, NULL, "path", "type", "filesize", "linktarget", "major", "minor",
+	"username", "userid", "groupname", "groupid", "permissions", "modificationtime",
+	"metadataencoding", "extensions", "archivecreationdate", "indexentry", "indexoffset",
+	"device", "inode", "contentchecksum", "samecontentsas", "sparsesize", "sparsemap"
+};
+
+/* Map a transformed key of length len to its key ID (KEY_UNKNOWN if it
+   isn't recognized).  Its length and first characters select the only
+   candidate, which is then compared once. */
+int lookup_key(const char *key, size_t len) {
+	int id;
+
+	switch (len) {
+	case 4:
+		id = key[0] == 'p' ? KEY_PATH : KEY_TYPE;
+		break;
+	case 5:
+		id = key[0] == 'i' ? KEY_INODE : key[1] == 'a' ? KEY_MAJOR : KEY_MINOR;
+		break;
+	case 6:
+		id = key[0] == 'd' ? KEY_DEVICE : KEY_USERID;
+		break;
+	case 7:
+		id = KEY_GROUPID;
+		break;
+	case 8:
+		id = key[0] == 'f' ? KEY_FILESIZE : KEY_USERNAME;
+		break;
+	case 9:
+		id = key[0] == 's' ? KEY_SPARSEMAP : KEY_GROUPNAME;
+		break;
+	case 10:
+		id = key[0] == 'l' ? KEY_LINKTARGET : key[0] == 'e' ? KEY_EXTENSIONS : key[0] == 's' ? KEY_SPARSESIZE : KEY_INDEXENTRY;
+		break;
+	case 11:
+		id = key[0] == 'p' ? KEY_PERMISSIONS : KEY_INDEXOFFSET;
+		break;
+	case 14:
+		id = KEY_SAMECONTENTSAS;
+		break;
+	case 15:
+		id = KEY_CONTENTCHECKSUM;
+		break;
+	case 16:
+		id = key[1] == 'o' ? KEY_MODIFICATIONTIME : KEY_METADATAENCODING;
+		break;
+	case 19:
+		id = KEY_ARCHIVECREATIONDATE;
+		break;
+	default:
+		return KEY_UNKNOWN;
+	}
+	return memcmp(key, keynames[id], len) == 0 ? id : KEY_UNKNOWN;
+}
 
-	while (isspace((unsigned char)*str)) {
-		str++;
+slice_t trim(slice_t str) {
+	while (str.len > 0 && isasciispace(*str.ptr)) {
+		str.ptr++;
+		str.len--;
 	}
-	if (*str != '\0') {
-		len = strlen(str);
-		for (len--; isspace((unsigned char)str[len]); len--) {
-			str[len] = '\0';
-		}
+	while (str.len > 0 && isasciispace(str.ptr[str.len - 1])) {
+		str.len--;
 	}
 	return str;
 }
 
-int parsemetadata(char *line, char **key, char **value) {
-	char *colon;
+/* The scan_key_*() functions look for a metadata key at the start of the
+   len bytes at line.  If the line starts with a valid key followed by a
+   colon, then the key is stored without spaces and in lowercase in key
+   (which must hold KEY_MAX + 1 bytes), its length is stored in *keylen, and
+   the colon's offset is returned.  Otherwise NOKEY is returned.  The vector
+   versions classify a block of bytes at a time and are chosen at run time
+   by select_scan_key(). */
+#define	NOKEY	((size_t)-1)
 
-	colon = strchr(line, ':');
-	if (colon && isvalidkey(line)) {
-		*colon = '\0';
-		*value = trim(colon + 1);
-		transformkey(line);
-		*key = line;
-		return 0;
-	}
-	colon = trim(line);
-	if (*colon != '\0') {
-		*key = NULL;
-		*value = colon;
-		return 0;
+size_t scan_key_scalar(const char *line, size_t len, char *key, size_t *keylen) {
+	const char *colon;
+	slice_t keyslice;
+
+	if ((colon = memchr(line, ':', len)) == NULL || !isvalidkey(line, colon - line)) {
+		return NOKEY;
 	}
-	return 1;
+	keyslice.ptr = line;
+	keyslice.len = colon - line;
+	*keylen = transformkey(keyslice, key);
+	return keyslice.len;
 }
 
-void write_error(void) {
-	(void) fprintf(stderr, "error: couldn't write to standard output: %s\n", strerror(errno));
-	exit(EXIT_FAILURE);
-}
+#ifdef	SIMD_SCAN
+/* the smallest page size that a vector load mustn't cross when it reads past
+   the end of a line */
+#define	SCAN_PAGE_SIZE	4096
 
-void printline(const char *line) {
-	if (fprintf(stdout, "%s\n", line) < 0) {
-		write_error();
+/* Append the first n bytes of block (a lowercased piece of a key) to key,
+   which already holds keylen bytes, skipping the bytes whose bits are set
+   in spaces.  Returns the new length of key. */
+size_t append_key_block(char *key, size_t keylen, const char *block, size_t n, unsigned int spaces) {
+	size_t i;
+
+	if (spaces == 0) {
+		if (n > KEY_MAX - keylen) {
+			n = KEY_MAX - keylen;
+		}
+		(void) memcpy(key + keylen, block, n);
+		return keylen + n;
+	}
+	for (i = 0; i < n && keylen < KEY_MAX; i++) {
+		if (!(spaces & (1u << i))) {
+			key[keylen++] = block[i];
+		}
 	}
+	return keylen;
 }
 
-void write_metadata(const char *key, const char *value) {
-	if (fprintf(stdout, "%s:\t%s\n", key, value) < 0) {
-		write_error();
+__attribute__((target("sse2")))
+size_t scan_key_sse2(const char *line, size_t len, char *key, size_t *keylen) {
+	char tail[16], lowered[16];
+	__m128i bytes, alpha, digit, space, valid;
+	unsigned int colons, invalid, keymask;
+	size_t offset, n, length;
+
+	if (len == 0 || !isasciialnum(*line)) {
+		return NOKEY;
+	}
+	for (offset = 0, length = 0; offset < len; offset += 16) {
+		if ((n = len - offset) >= 16 || ((uintptr_t)(line + offset) & (SCAN_PAGE_SIZE - 1)) <= SCAN_PAGE_SIZE - 16) {
+			/* reading past the line is safe within its page */
+			n = n < 16 ? n : 16;
+			bytes = _mm_loadu_si128((const __m128i *)(line + offset));
+		} else {
+			(void) memset(tail, 0, sizeof (tail));
+			(void) memcpy(tail, line + offset, n);
+			bytes = _mm_loadu_si128((const __m128i *)tail);
+		}
+		alpha = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+		alpha = _mm_and_si128(_mm_cmpgt_epi8(alpha, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(alpha, _mm_set1_epi8('z' + 1)));
+		digit = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
+		space = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '));
+		valid = _mm_or_si128(_mm_or_si128(alpha, digit), _mm_or_si128(space,
+		    _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('-')), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('_')))));
+		colons = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(':'))) & ((1u << n) - 1);
+		if (colons != 0) {
+			n = __builtin_ctz(colons);
+		}
+		keymask = (1u << n) - 1;
+		invalid = ~(unsigned int)_mm_movemask_epi8(valid) & keymask;
+		if (invalid != 0) {
+			return NOKEY;
+		}
+		_mm_storeu_si128((__m128i *)lowered, _mm_or_si128(bytes, _mm_and_si128(alpha, _mm_set1_epi8(0x20))));
+		length = append_key_block(key, length, lowered, n, (unsigned int)_mm_movemask_epi8(space) & keymask);
+		if (colons != 0) {
+			key[length] = '\0';
+			*keylen = length;
+			return offset + n;
+		}
 	}
+	return NOKEY;
 }
 
-void write_numeric_metadata(const char *key, unsigned long long value) {
-	if (fprintf(stdout, "%s:\t%llu\n", key, value) < 0) {
-		write_error();
+__attribute__((target("avx2")))
+size_t scan_key_avx2(const char *line, size_t len, char *key, size_t *keylen) {
+	char tail[32], lowered[32];
+	__m256i bytes, alpha, digit, space, valid;
+	unsigned int colons, invalid, keymask;
+	size_t offset, n, length;
+
+	if (len == 0 || !isasciialnum(*line)) {
+		return NOKEY;
+	}
+	for (offset = 0, length = 0; offset < len; offset += 32) {
+		if ((n = len - offset) >= 32 || ((uintptr_t)(line + offset) & (SCAN_PAGE_SIZE - 1)) <= SCAN_PAGE_SIZE - 32) {
+			n = n < 32 ? n : 32;
+			bytes = _mm256_loadu_si256((const __m256i *)(line + offset));
+		} else {
+			(void) memset(tail, 0, sizeof (tail));
+			(void) memcpy(tail, line + offset, n);
+			bytes = _mm256_loadu_si256((const __m256i *)tail);
+		}
+		alpha = _mm256_or_si256(bytes, _mm256_set1_epi8(0x20));
+		alpha = _mm256_and_si256(_mm256_cmpgt_epi8(alpha, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), alpha));
+		digit = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), bytes));
+		space = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' '));
+		valid = _mm256_or_si256(_mm256_or_si256(alpha, digit), _mm256_or_si256(space,
+		    _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('-')), _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('_')))));
+		colons = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(':')));
+		if (n < 32) {
+			colons &= (1u << n) - 1;
+		}
+		if (colons != 0) {
+			n = __builtin_ctz(colons);
+		}
+		keymask = n < 32 ? (1u << n) - 1 : ~0u;
+		invalid = ~(unsigned int)_mm256_movemask_epi8(valid) & keymask;
+		if (invalid != 0) {
+			return NOKEY;
+		}
+		_mm256_storeu_si256((__m256i *)lowered, _mm256_or_si256(bytes, _mm256_and_si256(alpha, _mm256_set1_epi8(0x20))));
+		length = append_key_block(key, length, lowered, n, (unsigned int)_mm256_movemask_epi8(space) & keymask);
+		if (colons != 0) {
+			key[length] = '\0';
+			*keylen = length;
+			return offset + n;
+		}
 	}
+	return NOKEY;
 }
+#endif	/* SIMD_SCAN */
 
-void write_octal_metadata(const char *key, unsigned int value) {
-	if (fprintf(stdout, "%s:\t%.7o\n", key, value) < 0) {
-		write_error();
+size_t (*scan_key)(const char *, size_t, char *, size_t *) = scan_key_scalar;
+
+/* Use the widest scan_key_*() function that the CPU supports. */
+void select_scan_key(void) {
+#ifdef	SIMD_SCAN
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scan_key = scan_key_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		scan_key = scan_key_sse2;
 	}
+#endif	/* SIMD_SCAN */
 }
 
-void write_blank(void) {
-	if (fputc('\n', stdout) == EOF) {
-		write_error();
+/* CRC-32C (Castagnoli), which x86-64 (SSE4.2) and ARMv8 compute in hardware.
+   crc32c(crc, buffer, len) extends crc, the CRC of earlier bytes (0 if there
+   are none), with len more bytes. */
+#define	CRC32C_POLYNOMIAL	0x82f63b78	/* reversed */
+static uint32_t crc32ctable[8][256];	/* for slicing-by-8 */
+#ifdef	HARDWARE_CRC32C
+static uint32_t crc32clong[4][256];	/* shift a CRC past CRC32C_LONG zeros */
+static uint32_t crc32cshort[4][256];	/* shift a CRC past CRC32C_SHORT zeros */
+#endif	/* HARDWARE_CRC32C */
+uint32_t crc32c_sw(uint32_t crc, const char *buffer, size_t len);
+uint32_t (*crc32c)(uint32_t, const char *, size_t) = crc32c_sw;
+
+uint32_t crc32c_sw(uint32_t crc, const char *buffer, size_t len) {
+	const unsigned char *next;
+	uint32_t high;
+
+	next = (const unsigned char *)buffer;
+	crc = ~crc;
+	for (; len >= 8; len -= 8, next += 8) {
+		crc ^= next[0] | (uint32_t)next[1] << 8 | (uint32_t)next[2] << 16 | (uint32_t)next[3] << 24;
+		high = next[4] | (uint32_t)next[5] << 8 | (uint32_t)next[6] << 16 | (uint32_t)next[7] << 24;
+		crc = crc32ctable[7][crc & 0xff] ^ crc32ctable[6][(crc >> 8) & 0xff] ^ crc32ctable[5][(crc >> 16) & 0xff] ^ crc32ctable[4][crc >> 24]
+		    ^ crc32ctable[3][high & 0xff] ^ crc32ctable[2][(high >> 8) & 0xff] ^ crc32ctable[1][(high >> 16) & 0xff] ^ crc32ctable[0][high >> 24];
+	}
+	for (; len > 0; len--) {
+		crc = (crc >> 8) ^ crc32ctable[0][(crc ^ *next++) & 0xff];
 	}
+	return ~crc;
 }
 
-void write_divider(void) {
-	if (fputs("---\n", stdout) == EOF) {
-		write_error();
+#ifdef	HARDWARE_CRC32C
+/* Multiply the 32x32 GF(2) matrix matrix by vector. */
+uint32_t gf2_matrix_times(const uint32_t *matrix, uint32_t vector) {
+	uint32_t sum;
+
+	for (sum = 0; vector != 0; vector >>= 1, matrix++) {
+		if (vector & 1) {
+			sum ^= *matrix;
+		}
 	}
+	return sum;
 }
 
-int add_file(const char *fname, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
-	FILE *fp;
-	struct passwd *passwordinfo;
-	struct group *groupinfo;
-	char buffer[WRITE_BLOCKSIZE];
-	size_t numread;
+/* Fill table with the operator that feeds len (a power of two) zero bytes
+   to a CRC, so that the CRC of A followed by B is
+   crc32c_shift(table, CRC of A) ^ (CRC of B starting from 0) if B has len
+   bytes (without the CRC's pre- and post-conditioning). */
+void crc32c_zeros(uint32_t table[4][256], size_t len) {
+	uint32_t op[32], square[32];
+	size_t n, k;
 
-	/* skip the file if it's the same as stdout (avoids infinite loops) or
-	   the file is the current directory (avoids an unnecessary entry) */
-	if ((sb->st_dev == stdoutdev && sb->st_ino == stdoutino) || strcmp(fname, ".") == 0) {
-		return 0;
+	/* the operator for one zero bit, then square it until it's for len
+	   bytes */
+	op[0] = CRC32C_POLYNOMIAL;
+	for (n = 1; n < 32; n++) {
+		op[n] = (uint32_t)1 << (n - 1);
+	}
+	for (len *= 8; len > 1; len >>= 1) {
+		for (n = 0; n < 32; n++) {
+			square[n] = gf2_matrix_times(op, op[n]);
+		}
+		(void) memcpy(op, square, sizeof (op));
 	}
+	for (k = 0; k < 4; k++) {
+		for (n = 0; n < 256; n++) {
+			table[k][n] = gf2_matrix_times(op, (uint32_t)n << (k * 8));
+		}
+	}
+}
 
-	if (verbose) {
-		if (fprintf(stderr, "%s\n", fname) < 0) {
-			perror("stderr");
-			return 1;
+uint32_t crc32c_shift(uint32_t table[4][256], uint32_t crc) {
+	return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^ table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+#ifdef	__x86_64__
+#define	CRC32C_BYTE(crc, next)	_mm_crc32_u8((crc), *(next))
+#define	CRC32C_WORD(crc, next)	_mm_crc32_u64((crc), load_word(next))
+#else
+#define	CRC32C_BYTE(crc, next)	__crc32cb((crc), *(next))
+#define	CRC32C_WORD(crc, next)	__crc32cd((crc), load_word(next))
+#endif	/* __x86_64__ */
+
+uint64_t load_word(const unsigned char *next) {
+	uint64_t word;
+
+	(void) memcpy(&word, next, sizeof (word));
+	return word;
+}
+
+/* Compute three streams at once, then combine them with crc32c_shift(). */
+#ifdef	__x86_64__
+__attribute__((target("sse4.2")))
+#endif	/* __x86_64__ */
+uint32_t crc32c_hw(uint32_t crc, const char *buffer, size_t len) {
+	const unsigned char *next, *end;
+	uint64_t crc0, crc1, crc2;
+
+	next = (const unsigned char *)buffer;
+	crc0 = ~crc;
+	for (; len > 0 && ((uintptr_t)next & 7) != 0; len--, next++) {
+		crc0 = CRC32C_BYTE(crc0, next);
+	}
+	for (; len >= 3 * CRC32C_LONG; len -= 3 * CRC32C_LONG, next += 2 * CRC32C_LONG) {
+		crc1 = crc2 = 0;
+		for (end = next + CRC32C_LONG; next < end; next += 8) {
+			crc0 = CRC32C_WORD(crc0, next);
+			crc1 = CRC32C_WORD(crc1, next + CRC32C_LONG);
+			crc2 = CRC32C_WORD(crc2, next + 2 * CRC32C_LONG);
 		}
+		crc0 = crc32c_shift(crc32clong, crc32c_shift(crc32clong, crc0) ^ crc1) ^ crc2;
 	}
-	if ((passwordinfo = getpwuid(sb->st_uid)) == NULL || (groupinfo = getgrgid(sb->st_gid)) == NULL) {
-		perror(fname);
-		return 1;
+	for (; len >= 3 * CRC32C_SHORT; len -= 3 * CRC32C_SHORT, next += 2 * CRC32C_SHORT) {
+		crc1 = crc2 = 0;
+		for (end = next + CRC32C_SHORT; next < end; next += 8) {
+			crc0 = CRC32C_WORD(crc0, next);
+			crc1 = CRC32C_WORD(crc1, next + CRC32C_SHORT);
+			crc2 = CRC32C_WORD(crc2, next + 2 * CRC32C_SHORT);
+		}
+		crc0 = crc32c_shift(crc32cshort, crc32c_shift(crc32cshort, crc0) ^ crc1) ^ crc2;
 	}
-	fp = NULL;
-	write_blank();
-	write_metadata("Path", fname);
-	if (S_ISREG(sb->st_mode)) {
-		write_metadata("Type", "Regular File");
-		write_numeric_metadata("File Size", sb->st_size);
-		if ((fp = fopen(fname, "r")) == NULL) {
-			perror(fname);
-			return 1;
+	for (; len >= 8; len -= 8, next += 8) {
+		crc0 = CRC32C_WORD(crc0, next);
+	}
+	for (; len > 0; len--, next++) {
+		crc0 = CRC32C_BYTE(crc0, next);
+	}
+	return ~(uint32_t)crc0;
+}
+#endif	/* HARDWARE_CRC32C */
+
+/* Build the CRC-32C tables and choose the fastest implementation. */
+void select_crc32c(void) {
+	uint32_t crc;
+	size_t n, k;
+
+	for (n = 0; n < 256; n++) {
+		for (crc = n, k = 0; k < 8; k++) {
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
 		}
-	} else if (S_ISDIR(sb->st_mode)) {
-		write_metadata("Type", "Directory");
-	} else if (S_ISLNK(sb->st_mode)) {
-		write_metadata("Type", "Symbolic Link");
-		if (readlink(fname, linkpath, sizeof (linkpath) - 1) == -1) {
-			perror(fname);
-			return 1;
+		crc32ctable[0][n] = crc;
+	}
+	for (n = 0; n < 256; n++) {
+		for (k = 1; k < 8; k++) {
+			crc32ctable[k][n] = (crc32ctable[k - 1][n] >> 8) ^ crc32ctable[0][crc32ctable[k - 1][n] & 0xff];
 		}
-		write_metadata("Link Target", linkpath);
-	} else if (S_ISCHR(sb->st_mode)) {
-		write_metadata("Type", "Character Device");
-		write_numeric_metadata("Major", major(sb->st_rdev));
-		write_numeric_metadata("Minor", minor(sb->st_rdev));
-	} else if (S_ISBLK(sb->st_mode)) {
-		write_metadata("Type", "Block Device");
-		write_numeric_metadata("Major", major(sb->st_rdev));
-		write_numeric_metadata("Minor", minor(sb->st_rdev));
-	} else if (S_ISFIFO(sb->st_mode)) {
-		write_metadata("Type", "FIFO");
-	} else if (S_ISSOCK(sb->st_mode)) {
-		write_metadata("Type", "Socket");
-	} else {
-		(void) fprintf(stderr, "%s: illegal file type\n", fname);
+	}
+#ifdef	HARDWARE_CRC32C
+#ifdef	__x86_64__
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("sse4.2")) {
+		return;
+	}
+#endif	/* __x86_64__ */
+	crc32c_zeros(crc32clong, CRC32C_LONG);
+	crc32c_zeros(crc32cshort, CRC32C_SHORT);
+	crc32c = crc32c_hw;
+#endif	/* HARDWARE_CRC32C */
+}
+
+/* Split line into a transformed key (stored in key, which must hold KEY_MAX
+   + 1 bytes) and a trimmed value.  *keyid is set to the key's ID, which is
+   KEY_NONE if the line has no valid key.  Returns 1 if the line is blank. */
+int parsemetadata(slice_t line, char *key, int *keyid, slice_t *value) {
+	size_t colon, keylen;
+
+	if ((colon = scan_key(line.ptr, line.len, key, &keylen)) != NOKEY) {
+		*keyid = lookup_key(key, keylen);
+		value->ptr = line.ptr + colon + 1;
+		value->len = line.len - colon - 1;
+		*value = trim(*value);
+		return 0;
+	}
+	*value = trim(line);
+	if (value->len > 0) {
+		*key = '\0';
+		*keyid = KEY_NONE;
+		return 0;
+	}
+	return 1;
+}
+
+/* Parse value, which must consist of digits in the given base (8, 10, or
+   16), into *number.  Returns nonzero if value isn't such a number or if
+   it's larger than max. */
+int parse_number(slice_t value, unsigned int base, unsigned long long max, unsigned long long *number) {
+	unsigned long long result;
+	unsigned int digit, c;
+	size_t n;
+
+	if (value.len == 0) {
 		return 1;
 	}
-	write_metadata("User Name", passwordinfo->pw_name);
-	write_numeric_metadata("User ID", sb->st_uid);
-	write_metadata("Group Name", groupinfo->gr_name);
-	write_numeric_metadata("Group ID", sb->st_gid);
-	write_octal_metadata("Permissions", sb->st_mode & ~S_IFMT);
-	write_numeric_metadata("Modification Time", sb->st_mtime);
-	if (fp) {
-		write_divider();
-		while (!feof(fp)) {
-			numread = fread(buffer, 1, sizeof (buffer), fp);
-			if (ferror(fp)) {
-				perror(fname);
-				return 1;
-			}
-			if (fwrite(buffer, 1, numread, stdout) != numread) {
-				perror(fname);
-				fclose(fp);
-				return 1;
-			}
+	for (result = 0, n = 0; n < value.len; n++) {
+		c = (unsigned char)value.ptr[n];
+		digit = c - '0' < 10 ? c - '0' : (c | 0x20) - 'a' < 26 ? (c | 0x20) - 'a' + 10 : base;
+		if (digit >= base || result > (max - digit) / base) {
+			return 1;
 		}
-		fclose(fp);
-		write_divider();
+		result = result * base + digit;
 	}
+	*number = result;
 	return 0;
 }
 
-int archive_file(const char *fname) {
-	struct stat sb;
+/* Parse a Content Checksum value, which is "crc32c:" followed by eight
+   hexadecimal digits. */
+int parse_checksum(slice_t value, uint32_t *checksum) {
+	unsigned long long number;
 
-	if (lstat(fname, &sb) != 0) {
-		perror(fname);
+	if (value.len != sizeof ("crc32c:") - 1 + 8 || strncasecmp(value.ptr, "crc32c:", sizeof ("crc32c:") - 1) != 0) {
 		return 1;
-	} else if (S_ISDIR(sb.st_mode)) {
-		return nftw(fname, add_file, open_max(), FTW_PHYS);
 	}
-	return add_file(fname, &sb, 0, NULL);
+	value.ptr += sizeof ("crc32c:") - 1;
+	value.len -= sizeof ("crc32c:") - 1;
+	if (parse_number(value, 16, 0xffffffff, &number) != 0) {
+		return 1;
+	}
+	*checksum = number;
+	return 0;
 }
 
-int handle_metadata(size_t lineno, char *key, char *value) {
-	char *end;
-
-	if (*value == '\0') {
-		(void) fprintf(stderr, "stdin:%zu: empty metadata values are not allowed\n", lineno);
+/* Report an error if the current entry's contents' CRC-32C isn't the one
+   that its Content Checksum specified. */
+int check_checksum(size_t lineno, const char *path, uint32_t expected, uint32_t crc) {
+	if (crc != expected) {
+		(void) fprintf(stderr, "%s:%zu: %s: contents don't match their checksum (expected crc32c:%08x, got crc32c:%08x)\n", inname, lineno, path, (unsigned int)expected, (unsigned int)crc);
 		return 1;
 	}
-	if (strcmp(key, "path") == 0) {
-		if (fpath) {
-			(void) fprintf(stderr, "stdin:%zu: file path already specified\n", lineno);
-			return 1;
-		}
-		fpath = safe_strdup(value);
-	} else if (strcmp(key, "type") == 0) {
-		if (ftype != UNKNOWN) {
-			(void) fprintf(stderr, "stdin:%zu: file type already specified\n", lineno);
-			return 1;
-		}
-		transformkey(value);
-		if (strcmp(value, "regularfile") == 0) {
-			ftype = REGULARFILE;
-		} else if (strcmp(value, "directory") == 0) {
-			ftype = DIRECTORY;
-		} else if (strcmp(value, "symboliclink") == 0) {
-			ftype = SYMLINK;
-		} else if (strcmp(value, "characterdevice") == 0) {
-			ftype = CHARDEVICE;
-		} else if (strcmp(value, "blockdevice") == 0) {
-			ftype = BLOCKDEVICE;
-		} else if (strcmp(value, "fifo") == 0) {
-			ftype = FIFO;
-		} else if (strcmp(value, "socket") == 0) {
-			ftype = SOCKET;
-		} else {
-			(void) fprintf(stderr, "stdin:%zu: unrecognized file type: %s\n", lineno, value);
-			return 1;
-		}
-	} else if (strcmp(key, "filesize") == 0) {
-		if (fsizegiven) {
-			(void) fprintf(stderr, "stdin:%zu: file size already specified\n", lineno);
-			return 1;
-		}
-		errno = 0;
-		fsize = strtoull(value, &end, 10);
-		if (errno != 0 || end == value || *end != '\0') {
-			(void) fprintf(stderr, "stdin:%zu: invalid file size: %s\n", lineno, value);
-			return 1;
-		}
-		fsizegiven = 1;
-	} else if (strcmp(key, "linktarget") == 0) {
-		if (flinktarget != NULL) {
-			(void) fprintf(stderr, "stdin:%zu: link target already specified\n", lineno);
-			return 1;
-		}
-		flinktarget = safe_strdup(value);
-	} else if (strcmp(key, "major") == 0) {
-		if (fmajor != -1) {
-			(void) fprintf(stderr, "stdin:%zu: major already specified\n", lineno);
-			return 1;
-		}
-		errno = 0;
-		fmajor = strtol(value, &end, 10);
-		if (errno != 0 || end == value || *end != '\0') {
-			(void) fprintf(stderr, "stdin:%zu: invalid major: %s\n", lineno, value);
+	return 0;
+}
+
+/* Check crc, the CRC-32C of the current entry's contents, which were read
+   from standard input, or save it if their checksum follows them. */
+int settle_checksum(size_t lineno, uint32_t crc) {
+	if (checksumfollows) {
+		contentscrc = crc;
+		contentscrcknown = 1;
+		return 0;
+	}
+	return fchecksumgiven && check_checksum(lineno, fpath, fchecksum, crc);
+}
+
+int slice_equals(slice_t str, const char *literal) {
+	return str.len == strlen(literal) && memcmp(str.ptr, literal, str.len) == 0;
+}
+
+/* Copy value into *buffer as a NUL-terminated string, growing the buffer
+   (whose size is *cap) if necessary. */
+void copy_slice(char **buffer, size_t *cap, slice_t value) {
+	if (value.len >= *cap && (*buffer = realloc(*buffer, *cap = value.len + 64)) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	(void) memcpy(*buffer, value.ptr, value.len);
+	(*buffer)[value.len] = '\0';
+}
+
+void write_error(void) {
+	(void) fprintf(stderr, "error: couldn't write to standard output: %s\n", strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+void printline(const char *line) {
+	if (fprintf(stdout, "%s\n", line) < 0) {
+		write_error();
+	}
+}
+
+/* The archive being created is written through outbuf rather than stdio:
+   Metadata is formatted directly into it, small files are read into it, and
+   it's written along with the next large piece of contents by a single
+   writev(2).  With -z, it's fed to the compression threads instead. */
+
+/* Write outbuf followed by the count bytes at bytes. */
+void flush_output_with(const char *bytes, size_t count) {
+	struct iovec iov[2];
+	ssize_t numwritten;
+	int n;
+
+#ifdef	GZIP_SUPPORT
+	if (gzipoption) {
+		write_compressed(outbuf, outlen);
+		write_compressed(bytes, count);
+		outlen = 0;
+		return;
+	}
+#endif	/* GZIP_SUPPORT */
+	iov[0].iov_base = outbuf;
+	iov[0].iov_len = outlen;
+	iov[1].iov_base = (char *)bytes;
+	iov[1].iov_len = count;
+	for (n = 0; ; ) {
+		while (n < 2 && iov[n].iov_len == 0) {
+			n++;
+		}
+		if (n == 2) {
+			break;
+		} else if ((numwritten = writev(STDOUT_FILENO, iov + n, 2 - n)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			write_error();
+		}
+		for (; n < 2 && (size_t)numwritten >= iov[n].iov_len; n++) {
+			numwritten -= iov[n].iov_len;
+		}
+		if (n < 2) {
+			iov[n].iov_base = (char *)iov[n].iov_base + numwritten;
+			iov[n].iov_len -= numwritten;
+		}
+	}
+	outlen = 0;
+}
+
+void flush_output(void) {
+	flush_output_with(NULL, 0);
+}
+
+/* Return space for the next count bytes of output (at most OUTPUT_BUFSIZE),
+   which the caller must fill. */
+char *reserve_output(size_t count) {
+	char *p;
+
+	if (count > OUTPUT_BUFSIZE - outlen) {
+		flush_output();
+	}
+	p = outbuf + outlen;
+	outlen += count;
+	outoffset += count;
+	return p;
+}
+
+void output_bytes(const char *bytes, size_t count) {
+	if (count >= OUTPUT_BUFSIZE / 2) {
+		/* don't copy large contents */
+		flush_output_with(bytes, count);
+		outoffset += count;
+	} else {
+		(void) memcpy(reserve_output(count), bytes, count);
+	}
+}
+
+/* Write value in decimal (without a NUL) and return its length. */
+size_t format_decimal(char *buffer, unsigned long long value) {
+	char digits[20], *p;
+
+	p = digits + sizeof (digits);
+	do {
+		*--p = '0' + value % 10;
+	} while ((value /= 10) != 0);
+	(void) memcpy(buffer, p, digits + sizeof (digits) - p);
+	return digits + sizeof (digits) - p;
+}
+
+/* Write value in octal with at least mindigits digits. */
+size_t format_octal(char *buffer, unsigned int value, int mindigits) {
+	char digits[24], *p;
+
+	p = digits + sizeof (digits);
+	do {
+		*--p = '0' + (value & 7);
+		value >>= 3;
+	} while (--mindigits > 0 || value != 0);
+	(void) memcpy(buffer, p, digits + sizeof (digits) - p);
+	return digits + sizeof (digits) - p;
+}
+
+void write_key_value(const char *key, const char *value, size_t len) {
+	size_t keylen;
+	char *p;
+
+	keylen = strlen(key);
+	if (keylen + len + 3 > OUTPUT_BUFSIZE) {
+		output_bytes(key, keylen);
+		output_bytes(":\t", 2);
+		output_bytes(value, len);
+		output_bytes("\n", 1);
+	} else {
+		p = reserve_output(keylen + len + 3);
+		(void) memcpy(p, key, keylen);
+		p[keylen] = ':';
+		p[keylen + 1] = '\t';
+		(void) memcpy(p + keylen + 2, value, len);
+		p[keylen + 2 + len] = '\n';
+	}
+	outlines++;
+}
+
+void write_metadata(const char *key, const char *value) {
+	write_key_value(key, value, strlen(value));
+}
+
+void write_numeric_metadata(const char *key, unsigned long long value) {
+	char digits[20];
+
+	write_key_value(key, digits, format_decimal(digits, value));
+}
+
+void write_octal_metadata(const char *key, unsigned int value) {
+	char digits[24];
+
+	write_key_value(key, digits, format_octal(digits, value, 7));
+}
+
+void write_blank(void) {
+	*reserve_output(1) = '\n';
+	outlines++;
+}
+
+void write_divider(void) {
+	(void) memcpy(reserve_output(4), "---\n", 4);
+	outlines++;
+}
+
+/* Read the next size bytes of the file into the output buffer, adding them
+   to *crc unless crc is NULL.  A file that shrank or grew since it was
+   statted is an error because its File Size was already written. */
+int write_file_contents_read(const char *fname, int fd, off_t size, uint32_t *crc) {
+	off_t numleft;
+	size_t count;
+	ssize_t numread;
+
+	for (numleft = size; ; numleft -= numread) {
+		if (OUTPUT_BUFSIZE - outlen < WRITE_BLOCKSIZE) {
+			flush_output();
+		}
+		/* ask for one byte more than is left to notice growing files */
+		count = numleft < (off_t)(OUTPUT_BUFSIZE - outlen) ? (size_t)numleft + 1 : OUTPUT_BUFSIZE - outlen;
+		if ((numread = read(fd, outbuf + outlen, count)) == 0) {
+			if (numleft > 0) {
+				(void) fprintf(stderr, "%s: file shrank while it was being archived\n", fname);
+				return 1;
+			}
+			return 0;
+		} else if (numread < 0) {
+			if (errno == EINTR) {
+				numread = 0;
+				continue;
+			}
+			perror(fname);
+			return 1;
+		} else if (numread > numleft) {
+			(void) fprintf(stderr, "%s: file grew while it was being archived\n", fname);
+			return 1;
+		} else if (crc != NULL) {
+			*crc = crc32c(*crc, outbuf + outlen, numread);
+		}
+		outlen += numread;
+		outoffset += numread;
+	}
+}
+
+/* where a SIGBUS raised by reading a mapped file that was truncated returns
+   to, while mappedactive is set */
+static sigjmp_buf mappedfault;
+static volatile sig_atomic_t mappedactive;
+
+void handle_mapped_fault(int sig) {
+	if (mappedactive) {
+		siglongjmp(mappedfault, 1);
+	}
+	(void) signal(sig, SIG_DFL);
+	(void) raise(sig);
+}
+
+/* Write the size bytes of the file and add them to *crc from a read-only
+   mapping, so that each byte is read once and copied once.  (The zero-copy
+   methods below can't checksum what they copy, and reading the file into
+   the output buffer copies it twice.)  Small files and files that can't be
+   mapped are read instead. */
+int write_file_contents_mapped(const char *fname, int fd, off_t size, uint32_t *crc) {
+	static char installed;
+	struct sigaction sa;
+	struct stat sb;
+	char *map;
+	volatile off_t offset;
+	size_t count;
+
+	if (size < ZEROCOPY_MIN_SIZE || (unsigned long long)size > SIZE_MAX || (map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		return write_file_contents_read(fname, fd, size, crc);
+	}
+	if (!installed) {
+		(void) memset(&sa, 0, sizeof (sa));
+		sa.sa_handler = handle_mapped_fault;
+		(void) sigemptyset(&sa.sa_mask);
+		(void) sigaction(SIGBUS, &sa, NULL);
+		installed = 1;
+	}
+	(void) madvise(map, size, MADV_SEQUENTIAL);
+	if (sigsetjmp(mappedfault, 1) != 0) {
+		/* the file was truncated under the mapping */
+		mappedactive = 0;
+		(void) munmap(map, size);
+		(void) fprintf(stderr, "%s: file shrank while it was being archived\n", fname);
+		return 1;
+	}
+	mappedactive = 1;
+	for (offset = 0; offset < size; offset += count) {
+		count = size - offset < CHECKSUM_BLOCKSIZE ? (size_t)(size - offset) : CHECKSUM_BLOCKSIZE;
+		*crc = crc32c(*crc, map + offset, count);
+		output_bytes(map + offset, count);
+	}
+	mappedactive = 0;
+	(void) munmap(map, size);
+	if (fstat(fd, &sb) != 0) {
+		perror(fname);
+		return 1;
+	} else if (sb.st_size != size) {
+		(void) fprintf(stderr, "%s: file %s while it was being archived\n", fname, sb.st_size < size ? "shrank" : "grew");
+		return 1;
+	}
+	return 0;
+}
+
+#ifdef	__linux__
+/* nonzero if errno indicates that the kernel can't move data between the
+   given descriptors without copying it through user space */
+int zerocopy_unsupported(void) {
+	return errno == ENOSYS || errno == EINVAL || errno == EXDEV || errno == EOPNOTSUPP || errno == EBADF || errno == ESPIPE;
+}
+
+/* Report an error and return nonzero if the file fname, which is open as
+   fd, shrank (numleft of its expected bytes weren't copied) or grew (it
+   has more bytes after them). */
+int finish_file_contents(const char *fname, int fd, off_t numleft) {
+	char byte;
+	ssize_t numread;
+
+	if (numleft > 0) {
+		(void) fprintf(stderr, "%s: file shrank while it was being archived\n", fname);
+		return 1;
+	}
+	while ((numread = read(fd, &byte, 1)) < 0 && errno == EINTR) {
+	}
+	if (numread < 0) {
+		perror(fname);
+		return 1;
+	} else if (numread > 0) {
+		(void) fprintf(stderr, "%s: file grew while it was being archived\n", fname);
+		return 1;
+	}
+	return 0;
+}
+
+/* The zero-copy methods below write directly to file descriptor 1, so the
+   metadata in the output buffer must be flushed first.  If a method isn't
+   supported, then the next method is used for the rest of this file and
+   all later files.  The file descriptor's offset tracks how much has been
+   copied, so falling back in the middle of a file is safe.  Contents that
+   are checksummed are mapped instead. */
+
+int write_file_contents_copy_range(const char *fname, int fd, off_t size, uint32_t *crc) {
+	off_t numleft;
+	ssize_t numcopied;
+
+	if (crc != NULL) {
+		return write_file_contents_mapped(fname, fd, size, crc);
+	} else if (size < ZEROCOPY_MIN_SIZE) {
+		return write_file_contents_read(fname, fd, size, NULL);
+	}
+	flush_output();
+	for (numleft = size; numleft > 0; numleft -= numcopied) {
+		if ((numcopied = copy_file_range(fd, NULL, STDOUT_FILENO, NULL, numleft < ZEROCOPY_BLOCKSIZE ? (size_t)numleft : ZEROCOPY_BLOCKSIZE, 0)) == 0) {
+			break;
+		} else if (numcopied < 0) {
+			if (errno == EINTR) {
+				numcopied = 0;
+				continue;
+			} else if (zerocopy_unsupported()) {
+				write_file_contents = write_file_contents_sendfile;
+				return write_file_contents_sendfile(fname, fd, numleft, NULL);
+			}
+			perror(fname);
+			return 1;
+		}
+		outoffset += numcopied;
+	}
+	return finish_file_contents(fname, fd, numleft);
+}
+
+int write_file_contents_sendfile(const char *fname, int fd, off_t size, uint32_t *crc) {
+	off_t numleft;
+	ssize_t numcopied;
+
+	if (crc != NULL) {
+		return write_file_contents_mapped(fname, fd, size, crc);
+	} else if (size < ZEROCOPY_MIN_SIZE) {
+		return write_file_contents_read(fname, fd, size, NULL);
+	}
+	flush_output();
+	for (numleft = size; numleft > 0; numleft -= numcopied) {
+		if ((numcopied = sendfile(STDOUT_FILENO, fd, NULL, numleft < ZEROCOPY_BLOCKSIZE ? (size_t)numleft : ZEROCOPY_BLOCKSIZE)) == 0) {
+			break;
+		} else if (numcopied < 0) {
+			if (errno == EINTR) {
+				numcopied = 0;
+				continue;
+			} else if (zerocopy_unsupported()) {
+				write_file_contents = write_file_contents_read;
+				return write_file_contents_read(fname, fd, numleft, NULL);
+			}
+			perror(fname);
+			return 1;
+		}
+		outoffset += numcopied;
+	}
+	return finish_file_contents(fname, fd, numleft);
+}
+
+int write_file_contents_splice(const char *fname, int fd, off_t size, uint32_t *crc) {
+	off_t numleft;
+	ssize_t numcopied;
+
+	if (crc != NULL) {
+		return write_file_contents_mapped(fname, fd, size, crc);
+	} else if (size < ZEROCOPY_MIN_SIZE) {
+		return write_file_contents_read(fname, fd, size, NULL);
+	}
+	flush_output();
+	for (numleft = size; numleft > 0; numleft -= numcopied) {
+		if ((numcopied = splice(fd, NULL, STDOUT_FILENO, NULL, numleft < ZEROCOPY_BLOCKSIZE ? (size_t)numleft : ZEROCOPY_BLOCKSIZE, SPLICE_F_MOVE)) == 0) {
+			break;
+		} else if (numcopied < 0) {
+			if (errno == EINTR) {
+				numcopied = 0;
+				continue;
+			} else if (zerocopy_unsupported()) {
+				write_file_contents = write_file_contents_read;
+				return write_file_contents_read(fname, fd, numleft, NULL);
+			}
+			perror(fname);
+			return 1;
+		}
+		outoffset += numcopied;
+	}
+	return finish_file_contents(fname, fd, numleft);
+}
+#endif	/* __linux__ */
+
+#ifdef	GZIP_SUPPORT
+void put_le32(unsigned char *p, uint32_t value) {
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+uint32_t get_le32(const unsigned char *p) {
+	return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Compress block b into a gzip member with stream, which is a raw deflate
+   stream. */
+void compress_block(z_stream *stream, compress_block_t *b) {
+	unsigned char *trailer;
+	size_t bound;
+
+	(void) deflateReset(stream);
+	bound = deflateBound(stream, b->len);
+	if ((b->member = malloc(GZIP_HEADER_SIZE + bound + GZIP_TRAILER_SIZE)) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	/* ID1, ID2, CM (deflate), FLG (FEXTRA), MTIME, XFL, OS (Unix), XLEN,
+	   and the PT subfield's ID and length, which precede the member's
+	   length */
+	(void) memcpy(b->member, "\x1f\x8b\x08\x04\0\0\0\0\0\x03\x08\0PT\x04\0", GZIP_HEADER_SIZE - 4);
+	stream->next_in = (unsigned char *)b->data;
+	stream->avail_in = b->len;
+	stream->next_out = b->member + GZIP_HEADER_SIZE;
+	stream->avail_out = bound;
+	if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+		abort();
+	}
+	trailer = stream->next_out;
+	put_le32(trailer, crc32(0, (unsigned char *)b->data, b->len));
+	put_le32(trailer + 4, b->len);
+	b->memberlen = trailer + GZIP_TRAILER_SIZE - b->member;
+	put_le32(b->member + GZIP_HEADER_SIZE - 4, b->memberlen);
+	free(b->data);
+	b->data = NULL;
+}
+
+/* the body of each compression thread */
+void *compress_blocks(void *unused) {
+	compress_block_t *b;
+	z_stream stream;
+
+	(void) memset(&stream, 0, sizeof (stream));
+	if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	(void) pthread_mutex_lock(&compresslock);
+	for (;;) {
+		while (compressnext == NULL && !compressclosed) {
+			(void) pthread_cond_wait(&compresswork, &compresslock);
+		}
+		if ((b = compressnext) == NULL) {
+			break;
+		}
+		compressnext = b->next;
+		(void) pthread_mutex_unlock(&compresslock);
+		compress_block(&stream, b);
+		(void) pthread_mutex_lock(&compresslock);
+		b->done = 1;
+		(void) pthread_cond_signal(&compressdone);
+	}
+	(void) pthread_mutex_unlock(&compresslock);
+	(void) deflateEnd(&stream);
+	return NULL;
+}
+
+/* Write compressed members from the head of the queue to file descriptor
+   1, waiting for compression threads while the queue has limit or more
+   blocks. */
+void write_compressed_blocks(size_t limit) {
+	compress_block_t *b;
+
+	(void) pthread_mutex_lock(&compresslock);
+	while ((b = compresshead) != NULL && (b->done || compresslength >= limit)) {
+		if (!b->done) {
+			(void) pthread_cond_wait(&compressdone, &compresslock);
+			continue;
+		}
+		if ((compresshead = b->next) == NULL) {
+			compresstail = NULL;
+		}
+		compresslength--;
+		(void) pthread_mutex_unlock(&compresslock);
+		if (write_fully(STDOUT_FILENO, (char *)b->member, b->memberlen) != 0) {
+			write_error();
+		}
+		free(b->member);
+		free(b);
+		(void) pthread_mutex_lock(&compresslock);
+	}
+	(void) pthread_mutex_unlock(&compresslock);
+}
+
+/* Queue compresscurrent for the compression threads. */
+void queue_compress_block(void) {
+	(void) pthread_mutex_lock(&compresslock);
+	if (compresstail) {
+		compresstail->next = compresscurrent;
+	} else {
+		compresshead = compresscurrent;
+	}
+	compresstail = compresscurrent;
+	if (compressnext == NULL) {
+		compressnext = compresscurrent;
+	}
+	compresslength++;
+	(void) pthread_cond_signal(&compresswork);
+	(void) pthread_mutex_unlock(&compresslock);
+	compresscurrent = NULL;
+	compressstarted = 1;
+	write_compressed_blocks(2 * numcompressjobs);
+}
+
+compress_block_t *new_compress_block(void) {
+	compress_block_t *b;
+
+	if ((b = calloc(1, sizeof (*b))) == NULL || (b->data = malloc(COMPRESS_BLOCKSIZE)) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return b;
+}
+
+/* Add size bytes of archive output to the blocks to be compressed. */
+void write_compressed(const char *buffer, size_t size) {
+	size_t n, count;
+
+	for (n = 0; n < size; n += count) {
+		if (compresscurrent == NULL) {
+			compresscurrent = new_compress_block();
+		}
+		count = size - n < COMPRESS_BLOCKSIZE - compresscurrent->len ? size - n : COMPRESS_BLOCKSIZE - compresscurrent->len;
+		(void) memcpy(compresscurrent->data + compresscurrent->len, buffer + n, count);
+		if ((compresscurrent->len += count) == COMPRESS_BLOCKSIZE) {
+			queue_compress_block();
+		}
+	}
+}
+
+/* Compress the rest of the archive (for 'c' with -z), write the remaining
+   members, and stop the compression threads. */
+void finish_compression(void) {
+	long n;
+
+	flush_output();
+	if (compresscurrent != NULL || !compressstarted) {
+		/* an empty archive still gets one (empty) member */
+		if (compresscurrent == NULL) {
+			compresscurrent = new_compress_block();
+		}
+		queue_compress_block();
+	}
+	(void) pthread_mutex_lock(&compresslock);
+	compressclosed = 1;
+	(void) pthread_cond_broadcast(&compresswork);
+	(void) pthread_mutex_unlock(&compresslock);
+	write_compressed_blocks(1);
+	for (n = 0; n < numcompressjobs; n++) {
+		(void) pthread_join(compressthreads[n], NULL);
+	}
+	free(compressthreads);
+}
+
+/* Start compressing the archive (for 'c' command with -z).  Compression
+   threads default to one per processor. */
+void start_compression(void) {
+	long n;
+	int result;
+
+	if ((numcompressjobs = numjobs) == 0 && (numcompressjobs = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+		numcompressjobs = 1;
+	}
+	if ((compressthreads = calloc(numcompressjobs, sizeof (*compressthreads))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (n = 0; n < numcompressjobs; n++) {
+		if ((result = pthread_create(&compressthreads[n], NULL, compress_blocks, NULL)) != 0) {
+			(void) fprintf(stderr, "error: couldn't start thread: %s\n", strerror(result));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+#endif	/* GZIP_SUPPORT */
+
+/* the file type identifiers used by the index extension, which are the
+   values of Type keys after transformkey() */
+const char *file_type_id(int type) {
+	static const char *ids[] = { NULL, "regularfile", "directory", "symboliclink", "characterdevice", "blockdevice", "fifo", "socket", "deleted", "hardlink" };
+
+	return ids[type];
+}
+
+/* Map a transformed Type value of length len to a file type ID, or
+   UNKNOWN. */
+int parse_file_type(const char *value, size_t len) {
+	int type;
+
+	switch (value[0]) {
+	case 'r':
+		type = REGULARFILE;
+		break;
+	case 'd':
+		type = len == 7 ? DELETED : DIRECTORY;
+		break;
+	case 's':
+		type = len == 6 ? SOCKET : SYMLINK;
+		break;
+	case 'c':
+		type = CHARDEVICE;
+		break;
+	case 'b':
+		type = BLOCKDEVICE;
+		break;
+	case 'f':
+		type = FIFO;
+		break;
+	case 'h':
+		type = HARDLINK;
+		break;
+	default:
+		return UNKNOWN;
+	}
+	return strncmp(file_type_id(type), value, len) == 0 && file_type_id(type)[len] == '\0' ? type : UNKNOWN;
+}
+
+/* Return the file type ID of the file described by sb. */
+int stat_file_type(const struct stat *sb) {
+	return S_ISREG(sb->st_mode) ? REGULARFILE : S_ISDIR(sb->st_mode) ? DIRECTORY : S_ISLNK(sb->st_mode) ? SYMLINK : S_ISCHR(sb->st_mode) ? CHARDEVICE : S_ISBLK(sb->st_mode) ? BLOCKDEVICE : S_ISFIFO(sb->st_mode) ? FIFO : SOCKET;
+}
+
+/* Record that the entry for fname begins at the current output offset. */
+void add_index_record(const char *fname, int type, unsigned long long size) {
+	index_record_t *record;
+
+	if (numindexrecords == indexrecordscap && (indexrecords = realloc(indexrecords, (indexrecordscap = indexrecordscap * 2 + 64) * sizeof (*indexrecords))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	record = &indexrecords[numindexrecords++];
+	record->path = safe_strdup(fname);
+	record->offset = outoffset;
+	record->lineno = outlines + 1;
+	record->size = size;
+	record->type = type;
+}
+
+void free_index(void) {
+	size_t n;
+
+	for (n = 0; n < numindexrecords; n++) {
+		free(indexrecords[n].path);
+	}
+	free(indexrecords);
+	indexrecords = NULL;
+	numindexrecords = indexrecordscap = 0;
+}
+
+/* Write the index extension's trailer.  Its last line has a fixed width
+   so that readers can find it by reading the end of the archive. */
+void write_index(void) {
+	unsigned long long indexoffset;
+	index_record_t *record;
+	char line[64];
+	size_t n, len;
+
+	write_blank();
+	indexoffset = outoffset;
+	for (n = 0; n < numindexrecords; n++) {
+		record = &indexrecords[n];
+		len = format_decimal(line, record->offset);
+		line[len++] = ' ';
+		len += format_decimal(line + len, record->lineno);
+		line[len++] = ' ';
+		len += format_decimal(line + len, record->size);
+		line[len++] = ' ';
+		output_bytes("Index Entry:\t", sizeof ("Index Entry:\t") - 1);
+		output_bytes(line, len);
+		output_bytes(file_type_id(record->type), strlen(file_type_id(record->type)));
+		output_bytes(" ", 1);
+		output_bytes(record->path, strlen(record->path));
+		output_bytes("\n", 1);
+		outlines++;
+	}
+	(void) snprintf(line, sizeof (line), "%0*llu", INDEX_OFFSET_DIGITS, indexoffset);
+	write_metadata("Index Offset", line);
+	free_index();
+}
+
+/* FNV-1a */
+size_t hash_bytes(const char *bytes, size_t len) {
+	size_t hash;
+
+	for (hash = 2166136261u; len > 0; len--, bytes++) {
+		hash = (hash ^ (unsigned char)*bytes) * 16777619u;
+	}
+	return hash;
+}
+
+size_t hash_id(unsigned long id) {
+	return (size_t)(id * 2654435761UL);
+}
+
+void add_pattern(pattern_set_t *set, const char *text) {
+	if (set->count == set->cap && (set->patterns = realloc(set->patterns, (set->cap = set->cap > 0 ? set->cap * 2 : REQUESTED_FILES_GROWTH) * sizeof (*set->patterns))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	set->patterns[set->count].text = safe_strdup(text);
+	set->patterns[set->count++].found = 0;
+}
+
+int compare_pattern_prefixes(const void *a, const void *b) {
+	const pattern_t *first, *second;
+	int result;
+
+	first = *(pattern_t * const *)a;
+	second = *(pattern_t * const *)b;
+	if ((result = memcmp(first->text, second->text, first->prefixlen < second->prefixlen ? first->prefixlen : second->prefixlen)) != 0) {
+		return result;
+	} else if (first->prefixlen != second->prefixlen) {
+		return first->prefixlen < second->prefixlen ? -1 : 1;
+	}
+	return first < second ? -1 : 1;
+}
+
+/* Compile set for match_pattern(), which then tests a path against all of
+   its patterns at once instead of calling fnmatch(3) with each in turn. */
+void compile_patterns(pattern_set_t *set) {
+	pattern_prefix_t *node;
+	pattern_t *pattern;
+	size_t n, numpatterns, slot;
+
+	numpatterns = 0;
+	for (n = 0; n < set->count; n++) {
+		pattern = &set->patterns[n];
+		pattern->prefixlen = strcspn(pattern->text, "*?[\\");
+		if (pattern->text[pattern->prefixlen] != '\0') {
+			numpatterns++;
+		}
+	}
+	for (set->literalcap = set->count > numpatterns ? 1 : 0; set->literalcap < (set->count - numpatterns) * 2; set->literalcap *= 2) {
+	}
+	if ((set->literalcap > 0 && (set->literalslots = calloc(set->literalcap, sizeof (*set->literalslots))) == NULL) || (numpatterns > 0 && ((set->prefixpatterns = malloc(numpatterns * sizeof (*set->prefixpatterns))) == NULL || (set->prefixes = malloc(numpatterns * sizeof (*set->prefixes))) == NULL))) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	numpatterns = 0;
+	for (n = 0; n < set->count; n++) {
+		pattern = &set->patterns[n];
+		if (pattern->text[pattern->prefixlen] != '\0') {
+			set->prefixpatterns[numpatterns++] = pattern;
+			continue;
+		}
+		/* the first of several identical patterns is the one that
+		   matches */
+		for (slot = hash_bytes(pattern->text, pattern->prefixlen) & (set->literalcap - 1); set->literalslots[slot] != NULL && strcmp(set->literalslots[slot]->text, pattern->text) != 0; slot = (slot + 1) & (set->literalcap - 1)) {
+		}
+		if (set->literalslots[slot] == NULL) {
+			set->literalslots[slot] = pattern;
+		}
+	}
+	if (numpatterns == 0) {
+		return;
+	}
+	qsort(set->prefixpatterns, numpatterns, sizeof (*set->prefixpatterns), compare_pattern_prefixes);
+	node = NULL;
+	for (n = 0; n < numpatterns; n++) {
+		pattern = set->prefixpatterns[n];
+		if (node == NULL || node->len != pattern->prefixlen || memcmp(node->prefix, pattern->text, node->len) != 0) {
+			node = &set->prefixes[set->numprefixes];
+			node->prefix = pattern->text;
+			node->len = pattern->prefixlen;
+			node->firstpattern = n;
+			node->numpatterns = 0;
+			/* the previous prefix and its parents include all of this
+			   prefix's prefixes, since they sort between them */
+			for (node->parent = set->numprefixes - 1; node->parent != NO_PREFIX && (set->prefixes[node->parent].len > node->len || memcmp(set->prefixes[node->parent].prefix, pattern->text, set->prefixes[node->parent].len) != 0); node->parent = set->prefixes[node->parent].parent) {
+			}
+			set->numprefixes++;
+		}
+		node->numpatterns++;
+	}
+}
+
+/* Return the first pattern in set that matches path, or NULL if none do. */
+pattern_t *match_pattern(const pattern_set_t *set, const char *path) {
+	const pattern_prefix_t *node;
+	pattern_t *first, *pattern;
+	size_t n, low, high, middle, end;
+	int result;
+
+	first = NULL;
+	if (set->literalcap > 0) {
+		for (n = hash_bytes(path, strlen(path)) & (set->literalcap - 1); set->literalslots[n] != NULL; n = (n + 1) & (set->literalcap - 1)) {
+			if (strcmp(set->literalslots[n]->text, path) == 0) {
+				first = set->literalslots[n];
+				break;
+			}
+		}
+	}
+	/* every prefix of path is the last prefix that sorts before it or
+	   one of that prefix's parents */
+	for (low = 0, high = set->numprefixes; low < high; ) {
+		middle = low + (high - low) / 2;
+		if (strncmp(set->prefixes[middle].prefix, path, set->prefixes[middle].len) <= 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	for (n = low - 1; n != NO_PREFIX; n = node->parent) {	/* low - 1 wraps to NO_PREFIX */
+		node = &set->prefixes[n];
+		if (strncmp(node->prefix, path, node->len) != 0) {
+			continue;
+		}
+		for (middle = node->firstpattern, end = middle + node->numpatterns; middle < end && (first == NULL || set->prefixpatterns[middle] < first); middle++) {
+			pattern = set->prefixpatterns[middle];
+			/* a prefix followed by '*' matches without fnmatch(3) */
+			if (strcmp(pattern->text + node->len, "*") != 0 && (result = fnmatch(pattern->text, path, 0)) != 0) {
+				if (result == FNM_NOSYS) {
+					(void) fprintf(stderr, "error: fnmatch(3) is not implemented on your system; cannot match patterns\n");
+					exit(EXIT_FAILURE);
+				}
+				continue;
+			}
+			first = pattern;
+			break;
+		}
+	}
+	return first;
+}
+
+void free_patterns(pattern_set_t *set) {
+	size_t n;
+
+	for (n = 0; n < set->count; n++) {
+		free(set->patterns[n].text);
+	}
+	free(set->patterns);
+	free(set->literalslots);
+	free(set->prefixes);
+	free(set->prefixpatterns);
+}
+
+/* Return the slot for id in cache, which is either id's or an empty one. */
+owner_name_t *find_owner_slot(owner_cache_t *cache, unsigned long id) {
+	size_t n;
+
+	for (n = hash_id(id) & (cache->cap - 1); cache->slots[n].name != NULL && cache->slots[n].id != id; n = (n + 1) & (cache->cap - 1)) {
+	}
+	return &cache->slots[n];
+}
+
+/* Return the slot for name in cache, which is either name's or an empty
+   one. */
+owner_name_t *find_owner_id_slot(owner_cache_t *cache, const char *name) {
+	size_t n;
+
+	for (n = hash_bytes(name, strlen(name)) & (cache->cap - 1); cache->slots[n].name != NULL && strcmp(cache->slots[n].name, name) != 0; n = (n + 1) & (cache->cap - 1)) {
+	}
+	return &cache->slots[n];
+}
+
+/* Make room for one more entry in cache, keeping it at most half full.
+   byname is nonzero if cache is keyed by name rather than by ID. */
+void grow_owner_cache(owner_cache_t *cache, int byname) {
+	owner_name_t *oldslots;
+	size_t oldcap, n;
+
+	if ((cache->count + 1) * 2 > cache->cap) {
+		oldslots = cache->slots;
+		oldcap = cache->cap;
+		cache->cap = oldcap > 0 ? oldcap * 2 : OWNER_CACHE_SIZE;
+		if ((cache->slots = calloc(cache->cap, sizeof (*cache->slots))) == NULL) {
+			(void) fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		for (n = 0; n < oldcap; n++) {
+			if (oldslots[n].name != NULL) {
+				*(byname ? find_owner_id_slot(cache, oldslots[n].name) : find_owner_slot(cache, oldslots[n].id)) = oldslots[n];
+			}
+		}
+		free(oldslots);
+	}
+}
+
+/* Add id's name to cache. */
+void add_owner_name(owner_cache_t *cache, unsigned long id, const char *name) {
+	owner_name_t *slot;
+
+	grow_owner_cache(cache, 0);
+	slot = find_owner_slot(cache, id);
+	slot->id = id;
+	slot->name = safe_strdup(name);
+	slot->known = 1;
+	cache->count++;
+}
+
+/* Add name's ID to cache; known is 0 if the name doesn't exist. */
+void add_owner_id(owner_cache_t *cache, const char *name, unsigned long id, int known) {
+	owner_name_t *slot;
+
+	grow_owner_cache(cache, 1);
+	slot = find_owner_id_slot(cache, name);
+	slot->id = id;
+	slot->name = safe_strdup(name);
+	slot->known = known;
+	cache->count++;
+}
+
+/* Look up the name of user uid, or NULL if there isn't one. */
+const char *user_name(uid_t uid) {
+	struct passwd *passwordinfo;
+	owner_name_t *slot;
+
+	if (usernames.cap > 0 && (slot = find_owner_slot(&usernames, uid))->name != NULL) {
+		usernames.hits++;
+		return slot->name;
+	}
+	usernames.misses++;
+	if ((passwordinfo = getpwuid(uid)) == NULL) {
+		return NULL;
+	}
+	add_owner_name(&usernames, uid, passwordinfo->pw_name);
+	return passwordinfo->pw_name;
+}
+
+/* Look up the name of group gid, or NULL if there isn't one. */
+const char *group_name(gid_t gid) {
+	struct group *groupinfo;
+	owner_name_t *slot;
+
+	if (groupnames.cap > 0 && (slot = find_owner_slot(&groupnames, gid))->name != NULL) {
+		groupnames.hits++;
+		return slot->name;
+	}
+	groupnames.misses++;
+	if ((groupinfo = getgrgid(gid)) == NULL) {
+		return NULL;
+	}
+	add_owner_name(&groupnames, gid, groupinfo->gr_name);
+	return groupinfo->gr_name;
+}
+
+/* Look up the ID of the user named name.  Returns 0 if there's no such
+   user. */
+int user_id(const char *name, uid_t *uid) {
+	struct passwd *passwordinfo;
+	owner_name_t *slot;
+
+	if (userids.cap > 0 && (slot = find_owner_id_slot(&userids, name))->name != NULL) {
+		userids.hits++;
+		if (slot->known) {
+			*uid = slot->id;
+		}
+		return slot->known;
+	}
+	userids.misses++;
+	if ((passwordinfo = getpwnam(name)) == NULL) {
+		add_owner_id(&userids, name, 0, 0);
+		return 0;
+	}
+	add_owner_id(&userids, name, passwordinfo->pw_uid, 1);
+	*uid = passwordinfo->pw_uid;
+	return 1;
+}
+
+/* Look up the ID of the group named name.  Returns 0 if there's no such
+   group. */
+int group_id(const char *name, gid_t *gid) {
+	struct group *groupinfo;
+	owner_name_t *slot;
+
+	if (groupids.cap > 0 && (slot = find_owner_id_slot(&groupids, name))->name != NULL) {
+		groupids.hits++;
+		if (slot->known) {
+			*gid = slot->id;
+		}
+		return slot->known;
+	}
+	groupids.misses++;
+	if ((groupinfo = getgrnam(name)) == NULL) {
+		add_owner_id(&groupids, name, 0, 0);
+		return 0;
+	}
+	add_owner_id(&groupids, name, groupinfo->gr_gid, 1);
+	*gid = groupinfo->gr_gid;
+	return 1;
+}
+
+void free_owner_cache(owner_cache_t *cache) {
+	size_t n;
+
+	for (n = 0; n < cache->cap; n++) {
+		free(cache->slots[n].name);
+	}
+	free(cache->slots);
+	cache->slots = NULL;
+	cache->cap = cache->count = 0;
+}
+
+/* Return the slot in dedupfiles for contents of size bytes whose beginning
+   has the CRC-32C headcrc, which is empty if no archived file's contents
+   are like that.  dedupfilescap must be nonzero. */
+dedup_file_t *find_dedup_file(uint64_t size, uint32_t headcrc) {
+	uint64_t key;
+	size_t n;
+
+	key = size * 0x9e3779b97f4a7c15ULL ^ headcrc;
+	for (n = (size_t)(key ^ key >> 32) & (dedupfilescap - 1); dedupfiles[n].path != NULL && (dedupfiles[n].size != size || dedupfiles[n].headcrc != headcrc); n = (n + 1) & (dedupfilescap - 1)) {
+	}
+	return &dedupfiles[n];
+}
+
+/* Remember the archived regular file at path, whose contents' beginning
+   has the CRC-32C headcrc and whose status was sb before they were
+   archived, for later files with the same contents. */
+void add_dedup_file(const char *path, const struct stat *sb, uint32_t headcrc) {
+	dedup_file_t *oldfiles, *d;
+	size_t oldcap, n;
+
+	if ((numdedupfiles + 1) * 2 > dedupfilescap) {
+		oldfiles = dedupfiles;
+		oldcap = dedupfilescap;
+		dedupfilescap = oldcap > 0 ? oldcap * 2 : OWNER_CACHE_SIZE;
+		if ((dedupfiles = calloc(dedupfilescap, sizeof (*dedupfiles))) == NULL) {
+			(void) fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		for (n = 0; n < oldcap; n++) {
+			if (oldfiles[n].path != NULL) {
+				*find_dedup_file(oldfiles[n].size, oldfiles[n].headcrc) = oldfiles[n];
+			}
+		}
+		free(oldfiles);
+	}
+	d = find_dedup_file(sb->st_size, headcrc);
+	d->path = safe_strdup(path);
+	d->size = sb->st_size;
+	d->headcrc = headcrc;
+	d->sb = *sb;
+	numdedupfiles++;
+}
+
+void free_dedup_files(void) {
+	size_t n;
+
+	for (n = 0; n < dedupfilescap; n++) {
+		free(dedupfiles[n].path);
+	}
+	free(dedupfiles);
+	dedupfiles = NULL;
+	dedupfilescap = numdedupfiles = 0;
+}
+
+/* Return path's slot in basefiles, which is empty if path isn't there.
+   basefilescap must be nonzero. */
+base_file_t *find_base_file(const char *path, size_t len) {
+	base_file_t *f;
+	size_t mask;
+
+	mask = basefilescap - 1;
+	for (f = &basefiles[hash_bytes(path, len) & mask]; f->path != NULL && (strncmp(f->path, path, len) != 0 || f->path[len] != '\0'); f = &basefiles[(f - basefiles + 1) & mask]) {
+	}
+	return f;
+}
+
+/* Return path's slot in basefiles, adding it if necessary. */
+base_file_t *add_base_file(const char *path, size_t len) {
+	base_file_t *old, *f;
+	size_t oldcap, n;
+
+	if (numbasefiles >= basefilescap / 2) {
+		old = basefiles;
+		oldcap = basefilescap;
+		basefilescap = oldcap > 0 ? oldcap * 2 : OWNER_CACHE_SIZE;
+		if ((basefiles = calloc(basefilescap, sizeof (*basefiles))) == NULL) {
+			(void) fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		for (n = 0; n < oldcap; n++) {
+			if (old[n].path != NULL) {
+				*find_base_file(old[n].path, strlen(old[n].path)) = old[n];
+			}
+		}
+		free(old);
+	}
+	if ((f = find_base_file(path, len))->path == NULL) {
+		if ((f->path = malloc(len + 1)) == NULL) {
+			(void) fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		(void) memcpy(f->path, path, len);
+		f->path[len] = '\0';
+		f->type = UNKNOWN;
+		numbasefiles++;
+	}
+	return f;
+}
+
+void free_base_files(void) {
+	size_t n;
+
+	for (n = 0; n < basefilescap; n++) {
+		free(basefiles[n].path);
+		free(basefiles[n].linktarget);
+		free(basefiles[n].linkedpath);
+	}
+	free(basefiles);
+	basefiles = NULL;
+	basefilescap = numbasefiles = 0;
+}
+
+/* Return nonzero if the file at fname is unchanged since the --since-archive
+   archives recorded it, which it would be if fname is new.  Either way,
+   fname's tombstone isn't needed. */
+int is_unchanged_file(const char *fname, const struct stat *sb) {
+	base_file_t *f;
+
+	if (basefilescap == 0 || (f = find_base_file(fname, strlen(fname)))->path == NULL) {
+		return 0;
+	}
+	f->seen = 1;
+	return f->type == stat_file_type(sb) && f->mtime == sb->st_mtime && f->mode == (sb->st_mode & ~S_IFMT)
+	    && f->uid == sb->st_uid && f->gid == sb->st_gid && (f->type != REGULARFILE || f->size == (unsigned long long)sb->st_size)
+	    && ((f->type != CHARDEVICE && f->type != BLOCKDEVICE) || (f->major == (long)major(sb->st_rdev) && f->minor == (long)minor(sb->st_rdev)))
+	    && (!f->hasinode || (f->dev == sb->st_dev && f->ino == sb->st_ino));
+}
+
+/* Return nonzero if path is at or below a path given to the 'c' command,
+   or if pruned is nonzero, a path that the walk skipped. */
+int is_below_root(const char *path, int pruned) {
+	base_file_t *f;
+	size_t len;
+
+	for (len = strlen(path); ; ) {
+		if ((len > 0 || path[0] == '/') && (f = find_base_file(path, len))->path != NULL && (pruned ? f->pruned : f->root)) {
+			return 1;
+		} else if (len == 0) {
+			return 0;
+		}
+		while (len > 0 && path[--len] != '/') {
+		}
+	}
+}
+
+int compare_paths_descending(const void *a, const void *b) {
+	return strcmp((*(base_file_t * const *)b)->path, (*(base_file_t * const *)a)->path);
+}
+
+/* Write tombstone entries for the files that the --since-archive archives
+   recorded below the archived roots but that weren't found (or skipped).
+   Children are written before their parents so that directories are empty
+   when they're removed. */
+void write_deleted_files(void) {
+	base_file_t **deleted;
+	size_t n, numdeleted;
+
+	if ((deleted = malloc((numbasefiles > 0 ? numbasefiles : 1) * sizeof (*deleted))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	numdeleted = 0;
+	for (n = 0; n < basefilescap; n++) {
+		if (basefiles[n].path != NULL && basefiles[n].type != UNKNOWN && basefiles[n].type != DELETED && !basefiles[n].seen && is_below_root(basefiles[n].path, 0) && !is_below_root(basefiles[n].path, 1)) {
+			deleted[numdeleted++] = &basefiles[n];
+		}
+	}
+	qsort(deleted, numdeleted, sizeof (*deleted), compare_paths_descending);
+	for (n = 0; n < numdeleted; n++) {
+		if (verbose && fprintf(stderr, "%s (deleted)\n", deleted[n]->path) < 0) {
+			perror("stderr");
+		}
+		write_blank();
+		if (writeextensions & EXTENSION_INDEX) {
+			add_index_record(deleted[n]->path, DELETED, 0);
+		}
+		write_metadata("Path", deleted[n]->path);
+		write_metadata("Type", "Deleted");
+		if (unbuffered) {
+			flush_output();
+		}
+	}
+	free(deleted);
+}
+
+/* Return nonzero if the file described by sb is a regular file that might
+   have holes because it occupies fewer blocks than its size needs (for 'c'
+   command with --sparse). */
+int may_be_sparse(const struct stat *sb) {
+	return (writeextensions & EXTENSION_SPARSE) && S_ISREG(sb->st_mode) && (unsigned long long)sb->st_blocks * 512 < (unsigned long long)sb->st_size;
+}
+
+/* List the data extents of the regular file e in e->extents and set
+   e->sparse if the file has holes.  Files are treated as having no holes
+   if the file system can't report them.  Returns 0 or an errno value. */
+int find_data_extents(archive_entry_t *e) {
+#ifdef	SEEK_DATA
+	off_t data, hole;
+	size_t cap;
+	int fd, supported;
+
+	if ((fd = open(e->path, O_RDONLY)) == -1) {
+		return errno;
+	}
+	cap = 0;
+	supported = 1;
+	e->datasize = 0;
+	for (hole = 0; hole < e->sb.st_size; e->datasize += hole - data) {
+		if ((data = lseek(fd, hole, SEEK_DATA)) == -1) {
+			/* ENXIO means that the rest of the file is a hole */
+			supported = errno == ENXIO;
+			break;
+		} else if (data >= e->sb.st_size) {
+			break;
+		} else if ((hole = lseek(fd, data, SEEK_HOLE)) == -1) {
+			supported = 0;
+			break;
+		} else if (hole > e->sb.st_size) {
+			hole = e->sb.st_size;
+		}
+		if (e->numextents == cap && (e->extents = realloc(e->extents, (cap = cap * 2 + 16) * sizeof (*e->extents))) == NULL) {
+			(void) fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		e->extents[e->numextents].offset = data;
+		e->extents[e->numextents++].length = hole - data;
+	}
+	(void) close(fd);
+	e->sparse = supported && e->datasize < e->sb.st_size;
+#endif	/* SEEK_DATA */
+	return 0;
+}
+
+/* Do the work for an archive entry that doesn't touch standard output:
+   read symbolic links, read regular files' contents into memory if
+   e->prefetch is set, list their data extents if they might be sparse, and
+   compute the checksums of prefetched contents.  (write_entry() computes
+   the checksums of other contents as it writes them.)  Errors are saved in
+   e->errnum and reported by write_entry() so that they appear in archive
+   order. */
+void prepare_entry(archive_entry_t *e) {
+	char target[sizeof (linkpath)];
+	ssize_t len;
+	size_t cap;
+	int fd;
+
+	if (e->hardlink != NULL) {
+		/* only the path is written */
+		return;
+	} else if (S_ISLNK(e->sb.st_mode)) {
+		if ((len = readlink(e->path, target, sizeof (target) - 1)) == -1) {
+			e->errnum = errno;
+		} else {
+			target[len] = '\0';
+			e->linktarget = safe_strdup(target);
+		}
+	} else if (e->prefetch && !e->prefetched) {
+		if ((fd = open(e->path, O_RDONLY)) == -1) {
+			e->errnum = errno;
+			return;
+		}
+		/* read one byte more than expected to detect growing files */
+		cap = e->sb.st_size + 1;
+		if ((e->contents = malloc(cap)) == NULL) {
+			(void) fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		for (e->contentslen = 0; ; e->contentslen += len) {
+			if (e->contentslen == cap && (e->contents = realloc(e->contents, cap *= 2)) == NULL) {
+				(void) fprintf(stderr, "out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+			if ((len = read(fd, e->contents + e->contentslen, cap - e->contentslen)) == 0) {
+				e->prefetched = 1;
+				break;
+			} else if (len < 0 && errno != EINTR) {
+				/* let write_entry() read the file again and report the error */
+				free(e->contents);
+				e->contents = NULL;
+				break;
+			} else if (len < 0) {
+				len = 0;
+			}
+		}
+		(void) close(fd);
+	}
+	if (may_be_sparse(&e->sb) && (e->errnum = find_data_extents(e)) != 0) {
+		return;
+	}
+	if (S_ISREG(e->sb.st_mode) && e->prefetched && (writeextensions & EXTENSION_CHECKSUM)) {
+		e->checksum = crc32c(0, e->contents, e->contentslen);
+	}
+}
+
+/* Return nonzero if the contents of the file at path are those of e, which
+   is a regular file that's open as fd if it wasn't prefetched. */
+int same_contents(archive_entry_t *e, int fd, const char *path) {
+	char buffer[WRITE_BLOCKSIZE], other[WRITE_BLOCKSIZE];
+	off_t offset;
+	ssize_t numread;
+	int otherfd, same;
+
+	if ((otherfd = open(path, O_RDONLY)) == -1) {
+		return 0;
+	}
+	same = 1;
+	for (offset = 0; same; offset += numread) {
+		while ((numread = pread(otherfd, other, sizeof (other), offset)) < 0 && errno == EINTR) {
+		}
+		if (numread <= 0) {
+			same = numread == 0 && offset == e->sb.st_size;
+			break;
+		} else if (offset + numread > e->sb.st_size) {
+			same = 0;
+		} else if (e->prefetched) {
+			same = memcmp(e->contents + offset, other, numread) == 0;
+		} else {
+			same = pread(fd, buffer, numread, offset) == numread && memcmp(buffer, other, numread) == 0;
+		}
+	}
+	(void) close(otherfd);
+	return same;
+}
+
+/* Compute the CRC-32C of the first DEDUP_HEAD_SIZE bytes of the contents
+   of e, which is a regular file that's open as fd if it wasn't prefetched.
+   Returns nonzero if they can't be read. */
+int checksum_contents_head(archive_entry_t *e, int fd, uint32_t *crc) {
+	char buffer[DEDUP_HEAD_SIZE];
+	size_t count;
+	ssize_t numread;
+
+	count = e->sb.st_size < DEDUP_HEAD_SIZE ? (size_t)e->sb.st_size : DEDUP_HEAD_SIZE;
+	if (e->prefetched) {
+		*crc = crc32c(0, e->contents, count);
+		return 0;
+	}
+	while ((numread = pread(fd, buffer, count, 0)) < 0 && errno == EINTR) {
+	}
+	if (numread != (ssize_t)count) {
+		return 1;
+	}
+	*crc = crc32c(0, buffer, count);
+	return 0;
+}
+
+/* Return nonzero if the archived file d is unchanged, so its contents are
+   still the ones in the archive. */
+int is_unchanged_dedup_file(const dedup_file_t *d) {
+	struct stat sb;
+
+	return lstat(d->path, &sb) == 0 && sb.st_dev == d->sb.st_dev && sb.st_ino == d->sb.st_ino && sb.st_size == d->sb.st_size
+	    && sb.st_mtim.tv_sec == d->sb.st_mtim.tv_sec && sb.st_mtim.tv_nsec == d->sb.st_mtim.tv_nsec
+	    && sb.st_ctim.tv_sec == d->sb.st_ctim.tv_sec && sb.st_ctim.tv_nsec == d->sb.st_ctim.tv_nsec;
+}
+
+/* Write the Sparse Map key of the sparse file e.  A file without data is
+   described by an empty extent. */
+void write_sparse_map(archive_entry_t *e) {
+	char *map;
+	size_t n, len;
+
+	if ((map = malloc(e->numextents * (2 * sizeof ("18446744073709551615")) + sizeof ("0+0"))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	(void) strcpy(map, "0+0");
+	for (len = 0, n = 0; n < e->numextents; n++) {
+		if (n > 0) {
+			map[len++] = ' ';
+		}
+		len += format_decimal(map + len, e->extents[n].offset);
+		map[len++] = '+';
+		len += format_decimal(map + len, e->extents[n].length);
+	}
+	write_key_value("Sparse Map", map, len > 0 ? len : 3);
+	free(map);
+}
+
+/* Read the data extents of the sparse file e, which is open as fd, into
+   the output buffer, adding them to *crc unless crc is NULL. */
+int write_file_extents(archive_entry_t *e, int fd, uint32_t *crc) {
+	off_t offset, end;
+	ssize_t numread;
+	size_t n, count;
+
+	for (n = 0; n < e->numextents; n++) {
+		for (offset = e->extents[n].offset, end = offset + e->extents[n].length; offset < end; offset += numread) {
+			if (OUTPUT_BUFSIZE - outlen < WRITE_BLOCKSIZE) {
+				flush_output();
+			}
+			count = end - offset < (off_t)(OUTPUT_BUFSIZE - outlen) ? (size_t)(end - offset) : OUTPUT_BUFSIZE - outlen;
+			if ((numread = pread(fd, outbuf + outlen, count, offset)) < 0) {
+				if (errno == EINTR) {
+					numread = 0;
+					continue;
+				}
+				perror(e->path);
+				return 1;
+			} else if (numread == 0) {
+				(void) fprintf(stderr, "%s: file shrank while it was being archived\n", e->path);
+				return 1;
+			} else if (crc != NULL) {
+				*crc = crc32c(*crc, outbuf + outlen, numread);
+			}
+			outlen += numread;
+			outoffset += numread;
+		}
+	}
+	return 0;
+}
+
+/* Report that path vanished before it could be archived.  It's skipped,
+   but 'c' exits with a failure status, as tar does. */
+void warn_removed_file(const char *path) {
+	(void) fprintf(stderr, "%s: file was removed while it was being archived\n", path);
+	filesremoved = 1;
+}
+
+int write_entry(archive_entry_t *e) {
+	const char *fname;
+	const struct stat *sb;
+	int fd;
+	const char *username, *groupname;
+	char checksum[sizeof ("crc32c:") + 8];
+	dedup_file_t *duplicate;
+	uint32_t crc, *crcp, headcrc;
+	int dedup;
+
+	fname = e->path;
+	sb = &e->sb;
+	if (verbose) {
+		if (fprintf(stderr, "%s\n", fname) < 0) {
+			perror("stderr");
+			return 1;
+		}
+	}
+	if ((username = user_name(sb->st_uid)) == NULL || (groupname = group_name(sb->st_gid)) == NULL) {
+		perror(fname);
+		return 1;
+	}
+	fd = -1;
+	if (S_ISREG(sb->st_mode) && e->hardlink == NULL && e->errnum == 0 && !e->prefetched && (fd = open(fname, O_RDONLY)) == -1) {
+		e->errnum = errno;
+	}
+	if (e->errnum == ENOENT) {
+		/* the file was removed after it was statted */
+		warn_removed_file(fname);
+		return 0;
+	}
+	write_blank();
+	if (e->hardlink != NULL) {
+		/* the earlier entry describes the file */
+		if (writeextensions & EXTENSION_INDEX) {
+			add_index_record(fname, HARDLINK, 0);
+		}
+		write_metadata("Path", fname);
+		write_metadata("Type", "Hard Link");
+		write_metadata("Link Target", e->hardlink);
+		return 0;
+	} else if (writeextensions & EXTENSION_INDEX) {
+		add_index_record(fname, stat_file_type(sb), !S_ISREG(sb->st_mode) ? 0 : e->sparse ? e->datasize : sb->st_size);
+	}
+	write_metadata("Path", fname);
+	if (S_ISREG(sb->st_mode)) {
+		write_metadata("Type", "Regular File");
+		if (e->sparse) {
+			write_numeric_metadata("File Size", e->datasize);
+			write_numeric_metadata("Sparse Size", sb->st_size);
+			write_sparse_map(e);
+		} else {
+			write_numeric_metadata("File Size", sb->st_size);
+		}
+		if (e->errnum != 0) {
+			errno = e->errnum;
+			perror(fname);
+			return 1;
+		} else if (e->prefetched && e->contentslen != (size_t)sb->st_size) {
+			/* the contents were read after the file was statted */
+			(void) fprintf(stderr, "%s: file %s while it was being archived\n", fname, e->contentslen < (size_t)sb->st_size ? "shrank" : "grew");
+			return 1;
+		}
+	} else if (S_ISDIR(sb->st_mode)) {
+		write_metadata("Type", "Directory");
+	} else if (S_ISLNK(sb->st_mode)) {
+		write_metadata("Type", "Symbolic Link");
+		if (e->linktarget == NULL) {
+			errno = e->errnum;
+			perror(fname);
+			return 1;
+		}
+		write_metadata("Link Target", e->linktarget);
+	} else if (S_ISCHR(sb->st_mode)) {
+		write_metadata("Type", "Character Device");
+		write_numeric_metadata("Major", major(sb->st_rdev));
+		write_numeric_metadata("Minor", minor(sb->st_rdev));
+	} else if (S_ISBLK(sb->st_mode)) {
+		write_metadata("Type", "Block Device");
+		write_numeric_metadata("Major", major(sb->st_rdev));
+		write_numeric_metadata("Minor", minor(sb->st_rdev));
+	} else if (S_ISFIFO(sb->st_mode)) {
+		write_metadata("Type", "FIFO");
+	} else if (S_ISSOCK(sb->st_mode)) {
+		write_metadata("Type", "Socket");
+	} else {
+		(void) fprintf(stderr, "%s: illegal file type\n", fname);
+		return 1;
+	}
+	write_metadata("User Name", username);
+	write_numeric_metadata("User ID", sb->st_uid);
+	write_metadata("Group Name", groupname);
+	write_numeric_metadata("Group ID", sb->st_gid);
+	write_octal_metadata("Permissions", sb->st_mode & ~S_IFMT);
+	write_numeric_metadata("Modification Time", sb->st_mtime);
+	if (writeextensions & EXTENSION_INCREMENTAL) {
+		write_numeric_metadata("Device", sb->st_dev);
+		write_numeric_metadata("Inode", sb->st_ino);
+	}
+	crc = 0;
+	if ((dedup = S_ISREG(sb->st_mode) && (writeextensions & EXTENSION_DEDUP) && !e->sparse && sb->st_size >= DEDUP_MIN_SIZE && checksum_contents_head(e, fd, &headcrc) == 0)) {
+		if (dedupfilescap > 0 && (duplicate = find_dedup_file(sb->st_size, headcrc))->path != NULL) {
+			/* the earlier file's contents were compared as they are now */
+			if (same_contents(e, fd, duplicate->path) && is_unchanged_dedup_file(duplicate)) {
+				deduphits++;
+				write_metadata("Same Contents As", duplicate->path);
+				if (fd != -1) {
+					(void) close(fd);
+				}
+				return 0;
+			}
+			/* keep the first path with this key */
+			dedup = 0;
+		}
+		dedupmisses++;
+	}
+	if (e->prefetched) {
+		write_divider();
+		output_bytes(e->contents, e->contentslen);
+		write_divider();
+		crc = e->checksum;
+	} else if (fd != -1) {
+		crcp = (writeextensions & EXTENSION_CHECKSUM) ? &crc : NULL;
+		write_divider();
+		if ((e->sparse ? write_file_extents(e, fd, crcp) : crcp != NULL ? write_file_contents_mapped(fname, fd, sb->st_size, crcp) : write_file_contents(fname, fd, sb->st_size, NULL)) != 0) {
+			(void) close(fd);
+			return 1;
+		}
+		(void) close(fd);
+		write_divider();
+	}
+	if (S_ISREG(sb->st_mode) && (writeextensions & EXTENSION_CHECKSUM)) {
+		/* the checksum follows the contents so that it can be computed
+		   while they're written */
+		(void) snprintf(checksum, sizeof (checksum), "crc32c:%08x", (unsigned int)crc);
+		write_metadata("Content Checksum", checksum);
+	}
+	if (dedup) {
+		add_dedup_file(fname, sb, headcrc);
+	}
+	return 0;
+}
+
+void free_entry(archive_entry_t *e) {
+	free(e->path);
+	free(e->linktarget);
+	free(e->hardlink);
+	free(e->extents);
+	free(e->contents);
+	free(e);
+}
+
+/* the body of each -j thread */
+void *prepare_queued_entries(void *unused) {
+	archive_entry_t *e;
+
+	(void) pthread_mutex_lock(&queuelock);
+	for (;;) {
+		while (queuenext == NULL && !queueclosed) {
+			(void) pthread_cond_wait(&queuework, &queuelock);
+		}
+		if ((e = queuenext) == NULL) {
+			break;
+		}
+		queuenext = e->next;
+		(void) pthread_mutex_unlock(&queuelock);
+		prepare_entry(e);
+		(void) pthread_mutex_lock(&queuelock);
+		e->prepared = 1;
+		(void) pthread_cond_signal(&queueprepared);
+	}
+	(void) pthread_mutex_unlock(&queuelock);
+	return NULL;
+}
+
+void start_jobs(void *(*job)(void *)) {
+	long n;
+	int result;
+
+	if ((jobthreads = calloc(numjobs, sizeof (*jobthreads))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (n = 0; n < numjobs; n++) {
+		if ((result = pthread_create(&jobthreads[n], NULL, job, NULL)) != 0) {
+			(void) fprintf(stderr, "error: couldn't start thread: %s\n", strerror(result));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* Stop the -j threads and discard entries that weren't written. */
+void stop_jobs(void) {
+	archive_entry_t *e;
+	long n;
+
+	(void) pthread_mutex_lock(&queuelock);
+	queueclosed = 1;
+	queuenext = NULL;
+	(void) pthread_cond_broadcast(&queuework);
+	(void) pthread_mutex_unlock(&queuelock);
+	for (n = 0; n < numjobs; n++) {
+		(void) pthread_join(jobthreads[n], NULL);
+	}
+	free(jobthreads);
+	while ((e = queuehead) != NULL) {
+		queuehead = e->next;
+		free_entry(e);
+	}
+	queuetail = NULL;
+	queuelength = queuebytes = 0;
+}
+
+/* Write prepared entries from the head of the queue.  This waits for -j
+   threads if drain is nonzero and entries remain or if the queue has no
+   room for another entry costing charge bytes. */
+int write_queued_entries(int drain, size_t charge) {
+	archive_entry_t *e;
+	int result;
+
+	result = 0;
+	(void) pthread_mutex_lock(&queuelock);
+	while (queuehead != NULL) {
+		if (queuehead->prepared) {
+			e = queuehead;
+			if ((queuehead = e->next) == NULL) {
+				queuetail = NULL;
+			}
+			queuelength--;
+			queuebytes -= e->charge;
+			(void) pthread_mutex_unlock(&queuelock);
+			result = write_entry(e);
+			free_entry(e);
+			if (unbuffered) {
+				flush_output();
+			}
+			(void) pthread_mutex_lock(&queuelock);
+			if (result) {
+				break;
+			}
+		} else if (drain || queuelength >= PREFETCH_MAX_ENTRIES || queuebytes + charge > prefetchbudget) {
+			(void) pthread_cond_wait(&queueprepared, &queuelock);
+		} else {
+			break;
+		}
+	}
+	(void) pthread_mutex_unlock(&queuelock);
+	return result;
+}
+
+int queue_entry(archive_entry_t *e) {
+	if (e->prefetched) {
+		e->charge = e->contentslen;
+	} else if (S_ISREG(e->sb.st_mode) && e->hardlink == NULL && !may_be_sparse(&e->sb) && e->sb.st_size <= PREFETCH_MAX_FILE_SIZE && (size_t)e->sb.st_size <= prefetchbudget) {
+		e->prefetch = 1;
+		e->charge = e->sb.st_size;
+	}
+	if (write_queued_entries(0, e->charge) != 0) {
+		free_entry(e);
+		return 1;
+	}
+	(void) pthread_mutex_lock(&queuelock);
+	if (queuetail) {
+		queuetail->next = e;
+	} else {
+		queuehead = e;
+	}
+	queuetail = e;
+	if (queuenext == NULL) {
+		queuenext = e;
+	}
+	queuelength++;
+	queuebytes += e->charge;
+	(void) pthread_cond_signal(&queuework);
+	(void) pthread_mutex_unlock(&queuelock);
+	return 0;
+}
+
+/* Return a copy of the first archived path of the file at fname if it has
+   several hard links and was archived before; otherwise remember fname as
+   the file's first path and return NULL. */
+char *find_hard_link(const char *fname, const struct stat *sb) {
+	struct stat other;
+	unsigned long id;
+	const char *first;
+
+	id = (unsigned long)sb->st_ino ^ (unsigned long)sb->st_dev << (sizeof (id) * CHAR_BIT / 2);
+	if (hardlinks.cap > 0 && (first = find_owner_slot(&hardlinks, id)->name) != NULL) {
+		if (lstat(first, &other) == 0 && other.st_dev == sb->st_dev && other.st_ino == sb->st_ino) {
+			hardlinks.hits++;
+			return safe_strdup(first);
+		}
+		/* keep the first path with this key */
+		return NULL;
+	}
+	hardlinks.misses++;
+	add_owner_name(&hardlinks, id, fname);
+	return NULL;
+}
+
+/* Archive the file fname.  If contents isn't NULL, then it holds the
+   regular file's sb->st_size bytes, and it's freed later. */
+int add_file_contents(const char *fname, const struct stat *sb, char *contents) {
+	archive_entry_t *e;
+	int result;
+
+	/* skip the file if it's the same as stdout (avoids infinite loops) or
+	   the file is the current directory (avoids an unnecessary entry) */
+	if ((sb->st_dev == stdoutdev && sb->st_ino == stdoutino) || strcmp(fname, ".") == 0) {
+		free(contents);
+		return 0;
+	} else if (differential && is_unchanged_file(fname, sb)) {
+		/* later links can still refer to the unchanged path */
+		if ((writeextensions & EXTENSION_HARDLINK) && !S_ISDIR(sb->st_mode) && sb->st_nlink > 1) {
+			free(find_hard_link(fname, sb));
+		}
+		free(contents);
+		return 0;
+	}
+
+	if ((e = calloc(1, sizeof (*e))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	e->path = safe_strdup(fname);
+	e->sb = *sb;
+	if (contents != NULL) {
+		e->contents = contents;
+		e->contentslen = sb->st_size;
+		e->prefetched = 1;
+	}
+	if ((writeextensions & EXTENSION_HARDLINK) && !S_ISDIR(sb->st_mode) && sb->st_nlink > 1) {
+		e->hardlink = find_hard_link(fname, sb);
+	}
+	if (numjobs > 0) {
+		return queue_entry(e);
+	}
+	prepare_entry(e);
+	result = write_entry(e);
+	free_entry(e);
+	if (unbuffered) {
+		flush_output();
+	}
+	return result;
+}
+
+/* Record that the walk skipped fname so that files at or below it don't get
+   tombstones. */
+void prune_path(const char *fname) {
+	size_t len;
+
+	if (differential) {
+		for (len = strlen(fname); len > 0 && fname[len - 1] == '/'; len--) {
+		}
+		add_base_file(fname, len)->pruned = 1;
+	}
+}
+
+/* Return nonzero if fname or its name matches an --exclude pattern, in
+   which case neither it nor anything below it is archived. */
+int is_excluded(const char *fname) {
+	const char *name;
+
+	if (excludes.count == 0) {
+		return 0;
+	}
+	name = (name = strrchr(fname, '/')) != NULL ? name + 1 : fname;
+	if (match_pattern(&excludes, fname) == NULL && (name == fname || match_pattern(&excludes, name) == NULL)) {
+		return 0;
+	}
+	prune_path(fname);
+	return 1;
+}
+
+/* Return nonzero if the directory fname shouldn't be walked because it's
+   on another file system and --one-file-system was given.  (The directory
+   itself is still archived.) */
+int is_other_file_system(const char *fname, const struct stat *sb) {
+	if (!onefilesystem || !S_ISDIR(sb->st_mode) || sb->st_dev == walkdev) {
+		return 0;
+	}
+	prune_path(fname);
+	return 1;
+}
+
+
+#ifdef	IO_URING_SUPPORT
+/* Return nonzero if io_uring is set up (by the first call) and supports
+   every opcode in ops, a set of URING_OP() bits. */
+int start_uring(unsigned long long ops) {
+	static char tried;
+	struct io_uring_params params;
+	struct io_uring_probe *probe;
+	int n, supported;
+
+	if (tried) {
+		return uringfd != -1 && (uringops & ops) == ops;
+	}
+	tried = 1;
+	(void) memset(&params, 0, sizeof (params));
+	if ((uringfd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) == -1) {
+		return 0;
+	}
+	if ((probe = calloc(1, sizeof (*probe) + 256 * sizeof (struct io_uring_probe_op))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	supported = (params.features & IORING_FEAT_SINGLE_MMAP) && syscall(__NR_io_uring_register, uringfd, IORING_REGISTER_PROBE, probe, 256) == 0;
+	for (n = 0; supported && n <= probe->last_op && n < 64; n++) {
+		if (probe->ops[n].flags & IO_URING_OP_SUPPORTED) {
+			uringops |= URING_OP(n);
+		}
+	}
+	free(probe);
+
+	/* the submission and completion rings share one mapping */
+	uringringslen = MAX(params.sq_off.array + params.sq_entries * sizeof (unsigned), params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe));
+	if (!supported || (uringrings = mmap(NULL, uringringslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uringfd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+		(void) close(uringfd);
+		uringfd = -1;
+		return 0;
+	}
+	if ((uringsqes = mmap(NULL, params.sq_entries * sizeof (struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uringfd, IORING_OFF_SQES)) == MAP_FAILED) {
+		(void) munmap(uringrings, uringringslen);
+		(void) close(uringfd);
+		uringfd = -1;
+		return 0;
+	}
+	uringsqtail = (unsigned *)(uringrings + params.sq_off.tail);
+	uringsqmask = (unsigned *)(uringrings + params.sq_off.ring_mask);
+	uringsqarray = (unsigned *)(uringrings + params.sq_off.array);
+	uringcqhead = (unsigned *)(uringrings + params.cq_off.head);
+	uringcqtail = (unsigned *)(uringrings + params.cq_off.tail);
+	uringcqmask = (unsigned *)(uringrings + params.cq_off.ring_mask);
+	uringcqes = (struct io_uring_cqe *)(uringrings + params.cq_off.cqes);
+	return (uringops & ops) == ops;
+}
+
+void stop_uring(void) {
+	if (uringfd != -1) {
+		(void) munmap(uringsqes, URING_ENTRIES * sizeof (struct io_uring_sqe));
+		(void) munmap(uringrings, uringringslen);
+		(void) close(uringfd);
+		uringfd = -1;
+	}
+}
+
+/* Return a cleared submission queue entry for an operation whose result
+   goes in *result.  At most URING_ENTRIES may be pending. */
+struct io_uring_sqe *next_uring_sqe(int *result) {
+	struct io_uring_sqe *sqe;
+	unsigned index;
+
+	index = (*uringsqtail + uringpending++) & *uringsqmask;
+	sqe = &uringsqes[index];
+	(void) memset(sqe, 0, sizeof (*sqe));
+	sqe->user_data = (uintptr_t)result;
+	uringsqarray[index] = index;
+	return sqe;
+}
+
+/* Submit the pending operations and wait for all of them. */
+int run_uring(void) {
+	unsigned count, submitted, completed, head;
+	struct io_uring_cqe *cqe;
+	int result;
+
+	count = uringpending;
+	uringpending = 0;
+	__atomic_store_n(uringsqtail, *uringsqtail + count, __ATOMIC_RELEASE);
+	for (submitted = completed = 0; completed < count; ) {
+		if ((result = syscall(__NR_io_uring_enter, uringfd, count - submitted, count - completed, IORING_ENTER_GETEVENTS, NULL, 0)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("error: io_uring_enter");
+			return 1;
+		}
+		submitted += result;
+		for (head = *uringcqhead; head != __atomic_load_n(uringcqtail, __ATOMIC_ACQUIRE); head++, completed++) {
+			cqe = &uringcqes[head & *uringcqmask];
+			*(int *)(uintptr_t)cqe->user_data = cqe->res;
+		}
+		__atomic_store_n(uringcqhead, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+void statx_to_stat(const struct statx *stx, struct stat *sb) {
+	(void) memset(sb, 0, sizeof (*sb));
+	sb->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	sb->st_ino = stx->stx_ino;
+	sb->st_mode = stx->stx_mode;
+	sb->st_nlink = stx->stx_nlink;
+	sb->st_uid = stx->stx_uid;
+	sb->st_gid = stx->stx_gid;
+	sb->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	sb->st_size = stx->stx_size;
+	sb->st_blksize = stx->stx_blksize;
+	sb->st_blocks = stx->stx_blocks;
+	sb->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	sb->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	sb->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	sb->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	sb->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* Return nonzero if a regular file's contents should be read while its
+   directory is walked.  (Unchanged files and the other exceptions below
+   don't need them.) */
+int is_early_read_file(const struct stat *sb) {
+	return S_ISREG(sb->st_mode) && sb->st_size <= URING_MAX_FILE_SIZE && !may_be_sparse(sb) && !differential
+	    && !((writeextensions & EXTENSION_HARDLINK) && sb->st_nlink > 1) && !(sb->st_dev == stdoutdev && sb->st_ino == stdoutino);
+}
+
+/* Read the small regular files among nodes[first] through the next
+   directory (or nodes[count - 1]) with batches of openat(2), read(2), and
+   close(2) operations, and return the index after that directory.  Files
+   that can't be read this way are left for write_entry(). */
+size_t read_small_files(walk_node_t *nodes, size_t first, size_t count) {
+	struct io_uring_sqe *sqe;
+	size_t end, n, budget;
+
+	for (end = first; end < count && (nodes[end].errnum != 0 || !S_ISDIR(nodes[end].sb.st_mode)); end++) {
+	}
+	for (budget = URING_BUDGET, n = first; n < end; n++) {
+		nodes[n].result = -1;
+		if (nodes[n].errnum == 0 && is_early_read_file(&nodes[n].sb) && (size_t)nodes[n].sb.st_size <= budget) {
+			budget -= nodes[n].sb.st_size;
+			sqe = next_uring_sqe(&nodes[n].result);
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t)nodes[n].path;
+			sqe->open_flags = O_RDONLY;
+		}
+	}
+	if (uringpending == 0 || run_uring() != 0) {
+		return end + 1;
+	}
+	for (n = first; n < end; n++) {
+		if (nodes[n].result >= 0) {
+			/* read one byte more than expected to detect growing files */
+			nodes[n].fd = nodes[n].result;
+			if ((nodes[n].contents = malloc(nodes[n].sb.st_size + 1)) == NULL) {
+				(void) fprintf(stderr, "out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+			sqe = next_uring_sqe(&nodes[n].result);
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = nodes[n].fd;
+			sqe->addr = (uintptr_t)nodes[n].contents;
+			sqe->len = nodes[n].sb.st_size + 1;
+		}
+	}
+	if (uringpending > 0 && run_uring() != 0) {
+		return end + 1;
+	}
+	for (n = first; n < end; n++) {
+		if (nodes[n].fd != -1) {
+			if (nodes[n].result != nodes[n].sb.st_size) {
+				free(nodes[n].contents);
+				nodes[n].contents = NULL;
+			}
+			sqe = next_uring_sqe(&nodes[n].result);
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = nodes[n].fd;
+			nodes[n].fd = -1;
+		}
+	}
+	if (uringpending > 0) {
+		(void) run_uring();
+	}
+	return end + 1;
+}
+
+#endif	/* IO_URING_SUPPORT */
+
+int compare_walk_names(const void *a, const void *b) {
+	return strcmp(((const walk_entry_t *)a)->path, ((const walk_entry_t *)b)->path);
+}
+
+int compare_walk_inodes(const void *a, const void *b) {
+	unsigned long long first, second;
+
+	first = ((const walk_entry_t *)a)->ino;
+	second = ((const walk_entry_t *)b)->ino;
+	return first < second ? -1 : first > second;
+}
+
+/* Add the path of the entry name in the directory at path (whose length is
+   len) to *entries unless it's "." or ".." or excluded.  maybedir is zero
+   if the entry is known not to be a directory. */
+void add_walk_entry(const char *path, size_t len, const char *name, unsigned long long ino, int maybedir, walk_entry_t **entries, size_t *count, size_t *cap) {
+	char *entrypath;
+
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		return;
+	}
+	if ((*count == *cap && (*entries = realloc(*entries, (*cap = *cap * 2 + 64) * sizeof (**entries))) == NULL)
+	    || (entrypath = malloc(len + strlen(name) + 2)) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	(void) sprintf(entrypath, "%s%s%s", path, path[len - 1] == '/' ? "" : "/", name);
+	/* excluded files aren't even statted */
+	if (is_excluded(entrypath)) {
+		free(entrypath);
+		return;
+	}
+	(*entries)[*count].path = entrypath;
+	(*entries)[*count].maybedir = maybedir;
+	(*entries)[(*count)++].ino = ino;
+}
+
+/* Read the entries of the directory at path into *entries (and their number
+   into *count) in --sort order.  On Linux, they're read DIRENTS_BUFSIZE
+   bytes at a time with getdents64(2).  Returns nonzero if the walk should
+   stop because the directory couldn't be read. */
+int read_directory(const char *path, walk_entry_t **entries, size_t *count) {
+	size_t len, cap;
+	int fd, result;
+#ifdef	__linux__
+	linux_dirent64_t *d;
+	long numread, offset;
+#else	/* !__linux__ */
+	struct dirent *d;
+	DIR *dir;
+#endif	/* __linux__ */
+
+	*entries = NULL;
+	*count = cap = 0;
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY)) == -1) {
+		perror(path);
+		return errno != EACCES && errno != ENOENT;
+	}
+	len = strlen(path);
+	result = 0;
+#ifdef	__linux__
+	if (direntsbuf == NULL && (direntsbuf = malloc(DIRENTS_BUFSIZE)) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	while ((numread = syscall(SYS_getdents64, fd, direntsbuf, DIRENTS_BUFSIZE)) > 0) {
+		for (offset = 0; offset < numread; offset += d->d_reclen) {
+			d = (linux_dirent64_t *)(direntsbuf + offset);
+			add_walk_entry(path, len, d->d_name, d->d_ino, d->d_type == DT_DIR || d->d_type == DT_UNKNOWN, entries, count, &cap);
+		}
+	}
+	if (numread == -1) {
+		perror(path);
+		result = 1;
+	}
+	(void) close(fd);
+#else	/* !__linux__ */
+	if ((dir = fdopendir(fd)) == NULL) {
+		perror(path);
+		(void) close(fd);
+		return 1;
+	}
+	for (errno = 0; (d = readdir(dir)) != NULL; errno = 0) {
+		add_walk_entry(path, len, d->d_name, d->d_ino, 1, entries, count, &cap);
+	}
+	if (errno != 0) {
+		perror(path);
+		result = 1;
+	}
+	(void) closedir(dir);
+#endif	/* __linux__ */
+	if (sortorder == SORT_NAME) {
+		qsort(*entries, *count, sizeof (**entries), compare_walk_names);
+	} else if (sortorder == SORT_INODE) {
+		qsort(*entries, *count, sizeof (**entries), compare_walk_inodes);
+	}
+	return result;
+}
+
+/* Stat nodes[0] through nodes[count - 1], with one batch of statx(2)
+   operations if io_uring is available.  Returns nonzero if the batch
+   couldn't be run. */
+int stat_walk_nodes(walk_node_t *nodes, size_t count) {
+	size_t n;
+#ifdef	IO_URING_SUPPORT
+	struct io_uring_sqe *sqe;
+
+	if (walkuring) {
+		for (n = 0; n < count; n++) {
+			sqe = next_uring_sqe(&nodes[n].result);
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t)nodes[n].path;
+			sqe->len = STATX_BASIC_STATS;
+			sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+			sqe->off = (uintptr_t)&uringstatx[n];
+		}
+		if (run_uring() != 0) {
+			return 1;
+		}
+		for (n = 0; n < count; n++) {
+			if ((nodes[n].errnum = -nodes[n].result) == 0) {
+				statx_to_stat(&uringstatx[n], &nodes[n].sb);
+			}
+		}
+		return 0;
+	}
+#endif	/* IO_URING_SUPPORT */
+	for (n = 0; n < count; n++) {
+		nodes[n].errnum = lstat(nodes[n].path, &nodes[n].sb) == 0 ? 0 : errno;
+	}
+	return 0;
+}
+
+/* Archive the files in the directory at path (and below it) depth-first.
+   With io_uring, up to URING_ENTRIES files are statted at a time, but a
+   batch ends at the first file that might be a directory.  Later files
+   are statted after it's walked, shortly before they're archived. */
+int walk_directory(const char *path) {
+	walk_entry_t *entries;
+	walk_node_t *nodes;
+	size_t numentries, start, count, batchsize, n;
+	int result;
+#ifdef	IO_URING_SUPPORT
+	size_t readend;
+#endif	/* IO_URING_SUPPORT */
+
+	if ((result = read_directory(path, &entries, &numentries)) != 0 || numentries == 0) {
+		for (n = 0; n < numentries; n++) {
+			free(entries[n].path);
+		}
+		free(entries);
+		return result;
+	}
+	if ((nodes = calloc(URING_ENTRIES, sizeof (*nodes))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	batchsize = 1;
+#ifdef	IO_URING_SUPPORT
+	if (walkuring) {
+		batchsize = URING_ENTRIES;
+	}
+#endif	/* IO_URING_SUPPORT */
+	for (start = 0; result == 0 && start < numentries; start += count) {
+		count = 0;
+		do {
+			nodes[count].path = entries[start + count].path;
+			nodes[count].fd = -1;
+			nodes[count].contents = NULL;
+		} while (!entries[start + count++].maybedir && count < batchsize && start + count < numentries);
+		if (stat_walk_nodes(nodes, count) != 0) {
+			result = 1;
+			break;
+		}
+#ifdef	IO_URING_SUPPORT
+		readend = 0;
+#endif	/* IO_URING_SUPPORT */
+		for (n = 0; result == 0 && n < count; n++) {
+#ifdef	IO_URING_SUPPORT
+			if (walkuring && n >= readend) {
+				readend = read_small_files(nodes, n, count);
+			}
+#endif	/* IO_URING_SUPPORT */
+			if (nodes[n].errnum == ENOENT) {
+				/* the file was removed after the directory was read */
+				warn_removed_file(nodes[n].path);
+				continue;
+			} else if (nodes[n].errnum != 0) {
+				errno = nodes[n].errnum;
+				perror(nodes[n].path);
+				result = 1;
+				break;
+			}
+			result = add_file_contents(nodes[n].path, &nodes[n].sb, nodes[n].contents);
+			nodes[n].contents = NULL;
+			if (result == 0 && S_ISDIR(nodes[n].sb.st_mode) && !is_other_file_system(nodes[n].path, &nodes[n].sb)) {
+				result = walk_directory(nodes[n].path);
+			}
+		}
+		for (; n < count; n++) {
+			free(nodes[n].contents);
+		}
+	}
+	for (n = 0; n < numentries; n++) {
+		free(entries[n].path);
+	}
+	free(entries);
+	free(nodes);
+	return result;
+}
+
+/* Archive the directory fname, whose status is sb, and the files below it. */
+int walk_tree(const char *fname, const struct stat *sb) {
+	char *root;
+	size_t len;
+	int result;
+
+#ifdef	IO_URING_SUPPORT
+	walkuring = !nouringoption && start_uring(URING_OP(IORING_OP_STATX) | URING_OP(IORING_OP_OPENAT) | URING_OP(IORING_OP_READ) | URING_OP(IORING_OP_CLOSE));
+#endif	/* IO_URING_SUPPORT */
+	/* the root is archived without trailing slashes */
+	root = safe_strdup(fname);
+	for (len = strlen(root); len > 1 && root[len - 1] == '/'; len--) {
+		root[len - 1] = '\0';
+	}
+	if ((result = add_file_contents(root, sb, NULL)) == 0) {
+		result = walk_directory(root);
+	}
+	free(root);
+	return result;
+}
+
+int archive_file(const char *fname) {
+	struct stat sb;
+	size_t len;
+
+	if (is_excluded(fname)) {
+		return 0;
+	}
+	if (differential) {
+		/* files that were below fname but are missing now were deleted */
+		for (len = strlen(fname); len > 0 && fname[len - 1] == '/'; len--) {
+		}
+		add_base_file(fname, len)->root = 1;
+	}
+	if (lstat(fname, &sb) != 0) {
+		perror(fname);
+		return 1;
+	} else if (S_ISDIR(sb.st_mode)) {
+		walkdev = sb.st_dev;
+		return walk_tree(fname, &sb);
+	}
+	return add_file_contents(fname, &sb, NULL);
+}
+
+/* Parse a Sparse Map value, which is a list of space-separated
+   OFFSET+LENGTH extents in ascending order, into fextents. */
+int parse_sparse_map(slice_t value) {
+	const char *next, *end, *plus;
+	slice_t offset, length;
+	unsigned long long number;
+	off_t previousend;
+
+	fnumextents = 0;
+	previousend = 0;
+	for (next = value.ptr, end = value.ptr + value.len; next < end; next++) {
+		if (*next == ' ') {
+			continue;
+		}
+		for (offset.ptr = next; next < end && *next != ' '; next++) {
+		}
+		if ((plus = memchr(offset.ptr, '+', next - offset.ptr)) == NULL) {
+			return 1;
+		}
+		offset.len = plus - offset.ptr;
+		length.ptr = plus + 1;
+		length.len = next - length.ptr;
+		if (fnumextents == fextentscap && (fextents = realloc(fextents, (fextentscap = fextentscap * 2 + 16) * sizeof (*fextents))) == NULL) {
+			(void) fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		if (parse_number(offset, 10, LLONG_MAX, &number) != 0 || (off_t)number < previousend) {
+			return 1;
+		}
+		fextents[fnumextents].offset = number;
+		if (parse_number(length, 10, LLONG_MAX - number, &number) != 0) {
+			return 1;
+		}
+		fextents[fnumextents].length = number;
+		previousend = fextents[fnumextents].offset + fextents[fnumextents].length;
+		fnumextents++;
+	}
+	return fnumextents == 0;
+}
+
+/* Return nonzero (after printing an error message) if the current entry's
+   sparse map doesn't describe its contents. */
+int check_sparse_map(size_t lineno) {
+	unsigned long long datasize;
+	size_t n;
+
+	if (!fsparsesizegiven || !fsparsemapgiven) {
+		(void) fprintf(stderr, "%s:%zu: sparse files need both a sparse size and a sparse map\n", inname, lineno);
+		return 1;
+	}
+	for (datasize = 0, n = 0; n < fnumextents; n++) {
+		datasize += fextents[n].length;
+	}
+	if (datasize != fsize || fextents[fnumextents - 1].offset + fextents[fnumextents - 1].length > fsparsesize) {
+		(void) fprintf(stderr, "%s:%zu: the sparse map doesn't match the file size or the sparse size\n", inname, lineno);
+		return 1;
+	}
+	return 0;
+}
+
+int handle_metadata(size_t lineno, int keyid, const char *key, slice_t value) {
+	char type[KEY_MAX + 1];
+	unsigned long long number;
+
+	if (value.len == 0) {
+		(void) fprintf(stderr, "%s:%zu: empty metadata values are not allowed\n", inname, lineno);
+		return 1;
+	}
+	switch (keyid) {
+	case KEY_PATH:
+		if (fpathgiven) {
+			(void) fprintf(stderr, "%s:%zu: file path already specified\n", inname, lineno);
+			return 1;
+		}
+		copy_slice(&fpath, &fpathcap, value);
+		fpathgiven = 1;
+		break;
+	case KEY_TYPE:
+		if (ftype != UNKNOWN) {
+			(void) fprintf(stderr, "%s:%zu: file type already specified\n", inname, lineno);
+			return 1;
+		}
+		if ((ftype = parse_file_type(type, transformkey(value, type))) == UNKNOWN || (ftype == DELETED && !(extensions & EXTENSION_INCREMENTAL)) || (ftype == HARDLINK && !(extensions & EXTENSION_HARDLINK))) {
+			(void) fprintf(stderr, "%s:%zu: unrecognized file type: %s\n", inname, lineno, type);
+			return 1;
+		}
+		break;
+	case KEY_FILESIZE:
+		if (fsizegiven) {
+			(void) fprintf(stderr, "%s:%zu: file size already specified\n", inname, lineno);
+			return 1;
+		}
+		if (parse_number(value, 10, SIZE_MAX, &number) != 0) {
+			(void) fprintf(stderr, "%s:%zu: invalid file size: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+			return 1;
+		}
+		fsize = number;
+		fsizegiven = 1;
+		break;
+	case KEY_LINKTARGET:
+		if (flinktargetgiven) {
+			(void) fprintf(stderr, "%s:%zu: link target already specified\n", inname, lineno);
+			return 1;
+		}
+		copy_slice(&flinktarget, &flinktargetcap, value);
+		flinktargetgiven = 1;
+		break;
+	case KEY_MAJOR:
+		if (fmajor != -1) {
+			(void) fprintf(stderr, "%s:%zu: major already specified\n", inname, lineno);
+			return 1;
+		}
+		if (parse_number(value, 10, LONG_MAX, &number) != 0) {
+			(void) fprintf(stderr, "%s:%zu: invalid major: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+			return 1;
+		}
+		fmajor = number;
+		break;
+	case KEY_MINOR:
+		if (fminor != -1) {
+			(void) fprintf(stderr, "%s:%zu: file path already specified\n", inname, lineno);
+			return 1;
+		}
+		if (parse_number(value, 10, LONG_MAX, &number) != 0) {
+			(void) fprintf(stderr, "%s:%zu: invalid minor: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+			return 1;
+		}
+		fminor = number;
+		break;
+	case KEY_USERNAME:
+		if (fusernamegiven) {
+			(void) fprintf(stderr, "%s:%zu: username already specified\n", inname, lineno);
+			return 1;
+		}
+		copy_slice(&fusername, &fusernamecap, value);
+		fusernamegiven = 1;
+		break;
+	case KEY_USERID:
+		if (fuidgiven) {
+			(void) fprintf(stderr, "%s:%zu: uid already specified\n", inname, lineno);
+			return 1;
+		}
+		if (parse_number(value, 10, (uid_t)-1, &number) != 0) {
+			(void) fprintf(stderr, "%s:%zu: invalid uid: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+			return 1;
+		}
+		fuid = number;
+		fuidgiven = 1;
+		break;
+	case KEY_GROUPNAME:
+		if (fgroupnamegiven) {
+			(void) fprintf(stderr, "%s:%zu: groupname already specified\n", inname, lineno);
+			return 1;
+		}
+		copy_slice(&fgroupname, &fgroupnamecap, value);
+		fgroupnamegiven = 1;
+		break;
+	case KEY_GROUPID:
+		if (fgidgiven) {
+			(void) fprintf(stderr, "%s:%zu: gid already specified\n", inname, lineno);
+			return 1;
+		}
+		if (parse_number(value, 10, (gid_t)-1, &number) != 0) {
+			(void) fprintf(stderr, "%s:%zu: invalid gid: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+			return 1;
+		}
+		fgid = number;
+		fgidgiven = 1;
+		break;
+	case KEY_PERMISSIONS:
+		if (fmodegiven) {
+			(void) fprintf(stderr, "%s:%zu: file permissions already specified\n", inname, lineno);
+			return 1;
+		}
+		if (parse_number(value, 8, ~S_IFMT & 07777, &number) != 0) {
+			(void) fprintf(stderr, "%s:%zu: invalid file permissions: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+			return 1;
+		}
+		fmode = number;
+		fmodegiven = 1;
+		break;
+	case KEY_MODIFICATIONTIME:
+		if (fmtimegiven) {
+			(void) fprintf(stderr, "%s:%zu: file modification time already specified\n", inname, lineno);
+			return 1;
+		}
+		if (parse_number(value, 10, LLONG_MAX, &number) != 0) {
+			(void) fprintf(stderr, "%s:%zu: invalid file modification time: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+			return 1;
+		}
+		fmtime = number;
+		fmtimegiven = 1;
+		break;
+	case KEY_DEVICE:
+		if (!(extensions & EXTENSION_INCREMENTAL)) {
+			(void) fprintf(stderr, "%s:%zu: unrecognized metadata key name: %s\n", inname, lineno, key);
+			return 1;
+		} else if (fdevgiven) {
+			(void) fprintf(stderr, "%s:%zu: device already specified\n", inname, lineno);
+			return 1;
+		} else if (parse_number(value, 10, (dev_t)-1, &number) != 0) {
+			(void) fprintf(stderr, "%s:%zu: invalid device: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+			return 1;
+		}
+		fdev = number;
+		fdevgiven = 1;
+		break;
+	case KEY_INODE:
+		if (!(extensions & EXTENSION_INCREMENTAL)) {
+			(void) fprintf(stderr, "%s:%zu: unrecognized metadata key name: %s\n", inname, lineno, key);
+			return 1;
+		} else if (finogiven) {
+			(void) fprintf(stderr, "%s:%zu: inode already specified\n", inname, lineno);
+			return 1;
+		} else if (parse_number(value, 10, (ino_t)-1, &number) != 0) {
+			(void) fprintf(stderr, "%s:%zu: invalid inode: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+			return 1;
+		}
+		fino = number;
+		finogiven = 1;
+		break;
+	case KEY_CONTENTCHECKSUM:
+		if (!(extensions & EXTENSION_CHECKSUM)) {
+			(void) fprintf(stderr, "%s:%zu: unrecognized metadata key name: %s\n", inname, lineno, key);
+			return 1;
+		} else if (fchecksumgiven) {
+			(void) fprintf(stderr, "%s:%zu: content checksum already specified\n", inname, lineno);
+			return 1;
+		} else if (parse_checksum(value, &fchecksum) != 0) {
+			(void) fprintf(stderr, "%s:%zu: invalid content checksum: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+			return 1;
+		}
+		fchecksumgiven = 1;
+		break;
+	case KEY_SAMECONTENTSAS:
+		if (!(extensions & EXTENSION_DEDUP)) {
+			(void) fprintf(stderr, "%s:%zu: unrecognized metadata key name: %s\n", inname, lineno, key);
+			return 1;
+		} else if (fsamecontentsgiven) {
+			(void) fprintf(stderr, "%s:%zu: same contents path already specified\n", inname, lineno);
+			return 1;
+		}
+		copy_slice(&fsamecontents, &fsamecontentscap, value);
+		fsamecontentsgiven = 1;
+		break;
+	case KEY_SPARSESIZE:
+		if (!(extensions & EXTENSION_SPARSE)) {
+			(void) fprintf(stderr, "%s:%zu: unrecognized metadata key name: %s\n", inname, lineno, key);
+			return 1;
+		} else if (fsparsesizegiven) {
+			(void) fprintf(stderr, "%s:%zu: sparse size already specified\n", inname, lineno);
+			return 1;
+		}
+		if (parse_number(value, 10, LLONG_MAX, &number) != 0) {
+			(void) fprintf(stderr, "%s:%zu: invalid sparse size: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+			return 1;
+		}
+		fsparsesize = number;
+		fsparsesizegiven = 1;
+		break;
+	case KEY_SPARSEMAP:
+		if (!(extensions & EXTENSION_SPARSE)) {
+			(void) fprintf(stderr, "%s:%zu: unrecognized metadata key name: %s\n", inname, lineno, key);
+			return 1;
+		} else if (fsparsemapgiven) {
+			(void) fprintf(stderr, "%s:%zu: sparse map already specified\n", inname, lineno);
+			return 1;
+		}
+		if (parse_sparse_map(value) != 0) {
+			(void) fprintf(stderr, "%s:%zu: invalid sparse map: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+			return 1;
+		}
+		fsparsemapgiven = 1;
+		break;
+	default:
+		(void) fprintf(stderr, "%s:%zu: unrecognized metadata key name: %s\n", inname, lineno, key);
+		return 1;
+	}
+	return 0;
+}
+
+int is_invalid_metadata(void) {
+	if (!fpathgiven) {
+		return 1;
+	}
+	switch (ftype) {
+	case UNKNOWN:
+		return 1;
+	case REGULARFILE:
+		/* entries without contents can't say where the contents go */
+		if (!fsizegiven || (fsamecontentsgiven && (fsparsesizegiven || fsparsemapgiven))) {
+			return 1;
+		}
+		break;
+	case DIRECTORY:
+		break;
+	case SYMLINK:
+		if (!flinktargetgiven) {
+			return 1;
+		}
+		break;
+	case CHARDEVICE:
+	case BLOCKDEVICE:
+		if (fmajor == -1 || fminor == -1) {
+			return 1;
+		}
+		break;
+	case FIFO:
+		break;
+	case SOCKET:
+		break;
+	case DELETED:
+		/* deleted files need only their paths */
+		return 0;
+	case HARDLINK:
+		/* the earlier entry has the rest of the metadata */
+		return !flinktargetgiven;
+	default:
+		abort();
+		break;
+	}
+	return !fuidgiven || !fgidgiven || !fusernamegiven || !fgroupnamegiven || !fmtimegiven || !fmodegiven;
+}
+
+void clear_metadata(void) {
+	ftype = UNKNOWN;
+	fmajor = -1;
+	fminor = -1;
+	fpathgiven = flinktargetgiven = fusernamegiven = fgroupnamegiven = fsamecontentsgiven = 0;
+	fsizegiven = fuidgiven = fgidgiven = fmodegiven = fmtimegiven = fdevgiven = finogiven = fchecksumgiven = 0;
+	fsparsesizegiven = fsparsemapgiven = 0;
+}
+
+void free_metadata(void) {
+	free(fpath);
+	free(flinktarget);
+	free(fusername);
+	free(fgroupname);
+	free(fsamecontents);
+	free(fextents);
+}
+
+#ifdef	GZIP_SUPPORT
+/* Decompress up to count bytes of the archive into buffer. */
+ssize_t inflate_input(char *buffer, size_t count) {
+	ssize_t numread;
+	int result;
+
+	instream.next_out = (unsigned char *)buffer;
+	instream.avail_out = count;
+	while (instream.avail_out == count) {
+		if (instream.avail_in == 0) {
+			if (inraweof) {
+				if (inmember) {
+					(void) fprintf(stderr, "%s: compressed data ends unexpectedly\n", inname);
+					errno = EIO;
+					return -1;
+				}
+				break;
+			}
+			if ((numread = read(infd, inraw, READ_BLOCKSIZE)) < 0) {
+				return -1;
+			}
+			inraweof = numread == 0;
+			instream.next_in = inraw;
+			instream.avail_in = numread;
+			continue;
+		}
+		inmember = 1;
+		if ((result = inflate(&instream, Z_NO_FLUSH)) == Z_STREAM_END) {
+			inmember = 0;
+			(void) inflateReset(&instream);
+		} else if (result != Z_OK) {
+			(void) fprintf(stderr, "%s: invalid compressed data: %s\n", inname, instream.msg != NULL ? instream.msg : zError(result));
+			errno = EIO;
+			return -1;
+		}
+	}
+	inoffset += count - instream.avail_out;
+	return count - instream.avail_out;
+}
+
+/* List the gzip members of infd, a compressed regular file of size bytes,
+   starting at offset if they all have PT extra fields. */
+void find_compressed_members(off_t offset, off_t size) {
+	unsigned char header[GZIP_HEADER_SIZE], isize[4];
+	unsigned long long start;
+	size_t cap;
+	uint32_t len;
+
+	for (start = 0, cap = 0; ; start += get_le32(isize), offset += len) {
+		if (numinmembers == cap && (inmembers = realloc(inmembers, (cap = cap * 2 + 64) * sizeof (*inmembers))) == NULL) {
+			(void) fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		inmembers[numinmembers].offset = offset;
+		inmembers[numinmembers++].start = start;
+		if (offset == size) {
+			break;
+		} else if (pread(infd, header, sizeof (header), offset) != sizeof (header) || memcmp(header, "\x1f\x8b\x08\x04", 4) != 0
+		    || memcmp(header + 10, "\x08\0PT\x04\0", 6) != 0 || (len = get_le32(header + 16)) < GZIP_HEADER_SIZE + GZIP_TRAILER_SIZE
+		    || len > size - offset || pread(infd, isize, sizeof (isize), offset + len - sizeof (isize)) != sizeof (isize)) {
+			/* another program wrote the file */
+			free(inmembers);
+			inmembers = NULL;
+			numinmembers = 0;
+			return;
+		}
+	}
+}
+
+/* Continue decompressing at the decompressed offset, which must be within
+   the members listed in inmembers. */
+int seek_compressed(unsigned long long offset) {
+	size_t low, high, middle;
+
+	/* find the last member that starts at or before offset */
+	for (low = 0, high = numinmembers - 1; high - low > 1; ) {
+		middle = low + (high - low) / 2;
+		if (inmembers[middle].start <= offset) {
+			low = middle;
+		} else {
+			high = middle;
+		}
+	}
+	if (lseek(infd, inmembers[low].offset, SEEK_SET) == -1) {
+		perror(inname);
+		return 1;
+	}
+	(void) inflateReset(&instream);
+	instream.avail_in = 0;
+	inraweof = inmember = 0;
+	inoffset = inmembers[low].start;
+	inpos = inend = 0;
+	ineof = 0;
+	return skip_input(0, offset - inmembers[low].start);
+}
+
+/* Decompress infd if -z was given or it's a regular file that begins with a
+   gzip header.  Compressed input is read sequentially through inbuf.
+   Returns compressedinput. */
+int open_compressed_input(void) {
+	unsigned char magic[2];
+	struct stat sb;
+	off_t offset;
+
+	if (!gzipoption && (fstat(infd, &sb) != 0 || !S_ISREG(sb.st_mode) || (offset = lseek(infd, 0, SEEK_CUR)) == -1
+	    || pread(infd, magic, sizeof (magic), offset) != sizeof (magic) || magic[0] != 0x1f || magic[1] != 0x8b)) {
+		return 0;
+	}
+	(void) memset(&instream, 0, sizeof (instream));
+	if (inflateInit2(&instream, MAX_WBITS + 16) != Z_OK || (inraw = malloc(READ_BLOCKSIZE)) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	inraweof = inmember = 0;
+	inoffset = 0;
+	if (fstat(infd, &sb) == 0 && S_ISREG(sb.st_mode) && (offset = lseek(infd, 0, SEEK_CUR)) != -1 && offset < sb.st_size) {
+		find_compressed_members(offset, sb.st_size);
+	}
+	return compressedinput = 1;
+}
+#endif	/* GZIP_SUPPORT */
+
+/* Read up to count bytes of the archive from infd. */
+ssize_t read_input(char *buffer, size_t count) {
+#ifdef	GZIP_SUPPORT
+	if (compressedinput) {
+		return inflate_input(buffer, count);
+	}
+#endif	/* GZIP_SUPPORT */
+	return read(infd, buffer, count);
+}
+
+/* Read more bytes from standard input into inbuf, moving unconsumed bytes to
+   the front and growing the buffer if necessary.  Returns the number of
+   bytes read, 0 at end-of-file, or -1 on error (see inerrno). */
+ssize_t fill_input(void) {
+	ssize_t numread;
+
+	if (ineof) {
+		return 0;
+	}
+	if (inpos > 0) {
+		(void) memmove(inbuf, inbuf + inpos, inend - inpos);
+		inend -= inpos;
+		inpos = 0;
+	}
+	if (inbufcap - inend < READ_BLOCKSIZE) {
+		if ((inbuf = realloc(inbuf, inbufcap = inend + READ_BLOCKSIZE)) == NULL) {
+			(void) fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	while ((numread = read_input(inbuf + inend, inbufcap - inend)) < 0) {
+		if (errno != EINTR) {
+			inerrno = errno;
+			return -1;
+		}
+	}
+	if (numread == 0) {
+		ineof = 1;
+	}
+	inend += numread;
+	return numread;
+}
+
+/* Like getline(3) on stdin, except that the returned line (without its
+   newline character) lives in inbuf and is only valid until the next input
+   function call. */
+ssize_t read_line(slice_t *line) {
+	char *newline;
+	size_t searched, len;
+	ssize_t numread;
+
+	for (searched = 0; ; ) {
+		if (inend - inpos > searched && (newline = memchr(inbuf + inpos + searched, '\n', inend - inpos - searched)) != NULL) {
+			len = newline - (inbuf + inpos);
+			break;
+		}
+		searched = inend - inpos;
+		if ((numread = fill_input()) < 0) {
+			return -1;
+		} else if (numread == 0) {
+			if (inend == inpos) {
+				return -1;
+			}
+			len = inend - inpos;
+			break;
+		}
+	}
+	line->ptr = inbuf + inpos;
+	line->len = len;
+	inpos += len + (inpos + len < inend);
+	return len;
+}
+
+/* Map standard input into memory if it's a regular file so that the parser
+   can read it in place.  inbuf then holds the whole file and inpos is the
+   current file offset.  Standard input is read normally if this fails. */
+void map_input(void) {
+	struct stat sb;
+	off_t offset;
+	void *map;
+
+#ifdef	GZIP_SUPPORT
+	if (open_compressed_input()) {
+		return;
+	}
+#endif	/* GZIP_SUPPORT */
+	if (fstat(infd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0 || (unsigned long long)sb.st_size > SIZE_MAX
+	    || (offset = lseek(infd, 0, SEEK_CUR)) == -1 || offset > sb.st_size) {
+		return;
+	}
+	if ((map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, infd, 0)) == MAP_FAILED) {
+		return;
+	}
+#ifdef	MADV_SEQUENTIAL
+	(void) madvise(map, sb.st_size, MADV_SEQUENTIAL);
+#endif	/* MADV_SEQUENTIAL */
+	inbuf = map;
+	inbufcap = inend = sb.st_size;
+	inpos = offset;
+	ineof = inmapped = 1;
+}
+
+/* Release inbuf.  If standard input was mapped, then its file offset is
+   moved past the consumed input, as if it had been read. */
+void free_input(void) {
+#ifdef	GZIP_SUPPORT
+	if (compressedinput) {
+		(void) inflateEnd(&instream);
+		free(inraw);
+		free(inmembers);
+		inraw = NULL;
+		inmembers = NULL;
+		numinmembers = 0;
+		compressedinput = 0;
+	}
+#endif	/* GZIP_SUPPORT */
+	if (inmapped) {
+		(void) lseek(infd, (off_t)inpos, SEEK_SET);
+		(void) munmap(inbuf, inbufcap);
+	} else {
+		free(inbuf);
+	}
+	inbuf = NULL;
+}
+
+/* Parse an index extension Index Entry value into record (except for its
+   path, which is stored in *path). */
+int parse_index_record(size_t lineno, slice_t value, index_record_t *record, slice_t *path) {
+	slice_t fields[4];
+	char type[KEY_MAX + 1];
+	unsigned long long number;
+	const char *space;
+	size_t n;
+
+	*path = value;
+	for (n = 0; n < 4; n++) {
+		if ((space = memchr(path->ptr, ' ', path->len)) == NULL) {
+			break;
+		}
+		fields[n].ptr = path->ptr;
+		fields[n].len = space - path->ptr;
+		path->ptr = space + 1;
+		path->len -= fields[n].len + 1;
+	}
+	if (n == 4 && path->len > 0 && parse_number(fields[0], 10, ULLONG_MAX, &record->offset) == 0
+	    && parse_number(fields[1], 10, SIZE_MAX, &number) == 0 && parse_number(fields[2], 10, ULLONG_MAX, &record->size) == 0) {
+		record->lineno = number;
+		if ((record->type = parse_file_type(type, transformkey(fields[3], type))) != UNKNOWN && (record->type != DELETED || (extensions & EXTENSION_INCREMENTAL)) && (record->type != HARDLINK || (extensions & EXTENSION_HARDLINK))) {
+			return 0;
+		}
+	}
+	(void) fprintf(stderr, "%s:%zu: invalid index entry: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+	return 1;
+}
+
+/* archive parser states */
+enum { SEEKING_METADATA, METADATA, CONTENTS_END, CONTENTS_TRAILER, INDEX, ARCHIVE_METADATA };
+
+/* Read the Content Checksum line that follows the current entry's contents
+   and their closing "---" line into fchecksum without consuming input.
+   That's possible if they're buffered or mapped, or if standard input is
+   a seekable uncompressed file.  Returns nonzero if the line was read. */
+int peek_trailing_checksum(void) {
+	static char unseekable;
+	char buffer[128], key[KEY_MAX + 1];
+	const char *p, *newline;
+	slice_t line, value;
+	size_t len;
+	ssize_t numread;
+	off_t offset;
+	int keyid, n;
+
+	if (fsize <= inend - inpos) {
+		p = inbuf + inpos + fsize;
+		len = inend - inpos - fsize;
+	} else if (inmapped || compressedinput || unseekable) {
+		return 0;
+	} else if ((offset = lseek(infd, 0, SEEK_CUR)) == -1) {
+		unseekable = 1;
+		return 0;
+	} else {
+		while ((numread = pread(infd, buffer, sizeof (buffer), offset - (off_t)(inend - inpos) + (off_t)fsize)) < 0 && errno == EINTR) {
+		}
+		if (numread < 0) {
+			return 0;
+		}
+		p = buffer;
+		len = numread;
+	}
+	for (n = 0; n < 2; n++, len -= newline + 1 - p, p = newline + 1) {
+		if ((newline = memchr(p, '\n', len < sizeof (buffer) ? len : sizeof (buffer))) == NULL) {
+			return 0;
+		}
+		line.ptr = p;
+		line.len = newline - p;
+		if (parsemetadata(line, key, &keyid, &value) != 0 || (n == 0 ? keyid != KEY_NONE || !slice_equals(value, "---") : keyid != KEY_CONTENTCHECKSUM)) {
+			return 0;
+		}
+	}
+	if (parse_checksum(value, &fchecksum) != 0) {
+		return 0;
+	}
+	fchecksumgiven = 1;
+	return 1;
+}
+
+/* Check the current entry's Content Checksum line, which follows its
+   contents, if it couldn't be read before them. */
+int handle_trailing_checksum(size_t lineno, slice_t value) {
+	uint32_t checksum;
+
+	if (parse_checksum(value, &checksum) != 0) {
+		(void) fprintf(stderr, "%s:%zu: invalid content checksum: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+		return 1;
+	}
+	return checksumfollows && contentscrcknown && check_checksum(lineno, fpath, checksum, contentscrc);
+}
+
+/* Check a line of the index extension's trailer.  The trailer ends after
+   its Index Offset line. */
+int handle_index_metadata(size_t lineno, int keyid, const char *key, slice_t value, int *state) {
+	index_record_t record;
+	slice_t path;
+
+	switch (keyid) {
+	case KEY_NONE:
+		(void) fprintf(stderr, "%s:%zu: invalid metadata key-value pair (missing key)\n", inname, lineno);
+		return 1;
+	case KEY_INDEXENTRY:
+		return parse_index_record(lineno, value, &record, &path);
+	case KEY_INDEXOFFSET:
+		*state = SEEKING_METADATA;
+		return 0;
+	}
+	(void) fprintf(stderr, "%s:%zu: unexpected metadata in index: %s\n", inname, lineno, key);
+	return 1;
+}
+
+/* Return nonzero if keyid is an archive metadata key, which begins another
+   archive if it follows file entries. */
+int is_archive_metadata_key(int keyid) {
+	return keyid == KEY_METADATAENCODING || keyid == KEY_EXTENSIONS || keyid == KEY_ARCHIVECREATIONDATE;
+}
+
+/* Handle a line of archive metadata.  extensions must be cleared before an
+   archive's first line is handled. */
+int handle_archive_metadata(size_t lineno, int keyid, const char *key, slice_t value) {
+	char name[KEY_MAX + 1];
+	slice_t item;
+	const char *comma;
+	size_t n;
+
+	switch (keyid) {
+	case KEY_NONE:
+		(void) fprintf(stderr, "%s:%zu: illegal archive metadata key-value pair (missing key)\n", inname, lineno);
+		return 1;
+	case KEY_METADATAENCODING:
+		transformkey(value, name);
+		if (strcmp(name, "utf-8") != 0 && strcmp(name, "utf8") != 0 && strcmp(name, "ascii") != 0) {
+			(void) fprintf(stderr, "%s:%zu: unrecognized metadata encoding: %.*s\n", inname, lineno, (int)value.len, value.ptr);
+			return 1;
+		}
+		break;
+	case KEY_EXTENSIONS:
+		for (; value.len > 0; value.len -= item.len + (comma != NULL), value.ptr += item.len + (comma != NULL)) {
+			item.ptr = value.ptr;
+			item.len = (comma = memchr(value.ptr, ',', value.len)) != NULL ? (size_t)(comma - value.ptr) : value.len;
+			transformkey(item, name);
+			if (*name == '\0') {
+				continue;
+			}
+			for (n = 0; n < NUM_EXTENSIONS && strcmp(name, extensionnames[n]) != 0; n++) {
+			}
+			if (n == NUM_EXTENSIONS) {
+				(void) fprintf(stderr, "%s:%zu: unrecognized extension: %s\n", inname, lineno, name);
+				return 1;
+			}
+			extensions |= 1U << n;
+		}
+		break;
+	case KEY_ARCHIVECREATIONDATE:
+		break;
+	default:
+		(void) fprintf(stderr, "%s:%zu: unrecognized archive metadata key: %s\n", inname, lineno, key);
+		return 1;
+	}
+	return 0;
+}
+
+/* Parse the archive metadata at the beginning of standard input.  *lineno
+   is set to the number of the first line after the archive metadata and
+   *ended is set to 1 if the archive has no file entries. */
+int scan_archive_metadata(size_t *lineno, int *ended) {
+	char key[KEY_MAX + 1];
+	slice_t line, value;
+	ssize_t numread;
+	int keyid;
+
+	extensions = 0;
+	for (*lineno = 1; (numread = read_line(&line)) != -1; ++*lineno) {
+		if (parsemetadata(line, key, &keyid, &value) != 0) {
+			++*lineno;
+			break;
+		} else if (handle_archive_metadata(*lineno, keyid, key, value)) {
+			return 1;
+		}
+	}
+	if (inerrno != 0) {
+		(void) fprintf(stderr, "%s:%zu: %s\n", inname, *lineno, strerror(inerrno));
+		return 1;
+	}
+	*ended = numread == -1;
+	return 0;
+}
+
+/* Parse file entries from standard input, starting at line lineno, and
+   call onentry for each.  If single is nonzero, then stop after the first
+   entry, and stop after the entry that starts at lastrequestedline if it's
+   set.  Archives appended to the first one (such as a chain of incremental
+   archives) are read as if they were part of it. */
+int scan_entries(int (*onentry)(size_t), size_t lineno, int single) {
+	char key[KEY_MAX + 1];
+	slice_t line, value;
+	size_t entryline;
+	int state, keyid, result;
+
+	state = SEEKING_METADATA;
+	entryline = 0;
+	for (; read_line(&line) != -1; lineno++) {
+		if (state == CONTENTS_TRAILER) {
+			/* any other line begins whatever follows the entry */
+			state = SEEKING_METADATA;
+			if (parsemetadata(line, key, &keyid, &value) == 0 && keyid == KEY_CONTENTCHECKSUM) {
+				if (handle_trailing_checksum(lineno, value)) {
+					return 1;
+				} else if (single || (lastrequestedline != 0 && entryline >= lastrequestedline)) {
+					return 0;
+				}
+				continue;
+			} else if (single || (lastrequestedline != 0 && entryline >= lastrequestedline)) {
+				return 0;
+			}
+		}
+		switch (state) {
+		case SEEKING_METADATA:
+			if (parsemetadata(line, key, &keyid, &value) == 0) {
+				if (keyid == KEY_NONE) {
+					(void) fprintf(stderr, "%s:%zu: invalid metadata key-value pair (missing key)\n", inname, lineno);
+					return 1;
+				} else if (is_archive_metadata_key(keyid)) {
+					extensions = 0;
+					if (handle_archive_metadata(lineno, keyid, key, value)) {
+						return 1;
+					}
+					state = ARCHIVE_METADATA;
+				} else if ((extensions & EXTENSION_INDEX) && (keyid == KEY_INDEXENTRY || keyid == KEY_INDEXOFFSET)) {
+					state = INDEX;
+					if (handle_index_metadata(lineno, keyid, key, value, &state)) {
+						return 1;
+					}
+				} else {
+					if (handle_metadata(lineno, keyid, key, value)) {
+						return 1;
+					}
+					entryline = lineno;
+					state = METADATA;
+				}
+			}
+			break;
+		case METADATA:
+			if ((result = parsemetadata(line, key, &keyid, &value)) == 0 && !is_archive_metadata_key(keyid)) {
+				if (keyid != KEY_NONE) {
+					if (handle_metadata(lineno, keyid, key, value)) {
+						return 1;
+					}
+				} else {
+					if (slice_equals(value, "---")) {
+						if (ftype != REGULARFILE) {
+							(void) fprintf(stderr, "%s:%zu: file contents marker found for non-regular file\n", inname, lineno);
+							return 1;
+						} else if (fsamecontentsgiven) {
+							(void) fprintf(stderr, "%s:%zu: file contents marker found for file with the same contents as another\n", inname, lineno);
+							return 1;
+						} else if (!fsizegiven) {
+							(void) fprintf(stderr, "%s:%zu: file contents marker found but no file size specified\n", inname, lineno);
+							return 1;
+						} else if ((fsparsesizegiven || fsparsemapgiven) && check_sparse_map(lineno)) {
+							return 1;
+						}
+						checksumfollows = (extensions & EXTENSION_CHECKSUM) && !fchecksumgiven && !peek_trailing_checksum();
+						contentscrcknown = 0;
+						if (onentry(lineno)) {
+							return 1;
+						}
+						clear_metadata();
+						state = CONTENTS_END;
+					} else {
+						(void) fprintf(stderr, "%s:%zu: invalid metadata key-value pair (missing key)\n", inname, lineno);
+						return 1;
+					}
+				}
+			} else {
+				if (ftype == REGULARFILE && !fsamecontentsgiven) {
+					(void) fprintf(stderr, "%s:%zu: end of regular file metadata reached but no file contents\n", inname, lineno);
+					return 1;
+				} else if (onentry(lineno)) {
+					return 1;
+				}
+				clear_metadata();
+				if (single || (lastrequestedline != 0 && entryline >= lastrequestedline)) {
+					return 0;
+				}
+				state = SEEKING_METADATA;
+				if (result == 0) {
+					/* another archive begins without a blank line */
+					extensions = 0;
+					if (handle_archive_metadata(lineno, keyid, key, value)) {
+						return 1;
+					}
+					state = ARCHIVE_METADATA;
+				}
+			}
+			break;
+		case CONTENTS_END:
+			if (parsemetadata(line, key, &keyid, &value) == 0) {
+				if (keyid != KEY_NONE) {
+					(void) fprintf(stderr, "%s:%zu: unexpected metadata (expected end-of-file-contents marker \"---\")\n", inname, lineno);
+					return 1;
+				} else if (!slice_equals(value, "---")) {
+					(void) fprintf(stderr, "%s:%zu: unexpected additional file data found (expected end-of-file contents marker \"---\" after %zu bytes)\n", inname, lineno, fsize);
+					return 1;
+				}
+				if (extensions & EXTENSION_CHECKSUM) {
+					state = CONTENTS_TRAILER;
+					break;
+				} else if (single || (lastrequestedline != 0 && entryline >= lastrequestedline)) {
+					return 0;
+				}
+				state = SEEKING_METADATA;
+			} else {
+				(void) fprintf(stderr, "%s:%zu: unexpected additional file data found (expected end-of-file contents marker \"---\" after %zu bytes)\n", inname, lineno, fsize);
+				return 1;
+			}
+			break;
+		case INDEX:
+			if (parsemetadata(line, key, &keyid, &value) != 0) {
+				state = SEEKING_METADATA;
+			} else if (handle_index_metadata(lineno, keyid, key, value, &state)) {
+				return 1;
+			}
+			break;
+		case ARCHIVE_METADATA:
+			if (parsemetadata(line, key, &keyid, &value) != 0) {
+				state = SEEKING_METADATA;
+			} else if (handle_archive_metadata(lineno, keyid, key, value)) {
+				return 1;
+			}
+			break;
+		default:
+			abort();
+			break;
+		}
+	}
+	if (inerrno != 0) {
+		(void) fprintf(stderr, "%s:%zu: %s\n", inname, lineno, strerror(inerrno));
+		return 1;
+	} else if (state == METADATA) {
+		if (ftype == REGULARFILE && !fsamecontentsgiven) {
+			(void) fprintf(stderr, "%s:%zu: end-of-file reached before reading file contents\n", inname, lineno);
+			return 1;
+		} else if (onentry(lineno)) {
+			return 1;
+		}
+		clear_metadata();
+	} else if (state == CONTENTS_END) {
+		(void) fprintf(stderr, "%s:%zu: end-of-file reached while reading file contents\n", inname, lineno);
+		return 1;
+	}
+	return 0;
+}
+
+int scan_archive(int (*onentry)(size_t)) {
+	size_t lineno;
+	int ended;
+
+	if (scan_archive_metadata(&lineno, &ended) != 0) {
+		return 1;
+	}
+	return ended ? 0 : scan_entries(onentry, lineno, 0);
+}
+
+/* Reposition standard input at offset bytes from the archive's start. */
+int seek_input(unsigned long long offset) {
+	if (inmapped) {
+		inpos = offset < inend - archivestart ? archivestart + offset : inend;
+		return 0;
+	}
+#ifdef	GZIP_SUPPORT
+	if (compressedinput) {
+		return seek_compressed(archivestart + offset);
+	}
+#endif	/* GZIP_SUPPORT */
+	if (lseek(infd, archivestart + (off_t)offset, SEEK_SET) == -1) {
+		perror(inname);
+		return 1;
+	}
+	inpos = inend = 0;
+	ineof = 0;
+	return 0;
+}
+
+/* Read count bytes of the archive at offset like pread(2).  Compressed
+   input continues after them. */
+ssize_t read_input_at(char *buffer, size_t count, off_t offset) {
+#ifdef	GZIP_SUPPORT
+	size_t n, numread;
+
+	if (compressedinput) {
+		if (seek_compressed(offset) != 0) {
+			return -1;
+		}
+		for (n = 0; n < count; n += numread) {
+			if (inpos == inend && fill_input() <= 0) {
+				break;
+			}
+			numread = consume_buffered_input(count - n);
+			(void) memcpy(buffer + n, inbuf + inpos - numread, numread);
+		}
+		return n;
+	}
+#endif	/* GZIP_SUPPORT */
+	return pread(infd, buffer, count, offset);
+}
+
+/* Load the index extension's records if standard input is seekable and the
+   archive has an index.  Returns -1 if there is no usable index (in which
+   case standard input is rewound), 0 if the index was loaded, and 1 on
+   error.  The trailer of an appended archive points into the first one,
+   so an index containing lines other than Index Entry lines is unusable
+   rather than invalid. */
+int load_index(void) {
+	char trailer[INDEX_TRAILER_SIZE + 1], key[KEY_MAX + 1], *buffer, *end;
+	unsigned long long indexoffset;
+	struct stat sb;
+	slice_t records, line, value, path;
+	const char *newline;
+	size_t lineno, len, pathcap;
+	ssize_t numread;
+	off_t size;
+	int ended, keyid;
+
+	if (compressedinput) {
+#ifdef	GZIP_SUPPORT
+		/* offsets are within the decompressed archive */
+		if (numinmembers == 0) {
+			return -1;
+		}
+		size = inmembers[numinmembers - 1].start;
+		archivestart = 0;
+#endif	/* GZIP_SUPPORT */
+	} else if (fstat(infd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+		return -1;
+	} else if (inmapped) {
+		size = sb.st_size;
+		archivestart = inpos;
+	} else if ((size = sb.st_size, archivestart = lseek(infd, 0, SEEK_CUR)) == -1) {
+		return -1;
+	}
+	if (scan_archive_metadata(&lineno, &ended) != 0) {
+		return 1;
+	} else if (ended || !(extensions & EXTENSION_INDEX) || size - archivestart < (off_t)INDEX_TRAILER_SIZE) {
+		return seek_input(0) ? 1 : -1;
+	}
+
+	/* the archive must end with the trailer or entries were appended */
+	if (read_input_at(trailer, INDEX_TRAILER_SIZE, size - INDEX_TRAILER_SIZE) != (ssize_t)INDEX_TRAILER_SIZE) {
+		return seek_input(0) ? 1 : -1;
+	}
+	trailer[INDEX_TRAILER_SIZE] = '\0';
+	errno = 0;
+	if (strncmp(trailer, INDEX_TRAILER_PREFIX, sizeof (INDEX_TRAILER_PREFIX) - 1) != 0 || trailer[INDEX_TRAILER_SIZE - 1] != '\n'
+	    || (indexoffset = strtoull(trailer + sizeof (INDEX_TRAILER_PREFIX) - 1, &end, 10)) > (unsigned long long)(size - archivestart) - INDEX_TRAILER_SIZE
+	    || errno != 0 || *end != '\n') {
+		return seek_input(0) ? 1 : -1;
+	}
+
+	len = size - archivestart - INDEX_TRAILER_SIZE - indexoffset;
+	buffer = NULL;
+	if (inmapped) {
+		records.ptr = inbuf + archivestart + indexoffset;
+	} else {
+		if ((buffer = malloc(len > 0 ? len : 1)) == NULL) {
+			(void) fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		if ((numread = read_input_at(buffer, len, archivestart + indexoffset)) != (ssize_t)len) {
+			(void) fprintf(stderr, "%s: couldn't read index: %s\n", inname, numread < 0 ? strerror(errno) : "unexpected end-of-file");
+			free(buffer);
+			return 1;
+		}
+		records.ptr = buffer;
+	}
+	for (records.len = len; records.len > 0; records.ptr = newline + 1, records.len -= line.len + 1) {
+		if ((newline = memchr(records.ptr, '\n', records.len)) == NULL) {
+			(void) fprintf(stderr, "%s: index ends unexpectedly\n", inname);
+			free(buffer);
+			return 1;
+		}
+		line.ptr = records.ptr;
+		line.len = newline - records.ptr;
+		if (parsemetadata(line, key, &keyid, &value) != 0 || keyid != KEY_INDEXENTRY) {
+			free(buffer);
+			free_index();
+			return seek_input(0) ? 1 : -1;
+		}
+		if (numindexrecords == indexrecordscap && (indexrecords = realloc(indexrecords, (indexrecordscap = indexrecordscap * 2 + 64) * sizeof (*indexrecords))) == NULL) {
+			(void) fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		if (parse_index_record(0, value, &indexrecords[numindexrecords], &path) != 0) {
+			free(buffer);
+			return 1;
+		}
+		indexrecords[numindexrecords].path = NULL;
+		pathcap = 0;
+		copy_slice(&indexrecords[numindexrecords].path, &pathcap, path);
+		numindexrecords++;
+	}
+	free(buffer);
+	return 0;
+}
+
+/* List the paths in the loaded index (for 't' command). */
+int list_index(void) {
+	size_t n;
+
+	for (n = 0; n < numindexrecords; n++) {
+		if (indexrecords[n].type != DELETED) {
+			printline(indexrecords[n].path);
+		}
+	}
+	return 0;
+}
+
+/* Consume up to count buffered bytes, returning how many were consumed. */
+size_t consume_buffered_input(size_t count) {
+	if (count > inend - inpos) {
+		count = inend - inpos;
+	}
+	inpos += count;
+	return count;
+}
+
+/* Discard the next count bytes of standard input. */
+int skip_input(size_t lineno, size_t count) {
+	ssize_t numread;
+
+	for (count -= consume_buffered_input(count); count > 0; count -= consume_buffered_input(count)) {
+		if ((numread = fill_input()) < 0) {
+			(void) fprintf(stderr, "%s:%zu: error while reading: %s\n", inname, lineno, strerror(inerrno));
+			return 1;
+		} else if (numread == 0) {
+			(void) fprintf(stderr, "%s:%zu: end-of-file reached while reading file contents (bad file size?)\n", inname, lineno);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int skip_file_data_read(size_t lineno) {
+	return skip_input(lineno, fsize);
+}
+
+int skip_file_data_seek(size_t lineno) {
+	size_t numleft;
+
+	numleft = fsize - consume_buffered_input(fsize);
+	if (numleft > 0 && compressedinput) {
+#ifdef	GZIP_SUPPORT
+		if (numleft > COMPRESS_BLOCKSIZE && numinmembers > 0) {
+			/* skip whole members without decompressing them */
+			return seek_compressed(inoffset + numleft);
+		}
+#endif	/* GZIP_SUPPORT */
+		return skip_input(lineno, numleft);
+	} else if (numleft > 0 && !inmapped && lseek(infd, (off_t)numleft, SEEK_CUR) == -1) {
+		if (errno == EBADF || errno == ESPIPE) {
+			/* fall back on read(2) if lseek(2) fails on stdin */
+			skip_file_data = skip_file_data_read;
+			return skip_input(lineno, numleft);
+		} else {
+			(void) fprintf(stderr, "%s:%zu: error while reading: %s\n", inname, lineno, strerror(errno));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Consume the current entry's contents and verify their checksum. */
+int verify_file_data(size_t lineno) {
+	size_t numleft, numconsumed;
+	ssize_t numread;
+	uint32_t crc;
+
+	crc = 0;
+	for (numleft = fsize; numleft > 0; numleft -= numconsumed) {
+		if (inend == inpos) {
+			if ((numread = fill_input()) < 0) {
+				(void) fprintf(stderr, "%s:%zu: error while reading: %s\n", inname, lineno, strerror(inerrno));
+				return 1;
+			} else if (numread == 0) {
+				(void) fprintf(stderr, "%s:%zu: end-of-file reached while reading file contents (bad file size?)\n", inname, lineno);
+				return 1;
+			}
+		}
+		numconsumed = consume_buffered_input(numleft);
+		crc = crc32c(crc, inbuf + inpos - numconsumed, numconsumed);
+	}
+	return settle_checksum(lineno, crc);
+}
+
+/* Write count bytes to fd, retrying after short writes. */
+int write_fully(int fd, const char *buffer, size_t count) {
+	ssize_t numwritten;
+
+	while (count > 0) {
+		if ((numwritten = write(fd, buffer, count)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		buffer += numwritten;
+		count -= numwritten;
+	}
+	return 0;
+}
+
+/* The copy_input_*() functions move up to count bytes from file descriptor
+   0 to fd without going through inbuf, which must be empty.  Each returns
+   the number of bytes moved, 0 at end-of-file, or -1 on error.  A method
+   that isn't supported for these descriptors is replaced with the next
+   one. */
+
+ssize_t copy_input_read(int fd, size_t count) {
+	ssize_t numread;
+
+	if ((numread = fill_input()) <= 0) {
+		return numread;
+	}
+	numread = consume_buffered_input(count);
+	if (write_fully(fd, inbuf + inpos - numread, numread) != 0) {
+		return -1;
+	}
+	return numread;
+}
+
+#ifdef	__linux__
+ssize_t copy_input_copy_range(int fd, size_t count) {
+	ssize_t numcopied;
+
+	while ((numcopied = copy_file_range(infd, NULL, fd, NULL, count, 0)) < 0 && errno == EINTR) {
+	}
+	if (numcopied < 0 && zerocopy_unsupported()) {
+		copy_input = copy_input_sendfile;
+		return copy_input_sendfile(fd, count);
+	}
+	return numcopied;
+}
+
+ssize_t copy_input_sendfile(int fd, size_t count) {
+	ssize_t numcopied;
+
+	while ((numcopied = sendfile(fd, infd, NULL, count)) < 0 && errno == EINTR) {
+	}
+	if (numcopied < 0 && zerocopy_unsupported()) {
+		copy_input = copy_input_read;
+		return copy_input_read(fd, count);
+	}
+	return numcopied;
+}
+
+ssize_t copy_input_splice(int fd, size_t count) {
+	ssize_t numcopied;
+
+	while ((numcopied = splice(infd, NULL, fd, NULL, count, SPLICE_F_MOVE)) < 0 && errno == EINTR) {
+	}
+	if (numcopied < 0 && zerocopy_unsupported()) {
+		copy_input = copy_input_read;
+		return copy_input_read(fd, count);
+	}
+	return numcopied;
+}
+#endif	/* __linux__ */
+
+/* Copy count bytes of standard input at offset to fd without disturbing
+   the parser's file offset.  If crc isn't NULL, then the bytes' CRC-32C is
+   added to it, which prevents zero-copy unless standard input is mapped. */
+int copy_input_range(int fd, off_t offset, size_t count, size_t lineno, const char *path, uint32_t *crc) {
+	char buffer[WRITE_BLOCKSIZE];
+	size_t numleft;
+	ssize_t numcopied;
+#ifdef	__linux__
+	int zerocopy;
+
+	zerocopy = count >= ZEROCOPY_MIN_SIZE && (crc == NULL || inmapped);
+#endif	/* __linux__ */
+	if (crc != NULL && inmapped) {
+		*crc = crc32c(*crc, inbuf + offset, count);
+		crc = NULL;
+	}
+	for (numleft = count; numleft > 0; numleft -= numcopied) {
+#ifdef	__linux__
+		if (zerocopy) {
+			if ((numcopied = copy_file_range(infd, &offset, fd, NULL, numleft > ZEROCOPY_BLOCKSIZE ? ZEROCOPY_BLOCKSIZE : numleft, 0)) < 0 && zerocopy_unsupported()) {
+				zerocopy = 0;
+				numcopied = 0;
+				continue;
+			}
+		} else
+#endif	/* __linux__ */
+		if ((numcopied = pread(infd, buffer, numleft < sizeof (buffer) ? numleft : sizeof (buffer), offset)) > 0) {
+			if (crc != NULL) {
+				*crc = crc32c(*crc, buffer, numcopied);
+			}
+			if (write_fully(fd, buffer, numcopied) != 0) {
+				perror(path);
+				return 1;
+			}
+			offset += numcopied;
+		}
+		if (numcopied == 0) {
+			(void) fprintf(stderr, "%s:%zu: end-of-file reached while reading file contents (bad file size?)\n", inname, lineno);
+			return 1;
+		} else if (numcopied < 0) {
+			if (errno == EINTR) {
+				numcopied = 0;
+				continue;
+			}
+			perror(path);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Copy the next count bytes of the current entry's contents from standard
+   input to fd, adding them to *crc unless crc is NULL. */
+int copy_input_stream(size_t lineno, int fd, size_t count, uint32_t *crc) {
+	size_t numleft, numbuffered;
+	ssize_t numcopied;
+
+	for (numleft = count; numleft > 0; numleft -= numcopied) {
+		if (inend > inpos) {
+			/* drain bytes that the metadata parser read ahead */
+			numbuffered = consume_buffered_input(numleft);
+			if (crc != NULL) {
+				*crc = crc32c(*crc, inbuf + inpos - numbuffered, numbuffered);
+			}
+			if (write_fully(fd, inbuf + inpos - numbuffered, numbuffered) != 0) {
+				perror(fpath);
+				return 1;
+			}
+			numcopied = numbuffered;
+			continue;
+		}
+		errno = 0;
+		if (inmapped || numleft < ZEROCOPY_MIN_SIZE || crc != NULL) {
+			if ((numcopied = copy_input_read(fd, numleft)) > 0 && crc != NULL) {
+				*crc = crc32c(*crc, inbuf + inpos - numcopied, numcopied);
+			}
+		} else {
+			numcopied = copy_input(fd, numleft > ZEROCOPY_BLOCKSIZE ? ZEROCOPY_BLOCKSIZE : numleft);
+		}
+		if (numcopied == 0) {
+			(void) fprintf(stderr, "%s:%zu: end-of-file reached while reading file contents (bad file size?)\n", inname, lineno);
+			return 1;
+		} else if (numcopied < 0) {
+			if (inerrno != 0) {
+				(void) fprintf(stderr, "%s:%zu: error while reading: %s\n", inname, lineno, strerror(inerrno));
+			} else {
+				perror(fpath);
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Copy the current entry's contents from standard input to fd and verify
+   their checksum if they have one.  (Mapped contents are verified before
+   they're copied.) */
+int extract_file_contents(size_t lineno, int fd) {
+	uint32_t crc;
+	int result;
+
+	crc = 0;
+	if (inmapped && fsize >= ZEROCOPY_MIN_SIZE && fsize <= inend - inpos) {
+		/* let the kernel copy large contents straight from the file */
+		if (fchecksumgiven && check_checksum(lineno, fpath, fchecksum, crc32c(0, inbuf + inpos, fsize))) {
 			return 1;
 		}
-	} else if (strcmp(key, "minor") == 0) {
-		if (fminor != -1) {
-			(void) fprintf(stderr, "stdin:%zu: file path already specified\n", lineno);
-			return 1;
+		result = copy_input_range(fd, (off_t)inpos, fsize, lineno, fpath, NULL);
+		inpos += fsize;
+		return result;
+	}
+	return copy_input_stream(lineno, fd, fsize, fchecksumgiven || checksumfollows ? &crc : NULL) || settle_checksum(lineno, crc);
+}
+
+int listfiles(size_t lineno) {
+	if (is_invalid_metadata()) {
+		(void) fprintf(stderr, "%s:%zu: incomplete file metadata\n", inname, lineno);
+		return 1;
+	}
+	if (ftype != DELETED) {
+		printline(fpath);
+	}
+	if (ftype == REGULARFILE && !fsamecontentsgiven) {
+		return fchecksumgiven || checksumfollows ? verify_file_data(lineno) : skip_file_data(lineno);
+	}
+	return 0;
+}
+
+/* Record an entry of a --since-archive archive in basefiles. */
+int record_base_file(size_t lineno) {
+	base_file_t *f, target;
+
+	if (is_invalid_metadata()) {
+		(void) fprintf(stderr, "%s:%zu: incomplete file metadata\n", inname, lineno);
+		return 1;
+	}
+	if (ftype == HARDLINK && basefilescap > 0 && (f = find_base_file(flinktarget, strlen(flinktarget)))->path != NULL) {
+		/* a hard link shares its target's metadata */
+		target = *f;
+		f = add_base_file(fpath, strlen(fpath));
+		target.path = f->path;
+		target.seen = f->seen;
+		target.root = f->root;
+		target.linktarget = target.linkedpath = NULL;
+		*f = target;
+		return 0;
+	}
+	f = add_base_file(fpath, strlen(fpath));
+	f->type = ftype;
+	f->size = fsparsemapgiven ? (unsigned long long)fsparsesize : fsize;
+	f->major = fmajor;
+	f->minor = fminor;
+	f->uid = fuid;
+	f->gid = fgid;
+	f->mode = fmode;
+	f->mtime = fmtime;
+	f->dev = fdev;
+	f->ino = fino;
+	f->hasinode = fdevgiven && finogiven;
+	if (ftype == REGULARFILE && !fsamecontentsgiven) {
+		return skip_file_data(lineno);
+	}
+	return 0;
+}
+
+/* Read the archive at path into basefiles.  Later archives' entries replace
+   earlier ones', so a full archive followed by the incremental archives
+   created after it describes the files that the last one saw. */
+int load_base_archive(const char *path) {
+	int error;
+
+	if ((infd = open(path, O_RDONLY)) == -1) {
+		perror(path);
+		infd = STDIN_FILENO;
+		return 1;
+	}
+	inname = path;
+	map_input();
+	error = scan_archive(record_base_file);
+	clear_metadata();
+	free_input();
+	(void) close(infd);
+	infd = STDIN_FILENO;
+	inname = "stdin";
+	inbufcap = inpos = inend = 0;
+	ineof = inmapped = 0;
+	inerrno = 0;
+	differential = 1;
+	return error;
+}
+
+/* Return nonzero if file_path matches a requested file, and mark the first
+   pattern that it matches as found. */
+int extract_if_requested_file(const char *file_path) {
+	pattern_t *pattern;
+
+	if ((pattern = match_pattern(&requestedfiles, file_path)) == NULL) {
+		return 0;
+	}
+	pattern->found = 1;
+	return 1;
+}
+
+/* Copy the contents of e->source, a file that was extracted earlier, to fd.
+   File systems that support reflinks can share the source's blocks. */
+int clone_file_contents(extract_entry_t *e, int fd) {
+	char buffer[WRITE_BLOCKSIZE];
+	size_t numleft;
+	ssize_t numcopied;
+	int sourcefd, result;
+#ifdef	__linux__
+	int zerocopy;
+
+	zerocopy = 1;
+#endif	/* __linux__ */
+	if ((sourcefd = open(e->source, O_RDONLY)) == -1) {
+		perror(e->source);
+		return 1;
+	}
+	result = 0;
+	for (numleft = e->size; numleft > 0; numleft -= numcopied) {
+#ifdef	__linux__
+		if (zerocopy) {
+			if ((numcopied = copy_file_range(sourcefd, NULL, fd, NULL, numleft > ZEROCOPY_BLOCKSIZE ? ZEROCOPY_BLOCKSIZE : numleft, 0)) < 0 && zerocopy_unsupported()) {
+				zerocopy = 0;
+				numcopied = 0;
+				continue;
+			}
+		} else
+#endif	/* __linux__ */
+		if ((numcopied = read(sourcefd, buffer, numleft < sizeof (buffer) ? numleft : sizeof (buffer))) > 0 && write_fully(fd, buffer, numcopied) != 0) {
+			perror(e->path);
+			result = 1;
+			break;
+		}
+		if (numcopied == 0) {
+			(void) fprintf(stderr, "%s:%zu: %s: %s is shorter than expected\n", inname, e->lineno, e->path, e->source);
+			result = 1;
+			break;
+		} else if (numcopied < 0) {
+			if (errno == EINTR) {
+				numcopied = 0;
+				continue;
+			}
+			perror(e->path);
+			result = 1;
+			break;
 		}
-		errno = 0;
-		fminor = strtol(value, &end, 10);
-		if (errno != 0 || end == value || *end != '\0') {
-			(void) fprintf(stderr, "stdin:%zu: invalid minor: %s\n", lineno, value);
+	}
+	(void) close(sourcefd);
+	return result;
+}
+
+int extract_file_contents_at(extract_entry_t *e, int fd) {
+	uint32_t crc;
+
+	if (!e->checksummed) {
+		return copy_input_range(fd, e->offset, e->size, e->lineno, e->path, NULL);
+	}
+	crc = 0;
+	return copy_input_range(fd, e->offset, e->size, e->lineno, e->path, &crc) || check_checksum(e->lineno, e->path, e->checksum, crc);
+}
+
+/* Move fd's offset from a hole's beginning at from to its end at to, either
+   with lseek(2) or, if fill is nonzero, by writing zeros. */
+int skip_hole(int fd, off_t from, off_t to, int fill) {
+	static const char zeros[WRITE_BLOCKSIZE];
+	size_t count;
+
+	if (!fill) {
+		return lseek(fd, to, SEEK_SET) == -1;
+	}
+	for (; from < to; from += count) {
+		count = to - from < (off_t)sizeof (zeros) ? (size_t)(to - from) : sizeof (zeros);
+		if (write_fully(fd, zeros, count) != 0) {
 			return 1;
 		}
-	} else if (strcmp(key, "username") == 0) {
-		if (fusername != NULL) {
-			(void) fprintf(stderr, "stdin:%zu: username already specified\n", lineno);
+	}
+	return 0;
+}
+
+/* Write e's contents, which are the sparse file's data extents one after
+   another, to fd at the extents' offsets.  Holes are skipped and the file
+   is then truncated to its size, or, if fill is nonzero, holes are written
+   as zeros (for standard output). */
+int extract_sparse_contents(extract_entry_t *e, int fd, int fill) {
+	uint32_t crc, *crcp;
+	off_t end, position;
+	size_t n, count;
+	int result;
+
+	crc = 0;
+	crcp = e->checksummed || (e->contents == NULL && e->offset == -1 && checksumfollows) ? &crc : NULL;
+	for (end = 0, position = 0, n = 0; n < e->numextents; n++) {
+		if (skip_hole(fd, end, e->extents[n].offset, fill) != 0) {
+			perror(e->path);
 			return 1;
 		}
-		fusername = safe_strdup(value);
-	} else if (strcmp(key, "userid") == 0) {
-		if (fuidgiven) {
-			(void) fprintf(stderr, "stdin:%zu: uid already specified\n", lineno);
-			return 1;
+		count = e->extents[n].length;
+		if (e->contents != NULL) {
+			if (crcp != NULL) {
+				crc = crc32c(crc, e->contents + position, count);
+			}
+			if ((result = write_fully(fd, e->contents + position, count)) != 0) {
+				perror(e->path);
+			}
+		} else if (e->offset != -1) {
+			result = copy_input_range(fd, e->offset + position, count, e->lineno, e->path, crcp);
+		} else {
+			result = copy_input_stream(e->lineno, fd, count, crcp);
 		}
-		errno = 0;
-		fuid = strtoul(value, &end, 10);
-		if (errno != 0 || end == value || *end != '\0') {
-			(void) fprintf(stderr, "stdin:%zu: invalid uid: %s\n", lineno, value);
+		if (result) {
 			return 1;
 		}
-		fuidgiven = 1;
-	} else if (strcmp(key, "groupname") == 0) {
-		if (fgroupname != NULL) {
-			(void) fprintf(stderr, "stdin:%zu: groupname already specified\n", lineno);
-			return 1;
+		position += count;
+		end = e->extents[n].offset + e->extents[n].length;
+	}
+	if (fill ? skip_hole(fd, end, e->sparsesize, 1) != 0 : ftruncate(fd, e->sparsesize) != 0) {
+		perror(e->path);
+		return 1;
+	}
+	if (e->contents == NULL && e->offset == -1) {
+		/* the contents were read from the stream */
+		return settle_checksum(e->lineno, crc);
+	}
+	return e->checksummed && check_checksum(e->lineno, e->path, e->checksum, crc);
+}
+
+void release_parent_directory(dir_handle_t *handle) {
+	if (handle == NULL) {
+		return;
+	}
+	(void) pthread_mutex_lock(&dirlock);
+	if (--handle->users == 0 && handle->stale) {
+		if (handle->fd != -1) {
+			(void) close(handle->fd);
 		}
-		fgroupname = safe_strdup(value);
-	} else if (strcmp(key, "groupid") == 0) {
-		if (fgidgiven) {
-			(void) fprintf(stderr, "stdin:%zu: gid already specified\n", lineno);
-			return 1;
+		free(handle->path);
+		handle->path = NULL;
+		if (handle->uncached) {
+			free(handle);
 		}
-		errno = 0;
-		fgid = strtoul(value, &end, 10);
-		if (errno != 0 || end == value || *end != '\0') {
-			(void) fprintf(stderr, "stdin:%zu: invalid gid: %s\n", lineno, value);
-			return 1;
+	}
+	(void) pthread_mutex_unlock(&dirlock);
+}
+
+/* Open the directory dir one component at a time with O_NOFOLLOW, so that
+   a symbolic link put in its place by an earlier entry or by another
+   process can't redirect extraction outside of it.  Returns -1 with errno
+   set on error. */
+int open_directory_nofollow(char *dir) {
+	char *component, *end, c;
+	int fd, nextfd, errnum;
+
+	fd = AT_FDCWD;
+	if (*dir == '/' && (fd = open("/", O_RDONLY | O_DIRECTORY)) == -1) {
+		return -1;
+	}
+	for (component = dir; *component != '\0'; component = end) {
+		if (*component == '/') {
+			end = component + 1;
+			continue;
 		}
-		fgidgiven = 1;
-	} else if (strcmp(key, "permissions") == 0) {
-		if (fmodegiven) {
-			(void) fprintf(stderr, "stdin:%zu: file permissions already specified\n", lineno);
-			return 1;
+		end = component + strcspn(component, "/");
+		c = *end;
+		*end = '\0';
+		nextfd = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		errnum = errno;
+		*end = c;
+		if (fd != AT_FDCWD) {
+			(void) close(fd);
 		}
-		errno = 0;
-		fmode = strtoul(value, &end, 8);
-		if (errno != 0 || end == value || *end != '\0' || (fmode & S_IFMT) != 0) {
-			(void) fprintf(stderr, "stdin:%zu: invalid file permissions: %s\n", lineno, value);
-			return 1;
+		if ((fd = nextfd) == -1) {
+			errno = errnum;
+			return -1;
 		}
-		fmodegiven = 1;
-	} else if (strcmp(key, "modificationtime") == 0) {
-		if (fmtimegiven) {
-			(void) fprintf(stderr, "stdin:%zu: file modification time already specified\n", lineno);
-			return 1;
+	}
+	return fd;
+}
+
+/* Open the parent directory of path for restore_file() and set *name to
+   path's last component, which is relative to the returned descriptor.
+   Recently used directories are kept open in dirhandles so that the kernel
+   doesn't resolve the same leading components for every file.  Returns
+   AT_FDCWD if path has no parent, or -1 on error.  Pass the result and
+   *handle to release_parent_directory() when done. */
+int open_parent_directory(const char *path, const char **name, dir_handle_t **handle) {
+	dir_handle_t *h, *victim;
+	const char *slash;
+	size_t len;
+	int fd;
+
+	*handle = NULL;
+	if ((slash = strrchr(path, '/')) == NULL || slash[1] == '\0') {
+		*name = path;
+		return AT_FDCWD;
+	}
+	*name = slash + 1;
+	len = slash == path ? 1 : (size_t)(slash - path);
+	(void) pthread_mutex_lock(&dirlock);
+	for (h = dirhandles, victim = NULL; h < dirhandles + DIRFD_CACHE_SIZE; h++) {
+		if (h->path != NULL && !h->stale && h->len == len && memcmp(h->path, path, len) == 0) {
+			h->users++;
+			h->lastuse = ++dirclock;
+			(void) pthread_mutex_unlock(&dirlock);
+			*handle = h;
+			return h->fd;
+		} else if (h->users == 0 && (victim == NULL || h->lastuse < victim->lastuse)) {
+			victim = h;
 		}
-		errno = 0;
-		fmtime = strtoull(value, &end, 10);
-		if (errno != 0 || end == value || *end != '\0') {
-			(void) fprintf(stderr, "stdin:%zu: invalid file modification time: %s\n", lineno, value);
-			return 1;
+	}
+	if ((h = victim) != NULL) {
+		if (h->path != NULL) {
+			(void) close(h->fd);
+			free(h->path);
 		}
-		fmtimegiven = 1;
-	} else {
-		(void) fprintf(stderr, "stdin:%zu: unrecognized metadata key name: %s\n", lineno, key);
+	} else if ((h = malloc(sizeof (*h))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((h->path = malloc(len + 1)) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	(void) memcpy(h->path, path, len);
+	h->path[len] = '\0';
+	h->len = len;
+	h->users = 1;
+	h->lastuse = ++dirclock;
+	/* a directory that can't be cached because every slot is in use is
+	   closed when it's released */
+	h->stale = h->uncached = victim == NULL;
+	if ((fd = h->fd = open_directory_nofollow(h->path)) == -1) {
+		perror(path);
+		h->stale = 1;
+	}
+	(void) pthread_mutex_unlock(&dirlock);
+	*handle = h;
+	if (fd == -1) {
+		release_parent_directory(h);
+		*handle = NULL;
+	}
+	return fd;
+}
+
+/* Forget cached directories at or below path, which was just removed.  (It
+   might have been a symbolic link to a directory.)  Directories that are in
+   use are closed when they're released. */
+void forget_directories(const char *path) {
+	dir_handle_t *h;
+	size_t len;
+
+	len = strlen(path);
+	(void) pthread_mutex_lock(&dirlock);
+	for (h = dirhandles; h < dirhandles + DIRFD_CACHE_SIZE; h++) {
+		if (h->path != NULL && h->len >= len && memcmp(h->path, path, len) == 0 && (h->len == len || h->path[len] == '/')) {
+			if (h->users > 0) {
+				h->stale = 1;
+			} else {
+				(void) close(h->fd);
+				free(h->path);
+				h->path = NULL;
+			}
+		}
+	}
+	(void) pthread_mutex_unlock(&dirlock);
+}
+
+void close_directories(void) {
+	dir_handle_t *h;
+
+	for (h = dirhandles; h < dirhandles + DIRFD_CACHE_SIZE; h++) {
+		if (h->path != NULL) {
+			(void) close(h->fd);
+			free(h->path);
+			h->path = NULL;
+		}
+	}
+}
+
+/* Forget deferred directories at or below path, which was just removed.
+   Directories are restored by the main thread, so no lock is needed. */
+void forget_deferred_directories(const char *path) {
+	size_t n, kept, len;
+
+	len = strlen(path);
+	for (n = kept = 0; n < numdeferreddirs; n++) {
+		if (strncmp(deferreddirs[n].path, path, len) == 0 && (deferreddirs[n].path[len] == '\0' || deferreddirs[n].path[len] == '/')) {
+			free(deferreddirs[n].path);
+		} else {
+			deferreddirs[kept++] = deferreddirs[n];
+		}
+	}
+	numdeferreddirs = kept;
+}
+
+/* Remove the file at path, which an incremental archive says was deleted.
+   A deleted directory's contents precede it in the archive, so it's empty
+   unless it has files that the archives don't know about. */
+int remove_deleted_file(const char *path) {
+	struct stat sb;
+
+	if (lstat(path, &sb) != 0) {
+		if (errno == ENOENT || errno == ENOTDIR) {
+			return 0;
+		}
+		perror(path);
+		return 1;
+	} else if ((S_ISDIR(sb.st_mode) ? rmdir(path) : unlink(path)) != 0 && errno != ENOENT) {
+		perror(path);
 		return 1;
 	}
+	forget_directories(path);
+	forget_deferred_directories(path);
 	return 0;
 }
 
-int is_invalid_metadata(void) {
-	if (!fpath) {
+/* Create the file described by e.  Directories' modification times are
+   deferred until finish_directories() is called.  Files are created
+   relative to their parent directories' descriptors and then changed
+   through their own descriptors where possible. */
+int restore_file_at(extract_entry_t *e, int dirfd, const char *name);
+
+int restore_file(extract_entry_t *e) {
+	dir_handle_t *handle;
+	const char *name;
+	int dirfd, result;
+
+	if (e->type == DELETED) {
+		return remove_deleted_file(e->path);
+	} else if ((dirfd = open_parent_directory(e->path, &name, &handle)) == -1) {
 		return 1;
 	}
-	switch (ftype) {
-	case UNKNOWN:
-		return 1;
-	case REGULARFILE:
-		if (!fsizegiven) {
+	result = restore_file_at(e, dirfd, name);
+	release_parent_directory(handle);
+	return result;
+}
+
+int restore_file_at(extract_entry_t *e, int dirfd, const char *name) {
+	int fd;
+	struct stat sb;
+	struct timespec times[2];
+	int result;
+
+	fd = -1;
+	if (e->type != DIRECTORY) {
+		if (unlinkat(dirfd, name, 0) == 0) {
+			forget_directories(e->path);
+		} else if (errno != ENOENT) {
+			perror(e->path);
 			return 1;
 		}
+	}
+	switch (e->type) {
+	case REGULARFILE:
+		result = 0;
+		if ((fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0666)) == -1) {
+			result = 1;
+		}
 		break;
 	case DIRECTORY:
+		if ((result = mkdirat(dirfd, name, e->mode)) != 0 && errno == EEXIST) {
+			if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(sb.st_mode)) {
+				result = fchmodat(dirfd, name, e->mode, 0);
+			}
+		}
 		break;
 	case SYMLINK:
-		if (!flinktarget) {
-			return 1;
-		}
+		result = symlinkat(e->linktarget, dirfd, name);
 		break;
 	case CHARDEVICE:
+		result = mknodat(dirfd, name, S_IFCHR | e->mode, makedev(e->major, e->minor));
+		break;
 	case BLOCKDEVICE:
-		if (fmajor == -1 || fminor == -1) {
-			return 1;
-		}
+		result = mknodat(dirfd, name, S_IFBLK | e->mode, makedev(e->major, e->minor));
 		break;
 	case FIFO:
+		result = mkfifoat(dirfd, name, e->mode);
 		break;
 	case SOCKET:
+		result = mknodat(dirfd, name, S_IFSOCK | e->mode, makedev(e->major, e->minor));
 		break;
+	case HARDLINK:
+		/* the link shares its target's owner, mode, and times */
+		if (linkat(AT_FDCWD, e->linktarget, dirfd, name, 0) != 0) {
+			perror(e->path);
+			return 1;
+		}
+		return 0;
 	default:
 		abort();
 		break;
 	}
-	return !fuidgiven || !fgidgiven || !fusername || !fgroupname || !fmtimegiven || !fmodegiven;
-}
+	if (result) {
+		perror(e->path);
+		return 1;
+	}
+	times[0].tv_sec = 0;
+	times[0].tv_nsec = UTIME_OMIT;
+	times[1].tv_sec = e->mtime;
+	times[1].tv_nsec = 0;
+	if (fd != -1) {
+		if (e->source != NULL) {
+			result = clone_file_contents(e, fd);
+		} else if (e->extents != NULL) {
+			result = extract_sparse_contents(e, fd, 0);
+		} else if (e->contents != NULL) {
+			if (e->checksummed && check_checksum(e->lineno, e->path, e->checksum, crc32c(0, e->contents, e->size))) {
+				result = 1;
+			} else if ((result = write_fully(fd, e->contents, e->size)) != 0) {
+				perror(e->path);
+			}
+		} else if (e->offset != -1) {
+			result = extract_file_contents_at(e, fd);
+		} else {
+			result = extract_file_contents(e->lineno, fd);
+		}
 
-void clear_metadata(void) {
-	free(fpath);
-	fpath = NULL;
-	ftype = UNKNOWN;
-	free(flinktarget);
-	flinktarget = NULL;
-	fmajor = -1;
-	fminor = -1;
-	free(fusername);
-	fusername = NULL;
-	free(fgroupname);
-	fgroupname = NULL;
-	fsizegiven = fuidgiven = fgidgiven = fmodegiven = fmtimegiven = 0;
+		/* set the owner first because chown(2) may clear set-user-ID and
+		   set-group-ID bits */
+		if (!result && ((e->chown && fchown(fd, e->uid, e->gid) != 0) || fchmod(fd, e->mode) != 0 || futimens(fd, times) != 0)) {
+			perror(e->path);
+			result = 1;
+		}
+		(void) close(fd);
+		return result;
+	}
+	if (e->type == DIRECTORY) {
+		if (numdeferreddirs == deferreddirscap && (deferreddirs = realloc(deferreddirs, (deferreddirscap = deferreddirscap * 2 + 16) * sizeof (*deferreddirs))) == NULL) {
+			(void) fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		deferreddirs[numdeferreddirs].path = safe_strdup(e->path);
+		deferreddirs[numdeferreddirs++].mtime = e->mtime;
+	} else if (utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW) != 0) {
+		perror(e->path);
+		return 1;
+	}
+	if (e->chown && fchownat(dirfd, name, e->uid, e->gid, AT_SYMLINK_NOFOLLOW) != 0) {
+		perror(e->path);
+		return 1;
+	}
+	return 0;
 }
 
-/* archive parser states */
-enum { SEEKING_METADATA, METADATA, CONTENTS_END };
-
-int scan_archive(int (*onentry)(size_t)) {
-	char *line, *key, *value;
-	size_t linecap, lineno;
-	ssize_t numread;
-	int state;
+/* Set the modification times of extracted directories. */
+int finish_directories(void) {
+	struct timespec times[2];
+	size_t n;
+	int error;
 
-	/* archive metadata first */
-	for (line = NULL, lineno = 1; (numread = getline(&line, &linecap, stdin)) != -1; lineno++) {
-		if (parsemetadata(line, &key, &value) != 0) {
-			break;
-		}
-		if (!key && value) {
-			(void) fprintf(stderr, "stdin:%zu: illegal archive metadata key-value pair (missing key)\n", lineno);
-			return 1;
+	error = 0;
+	times[0].tv_sec = 0;
+	times[0].tv_nsec = UTIME_OMIT;
+	times[1].tv_nsec = 0;
+	for (n = 0; n < numdeferreddirs; n++) {
+		times[1].tv_sec = deferreddirs[n].mtime;
+		if (!error && utimensat(AT_FDCWD, deferreddirs[n].path, times, AT_SYMLINK_NOFOLLOW) != 0) {
+			perror(deferreddirs[n].path);
+			error = 1;
 		}
-		if (strcmp(key, "metadataencoding") == 0) {
-			transformkey(value);
-			if (strcmp(value, "utf-8") != 0 && strcmp(value, "utf8") != 0 && strcmp(value, "ascii") != 0) {
-				(void) fprintf(stderr, "stdin:%zu: unrecognized metadata encoding: %s\n", lineno, value);
-				return 1;
-			}
-		} else if (strcmp(key, "extensions") == 0) {
-			transformkey(value);
-			if (*value != '\0') {
-				(void) fprintf(stderr, "stdin:%zu: unrecognized extensions: %s\n", lineno, value);
+		free(deferreddirs[n].path);
+	}
+	free(deferreddirs);
+	deferreddirs = NULL;
+	numdeferreddirs = deferreddirscap = 0;
+	return error;
+}
+
+/* Return nonzero if a queued entry's path equals path or one of its
+   ancestors.  queuelock must be held. */
+int is_busy_path(const char *path) {
+	extract_entry_t *e;
+	size_t len;
+
+	for (len = strlen(path); len > 0; ) {
+		for (e = busypaths[hash_bytes(path, len) % BUSY_BUCKETS]; e != NULL; e = e->nextbusy) {
+			if (strncmp(e->path, path, len) == 0 && e->path[len] == '\0') {
 				return 1;
 			}
-		} else if (strcmp(key, "archivecreationdate") != 0) {
-			(void) fprintf(stderr, "stdin:%zu: unrecognized archive metadata key: %s\n", lineno, key);
-			return 1;
+		}
+		while (len > 0 && path[--len] != '/') {
 		}
 	}
-	if (ferror(stdin)) {
-		(void) fprintf(stderr, "stdin:%zu: %s\n", lineno, strerror(errno));
-		return 1;
-	} else if (feof(stdin)) {
-		return 0;
+	return 0;
+}
+
+void free_extract_entry(extract_entry_t *e) {
+	free(e->path);
+	free(e->linktarget);
+	free(e->extents);
+	if (!e->mapped) {
+		free(e->contents);
 	}
+	free(e);
+}
 
-	/* now for the file entries */
-	state = SEEKING_METADATA;
-	for (; (numread = getline(&line, &linecap, stdin)) != -1; lineno++) {
-		switch (state) {
-		case SEEKING_METADATA:
-			if (parsemetadata(line, &key, &value) == 0) {
-				if (key == NULL) {
-					(void) fprintf(stderr, "stdin:%zu: invalid metadata key-value pair (missing key)\n", lineno);
-					return 1;
-				} else {
-					if (handle_metadata(lineno, key, value)) {
-						return 1;
-					}
-					state = METADATA;
-				}
-			}
+/* the body of each -j thread */
+void *restore_queued_files(void *unused) {
+	extract_entry_t *e, **busy;
+	int result;
+
+	(void) pthread_mutex_lock(&queuelock);
+	for (;;) {
+		while (extracthead == NULL && !queueclosed) {
+			(void) pthread_cond_wait(&queuework, &queuelock);
+		}
+		if ((e = extracthead) == NULL) {
 			break;
-		case METADATA:
-			if (parsemetadata(line, &key, &value) == 0) {
-				if (key) {
-					if (handle_metadata(lineno, key, value)) {
-						return 1;
-					}
-				} else {
-					if (strcmp(value, "---") == 0) {
-						if (ftype != REGULARFILE) {
-							(void) fprintf(stderr, "stdin:%zu: file contents marker found for non-regular file\n", lineno);
-							return 1;
-						} else if (!fsizegiven) {
-							(void) fprintf(stderr, "stdin:%zu: file contents marker found but no file size specified\n", lineno);
-							return 1;
-						} else if (onentry(lineno)) {
-							return 1;
-						}
-						clear_metadata();
-						state = CONTENTS_END;
-					} else {
-						(void) fprintf(stderr, "stdin:%zu: invalid metadata key-value pair (missing key)\n", lineno);
-						return 1;
-					}
-				}
+		}
+		if ((extracthead = e->next) == NULL) {
+			extracttail = NULL;
+		}
+		(void) pthread_mutex_unlock(&queuelock);
+		result = restore_file(e);
+		(void) pthread_mutex_lock(&queuelock);
+		if (result) {
+			extractfailed = 1;
+		}
+		for (busy = &busypaths[hash_bytes(e->path, strlen(e->path)) % BUSY_BUCKETS]; *busy != e; busy = &(*busy)->nextbusy) {
+		}
+		*busy = e->nextbusy;
+		queuelength--;
+		queuebytes -= e->charge;
+		free_extract_entry(e);
+		(void) pthread_cond_broadcast(&queueprepared);
+	}
+	(void) pthread_mutex_unlock(&queuelock);
+	return NULL;
+}
+
+/* Wait until the -j threads have restored every queued entry.  Returns
+   nonzero if any of them failed. */
+int wait_for_restored_files(void) {
+	int failed;
+
+	(void) pthread_mutex_lock(&queuelock);
+	while (queuelength > 0) {
+		(void) pthread_cond_wait(&queueprepared, &queuelock);
+	}
+	failed = extractfailed;
+	(void) pthread_mutex_unlock(&queuelock);
+	return failed;
+}
+
+/* Read the current entry's contents from standard input into memory.  If
+   their checksum follows them, then their CRC-32C is saved for it. */
+char *read_file_contents(size_t lineno) {
+	char *contents;
+	size_t numread;
+	ssize_t result;
+
+	if ((contents = malloc(fsize > 0 ? fsize : 1)) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (numread = 0; numread < fsize; ) {
+		if (inend == inpos && (result = fill_input()) <= 0) {
+			if (result < 0) {
+				(void) fprintf(stderr, "%s:%zu: error while reading: %s\n", inname, lineno, strerror(inerrno));
 			} else {
-				if (ftype == REGULARFILE) {
-					(void) fprintf(stderr, "stdin:%zu: end of regular file metadata reached but no file contents\n", lineno);
-					return 1;
-				} else if (onentry(lineno)) {
-					return 1;
-				}
-				clear_metadata();
-				state = SEEKING_METADATA;
+				(void) fprintf(stderr, "%s:%zu: end-of-file reached while reading file contents (bad file size?)\n", inname, lineno);
 			}
-			break;
-		case CONTENTS_END:
-			if (parsemetadata(line, &key, &value) == 0) {
-				if (key) {
-					(void) fprintf(stderr, "stdin:%zu: unexpected metadata (expected end-of-file-contents marker \"---\")\n", lineno);
-					return 1;
-				} else if (strcmp(value, "---") != 0) {
-					(void) fprintf(stderr, "stdin:%zu: unexpected additional file data found (expected end-of-file contents marker \"---\" after %zu bytes)\n", lineno, fsize);
-					return 1;
-				}
-				state = SEEKING_METADATA;
+			free(contents);
+			return NULL;
+		}
+		result = consume_buffered_input(fsize - numread);
+		(void) memcpy(contents + numread, inbuf + inpos - result, result);
+		numread += result;
+	}
+	if (checksumfollows) {
+		(void) settle_checksum(lineno, crc32c(0, contents, fsize));
+	}
+	return contents;
+}
+
+/* Copy entry, whose metadata buffers are reused by the next entry. */
+extract_entry_t *copy_extract_entry(const extract_entry_t *entry) {
+	extract_entry_t *e;
+
+	if ((e = malloc(sizeof (*e))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	*e = *entry;
+	e->next = NULL;
+	e->path = safe_strdup(entry->path);
+	e->linktarget = entry->linktarget != NULL ? safe_strdup(entry->linktarget) : NULL;
+	if (entry->extents != NULL) {
+		if ((e->extents = malloc(entry->numextents * sizeof (*e->extents))) == NULL) {
+			(void) fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		(void) memcpy(e->extents, entry->extents, entry->numextents * sizeof (*e->extents));
+	}
+	return e;
+}
+
+/* Hand the current entry to the -j threads.  Directories are created
+   immediately so that they exist before their contents are extracted. */
+int queue_extract_entry(size_t lineno, extract_entry_t *entry) {
+	extract_entry_t *e, **busy;
+	int failed;
+
+	(void) pthread_mutex_lock(&queuelock);
+	while (!extractfailed && is_busy_path(entry->path)) {
+		(void) pthread_cond_wait(&queueprepared, &queuelock);
+	}
+	if (extractfailed) {
+		(void) pthread_mutex_unlock(&queuelock);
+		return 1;
+	}
+	(void) pthread_mutex_unlock(&queuelock);
+	if (entry->type == DIRECTORY) {
+		return restore_file(entry);
+	} else if (entry->type == DELETED) {
+		/* earlier entries might be below the path */
+		return wait_for_restored_files() || restore_file(entry);
+	} else if (entry->source != NULL) {
+		/* the earlier entry's file must be complete */
+		return wait_for_restored_files() || restore_file(entry);
+	} else if (entry->type == HARDLINK) {
+		/* the earlier entry's file must exist, but the link is cheap
+		   enough to make here once it does */
+		(void) pthread_mutex_lock(&queuelock);
+		while (!extractfailed && is_busy_path(entry->linktarget)) {
+			(void) pthread_cond_wait(&queueprepared, &queuelock);
+		}
+		failed = extractfailed;
+		(void) pthread_mutex_unlock(&queuelock);
+		return failed || restore_file(entry);
+	} else if (entry->type == REGULARFILE && entry->offset == -1) {
+		if (inmapped) {
+			/* the contents are already in memory */
+			if (fsize > inend - inpos) {
+				(void) fprintf(stderr, "%s:%zu: end-of-file reached while reading file contents (bad file size?)\n", inname, lineno);
+				return 1;
+			} else if (fsize >= ZEROCOPY_MIN_SIZE) {
+				entry->offset = inpos;
 			} else {
-				(void) fprintf(stderr, "stdin:%zu: unexpected additional file data found (expected end-of-file contents marker \"---\" after %zu bytes)\n", lineno, fsize);
+				entry->contents = inbuf + inpos;
+				entry->mapped = 1;
+			}
+		} else if (fsize <= inend - inpos || (!seekableinput && fsize <= prefetchbudget)) {
+			/* pass small or unseekable contents in memory */
+			entry->charge = fsize;
+		} else if (seekableinput) {
+			if ((entry->offset = lseek(infd, 0, SEEK_CUR)) == -1) {
+				perror(inname);
 				return 1;
 			}
-			break;
-		default:
-			abort();
-			break;
+			entry->offset -= inend - inpos;
+		} else {
+			/* too large for memory: extract it here once the queue is empty */
+			return wait_for_restored_files() || restore_file(entry);
 		}
 	}
-	if (ferror(stdin)) {
-		(void) fprintf(stderr, "stdin:%zu: %s\n", lineno, strerror(errno));
-		return 1;
-	} else if (state == METADATA) {
-		if (ftype == REGULARFILE) {
-			(void) fprintf(stderr, "stdin:%zu: end-of-file reached before reading file contents\n", lineno);
-			return 1;
-		} else if (onentry(lineno)) {
+
+	(void) pthread_mutex_lock(&queuelock);
+	while (queuelength > 0 && (queuelength >= PREFETCH_MAX_ENTRIES || queuebytes + entry->charge > prefetchbudget)) {
+		(void) pthread_cond_wait(&queueprepared, &queuelock);
+	}
+	(void) pthread_mutex_unlock(&queuelock);
+	if (ftype == REGULARFILE && !fsamecontentsgiven) {
+		if (entry->mapped || entry->offset != -1) {
+			if (skip_file_data(lineno) != 0) {
+				return 1;
+			}
+		} else if ((entry->contents = read_file_contents(lineno)) == NULL) {
 			return 1;
 		}
-		clear_metadata();
-	} else if (state == CONTENTS_END) {
-		(void) fprintf(stderr, "stdin:%zu: end-of-file reached while reading file contents\n", lineno);
-		return 1;
 	}
-	free(line);
+
+	e = copy_extract_entry(entry);
+	busy = &busypaths[hash_bytes(e->path, strlen(e->path)) % BUSY_BUCKETS];
+	(void) pthread_mutex_lock(&queuelock);
+	e->nextbusy = *busy;
+	*busy = e;
+	if (extracttail) {
+		extracttail->next = e;
+	} else {
+		extracthead = e;
+	}
+	extracttail = e;
+	queuelength++;
+	queuebytes += e->charge;
+	(void) pthread_cond_signal(&queuework);
+	(void) pthread_mutex_unlock(&queuelock);
 	return 0;
 }
 
-int skip_file_data_fread(size_t lineno) {
-	char buffer[WRITE_BLOCKSIZE];
-	size_t numread, numleft;
+#ifdef	IO_URING_SUPPORT
+/* Queue the creation of batch file f, first unlinking the existing file if
+   unlink is nonzero. */
+void create_batch_file(batch_file_t *f, int unlink) {
+	struct io_uring_sqe *sqe;
 
-	for (numleft = fsize; numleft > 0; ) {
-		numread = fread(buffer, 1, numleft < sizeof (buffer) ? numleft : sizeof (buffer), stdin);
-		numleft -= numread;
-		if (ferror(stdin)) {
-			(void) fprintf(stderr, "stdin:%zu: error while reading: %s\n", lineno, strerror(errno));
-			return 1;
-		} else if (feof(stdin) && numleft > 0) {
-			(void) fprintf(stderr, "stdin:%zu: end-of-file reached while reading file contents (bad file size?)\n", lineno);
-			return 1;
-		}
+	f->unlinked = -ENOENT;
+	if (unlink) {
+		sqe = next_uring_sqe(&f->unlinked);
+		sqe->opcode = IORING_OP_UNLINKAT;
+		sqe->fd = f->dirfd;
+		sqe->addr = (uintptr_t)f->name;
+		/* a hard link runs the next operation even if this one fails */
+		sqe->flags = IOSQE_IO_HARDLINK;
 	}
-	return 0;
+	sqe = next_uring_sqe(&f->result);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = f->dirfd;
+	sqe->addr = (uintptr_t)f->name;
+	sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW;
+	sqe->len = 0666;
 }
 
-int skip_file_data_fseek(size_t lineno) {
-	int ret;
-	if (fsize <= (size_t)LONG_MAX) {
-		if ((ret = fseek(stdin, (long)fsize, SEEK_CUR)) != 0) {
-			if (errno == EBADF || errno == ESPIPE) {
-				/* fall back on read(2) if fseek(3) fails on stdin */
-				skip_file_data = skip_file_data_fread;
-				return skip_file_data_fread(lineno);
-			} else {
-				(void) fprintf(stderr, "stdin:%zu: error while reading: %s\n", lineno, strerror(errno));
-				return 1;
+/* Extract the batched files.  Every file is created by one batch of
+   openat(2) operations.  Files that already exist are unlinked and created
+   again by chains of linked unlinkat(2) and openat(2) operations, and then
+   every file's contents are written and every file is closed by single
+   batches.  io_uring can't change owners, modes, or times, so
+   restore_file_at()'s fchown(2), fchmod(2), and futimens(2) calls are
+   still made directly.  Returns nonzero if any file failed. */
+int extract_batched_files(void) {
+	struct io_uring_sqe *sqe;
+	struct timespec times[2];
+	batch_file_t *f;
+	size_t n;
+	int error, failed;
+
+	for (n = 0; n < numbatchfiles; n++) {
+		batchfiles[n].fd = -1;
+		batchfiles[n].errnum = 0;
+		create_batch_file(&batchfiles[n], 0);
+	}
+	error = numbatchfiles > 0 && run_uring() != 0;
+	for (n = 0; !error && n < numbatchfiles; n++) {
+		if (batchfiles[n].result == -EEXIST) {
+			create_batch_file(&batchfiles[n], 1);
+		}
+	}
+	error = error || (uringpending > 0 && run_uring() != 0);
+	for (n = 0; !error && n < numbatchfiles; n++) {
+		f = &batchfiles[n];
+		if (f->unlinked == 0) {
+			forget_directories(f->e->path);
+		}
+		if (f->result >= 0) {
+			f->fd = f->result;
+			f->result = 0;
+		}
+		if (f->unlinked < 0 && f->unlinked != -ENOENT) {
+			f->errnum = -f->unlinked;
+		} else if (f->fd == -1) {
+			f->errnum = -f->result;
+		} else if (f->e->size > 0) {
+			sqe = next_uring_sqe(&f->result);
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = f->fd;
+			sqe->addr = (uintptr_t)f->e->contents;
+			sqe->len = f->e->size;
+		}
+	}
+	error = error || (uringpending > 0 && run_uring() != 0);
+
+	times[0].tv_sec = 0;
+	times[0].tv_nsec = UTIME_OMIT;
+	times[1].tv_nsec = 0;
+	for (failed = 0, n = 0; !error && n < numbatchfiles; n++) {
+		f = &batchfiles[n];
+		if (f->errnum == 0 && f->result < 0) {
+			f->errnum = -f->result;
+		} else if (f->errnum == 0 && (size_t)f->result < f->e->size && write_fully(f->fd, f->e->contents + f->result, f->e->size - f->result) != 0) {
+			f->errnum = errno;
+		}
+		if (f->errnum != 0) {
+			errno = f->errnum;
+			perror(f->e->path);
+			failed = 1;
+		} else {
+			/* set the owner first because chown(2) may clear set-user-ID
+			   and set-group-ID bits */
+			times[1].tv_sec = f->e->mtime;
+			if ((f->e->chown && fchown(f->fd, f->e->uid, f->e->gid) != 0) || fchmod(f->fd, f->e->mode) != 0 || futimens(f->fd, times) != 0) {
+				perror(f->e->path);
+				failed = 1;
 			}
 		}
-		return ret;
-	} else {
-		return skip_file_data_fread(lineno);
 	}
+	for (n = 0; n < numbatchfiles; n++) {
+		if (batchfiles[n].fd != -1) {
+			sqe = next_uring_sqe(&batchfiles[n].result);
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = batchfiles[n].fd;
+		}
+	}
+	if (uringpending > 0) {
+		(void) run_uring();
+	}
+	for (n = 0; n < numbatchfiles; n++) {
+		release_parent_directory(batchfiles[n].handle);
+		free_extract_entry(batchfiles[n].e);
+	}
+	numbatchfiles = batchbytes = 0;
+	return error || failed;
 }
 
-int extract_file_contents(size_t lineno, FILE *fp) {
-	char buffer[WRITE_BLOCKSIZE];
-	size_t numleft, numread;
+/* Restore the current entry, batching it if it's a small regular file
+   whose contents can be held in memory (for 'x' command without -j).
+   Batched files are extracted first if the entry might depend on them. */
+int batch_extract_entry(size_t lineno, extract_entry_t *entry) {
+	batch_file_t *f;
+	size_t hash, n;
+	int batchable;
 
-	for (numleft = fsize; numleft; ) {
-		numread = fread(buffer, 1, numleft < sizeof (buffer) ? numleft : sizeof (buffer), stdin);
-		numleft -= numread;
-		if (ferror(stdin)) {
-			(void) fprintf(stderr, "stdin:%zu: error while reading: %s\n", lineno, strerror(errno));
+	batchable = entry->type == REGULARFILE && entry->size <= URING_MAX_FILE_SIZE && entry->offset == -1 && entry->source == NULL && entry->extents == NULL;
+	hash = hash_bytes(entry->path, strlen(entry->path));
+	for (n = 0; n < numbatchfiles && (batchfiles[n].hash != hash || strcmp(batchfiles[n].e->path, entry->path) != 0); n++) {
+	}
+	if (n < numbatchfiles || entry->type == HARDLINK || entry->type == DELETED || entry->source != NULL
+	    || (batchable && (numbatchfiles == BATCH_MAX_FILES || batchbytes + entry->size > URING_BUDGET))) {
+		if (extract_batched_files() != 0) {
 			return 1;
-		} else if (feof(stdin) && numleft > 0) {
-			(void) fprintf(stderr, "stdin:%zu: end-of-file reached while reading file contents (bad file size?)\n", lineno);
+		}
+	}
+	if (!batchable) {
+		return restore_file(entry);
+	}
+
+	if (inmapped) {
+		if (entry->size > inend - inpos) {
+			(void) fprintf(stderr, "%s:%zu: end-of-file reached while reading file contents (bad file size?)\n", inname, lineno);
 			return 1;
-		} else if (fwrite(buffer, 1, numread, fp) != numread) {
-			perror(fpath);
+		}
+		entry->contents = inbuf + inpos;
+		entry->mapped = 1;
+		if (skip_file_data(lineno) != 0) {
 			return 1;
 		}
+	} else if ((entry->contents = read_file_contents(lineno)) == NULL) {
+		return 1;
+	}
+	if (entry->checksummed && check_checksum(lineno, entry->path, entry->checksum, crc32c(0, entry->contents, entry->size))) {
+		if (!entry->mapped) {
+			free(entry->contents);
+		}
+		return 1;
 	}
-	if (fp != stdout) {
-		(void) fclose(fp);
+
+	f = &batchfiles[numbatchfiles];
+	f->e = copy_extract_entry(entry);
+	if ((f->dirfd = open_parent_directory(f->e->path, &f->name, &f->handle)) == -1) {
+		free_extract_entry(f->e);
+		return 1;
 	}
+	f->hash = hash;
+	numbatchfiles++;
+	batchbytes += entry->mapped ? 0 : entry->size;
 	return 0;
 }
+#endif	/* IO_URING_SUPPORT */
 
-int listfiles(size_t lineno) {
-	if (is_invalid_metadata()) {
-		(void) fprintf(stderr, "stdin:%zu: incomplete file metadata\n", lineno);
+/* the parent directory of the last extracted file whose owner was checked */
+static char *lastparent;
+static size_t lastparentcap, lastparentlen = (size_t)-1;
+static char lastparentsetgid;
+
+/* Return nonzero if a new file at path gets the process's effective group
+   ID, that is, if its parent directory doesn't have its set-group-ID bit
+   set.  Archives list directories' contents together, so the answer is
+   remembered for the last parent directory. */
+int gets_effective_group(const char *path) {
+	struct stat sb;
+	slice_t parent;
+	const char *slash;
+
+	parent.ptr = path;
+	parent.len = (slash = strrchr(path, '/')) == NULL ? 0 : slash == path ? 1 : (size_t)(slash - path);
+	if (parent.len != lastparentlen || memcmp(lastparent, path, parent.len) != 0) {
+		copy_slice(&lastparent, &lastparentcap, parent);
+		lastparentlen = parent.len;
+		lastparentsetgid = stat(parent.len > 0 ? lastparent : ".", &sb) != 0 || (sb.st_mode & S_ISGID) != 0;
+	}
+	return !lastparentsetgid;
+}
+
+/* Choose the owner of the current entry's file (for 'x' command).  Returns
+   nonzero if lchown(2) must set it, which is unnecessary when ownership
+   isn't restored or when a new file already gets that owner. */
+int resolve_owner(uid_t *uid, gid_t *gid) {
+	if (ownermode == OWNER_NONE) {
+		return 0;
+	}
+	*uid = fuid;
+	*gid = fgid;
+	if (!numericowner) {
+		/* fall back on the archived IDs for names that don't exist here */
+		(void) user_id(fusername, uid);
+		(void) group_id(fgroupname, gid);
+	}
+	if (ftype == DIRECTORY) {
+		/* an existing directory keeps its owner, and it may change the
+		   set-group-ID bit of the cached parent directory */
+		lastparentlen = (size_t)-1;
 		return 1;
 	}
-	printline(fpath);
-	if (ftype == REGULARFILE) {
-		return skip_file_data(lineno);
+	return *uid != euid || *gid != egid || !gets_effective_group(fpath);
+}
+
+/* Return the offset in standard input of the current entry's contents, or
+   -1 if they can't be read again. */
+off_t contents_offset(void) {
+	off_t offset;
+
+	if (inmapped) {
+		return inpos;
+	} else if (compressedinput || (offset = lseek(infd, 0, SEEK_CUR)) == -1) {
+		return -1;
+	}
+	return offset - (off_t)(inend - inpos);
+}
+
+/* Remember the current entry, which isn't a hard link, so that a later hard
+   link to its file can be restored from it if the file isn't extracted
+   (for the hardlink extension).  extracted is nonzero if the file is being
+   extracted. */
+void remember_link_target(int extracted) {
+	base_file_t *f;
+
+	f = add_base_file(fpath, strlen(fpath));
+	f->type = ftype;
+	f->extracted = extracted;
+	free(f->linktarget);
+	free(f->linkedpath);
+	f->linktarget = f->linkedpath = NULL;
+	if (extracted) {
+		return;
+	}
+	f->size = fsize;
+	f->major = fmajor;
+	f->minor = fminor;
+	f->mode = fmode;
+	f->mtime = fmtime;
+	f->uid = fuid;
+	f->gid = fgid;
+	if (ownermode != OWNER_NONE && !numericowner) {
+		/* as resolve_owner() does */
+		(void) user_id(fusername, &f->uid);
+		(void) group_id(fgroupname, &f->gid);
+	}
+	f->checksum = fchecksum;
+	f->checksummed = fchecksumgiven;
+	if (ftype == SYMLINK) {
+		f->linktarget = safe_strdup(flinktarget);
+	} else if (ftype != REGULARFILE || fsparsemapgiven) {
+		f->offset = -1;
+	} else if (fsamecontentsgiven) {
+		/* locate_contents() found the earlier entry */
+		f->offset = find_base_file(fsamecontents, strlen(fsamecontents))->offset;
+	} else {
+		f->offset = contents_offset();
+	}
+}
+
+/* If the current entry is a hard link to a file that wasn't extracted, then
+   make e restore the file from the entry that described it instead, unless
+   an earlier hard link to it already did, in which case e links to that.
+   Returns nonzero if the file can't be restored. */
+int resolve_link_target(size_t lineno, extract_entry_t *e) {
+	base_file_t *f;
+
+	if (basefilescap == 0 || (f = find_base_file(flinktarget, strlen(flinktarget)))->path == NULL || f->extracted || f->type == UNKNOWN || f->type == DELETED) {
+		return 0;
+	} else if (f->linkedpath != NULL) {
+		e->linktarget = f->linkedpath;
+		return 0;
+	} else if (f->type == REGULARFILE && f->offset == -1) {
+		(void) fprintf(stderr, "%s:%zu: %s: the contents of %s aren't available\n", inname, lineno, fpath, flinktarget);
+		return 1;
 	}
+	e->type = f->type;
+	e->linktarget = f->linktarget;
+	e->major = f->major;
+	e->minor = f->minor;
+	e->chown = ownermode != OWNER_NONE;
+	e->uid = f->uid;
+	e->gid = f->gid;
+	e->mode = f->mode;
+	e->mtime = f->mtime;
+	e->size = f->size;
+	e->offset = f->type == REGULARFILE ? f->offset : -1;
+	e->checksum = f->checksum;
+	e->checksummed = f->checksummed;
+	f->linkedpath = safe_strdup(fpath);
 	return 0;
 }
 
-int extract_if_requested_file(const char *file_path) {
-	size_t n;
-	int result;
+/* Remember where the current regular file entry's contents can be found
+   again so that later entries can refer to them (for the dedup extension).
+   extracted is nonzero if the entry's file is being extracted.  If the
+   entry refers to an earlier entry's contents, then *offset is set to their
+   offset in standard input or, if standard input isn't seekable, *source
+   is set to the extracted file that has them. */
+int locate_contents(size_t lineno, int extracted, off_t *offset, const char **source) {
+	base_file_t *f;
+	off_t contentsoffset;
 
-	for (n = 0; n < num_requested_files; n++) {
-		if ((result = fnmatch(requested_files[n].path_pattern, file_path, 0)) == 0) {
-			requested_files[n].found = 1;
+	*offset = -1;
+	*source = NULL;
+	if (fsamecontentsgiven) {
+		if (basefilescap == 0 || (f = find_base_file(fsamecontents, strlen(fsamecontents)))->path == NULL || f->size != fsize || (f->offset == -1 && !f->extracted)) {
+			(void) fprintf(stderr, "%s:%zu: %s: the contents of %s aren't available\n", inname, lineno, fpath, fsamecontents);
 			return 1;
-		} else if (result == FNM_NOSYS) {
-			(void) fprintf(stderr, "error: fnmatch(3) is not implemented on your system; cannot extract individual files\n");
-			exit(EXIT_FAILURE);
 		}
+		if ((contentsoffset = *offset = f->offset) == -1) {
+			*source = f->path;
+		}
+		if (f->checksummed && !fchecksumgiven) {
+			/* verify the earlier entry's contents when they're copied */
+			fchecksum = f->checksum;
+			fchecksumgiven = 1;
+		}
+	} else {
+		contentsoffset = contents_offset();
 	}
+	f = add_base_file(fpath, strlen(fpath));
+	f->type = REGULARFILE;
+	f->size = fsize;
+	f->offset = contentsoffset;
+	f->checksum = fchecksum;
+	f->checksummed = fchecksumgiven;
+	f->extracted = extracted;
 	return 0;
 }
 
 int extract(size_t lineno) {
-	FILE *fp;
-	struct stat sb;
-	struct timespec times[2];
-	int result;
+	extract_entry_t entry;
+	int failed, selected;
+	const char *source;
+	off_t offset;
 
 	if (is_invalid_metadata()) {
-		(void) fprintf(stderr, "stdin:%zu: incomplete file metadata\n", lineno);
+		(void) fprintf(stderr, "%s:%zu: incomplete file metadata\n", inname, lineno);
+		return 1;
+	}
+	selected = should_extract_file == NULL || should_extract_file(fpath);
+	offset = -1;
+	source = NULL;
+	if (ftype == REGULARFILE && (extensions & EXTENSION_DEDUP) && !fsparsemapgiven && locate_contents(lineno, selected && !extracttostdout, &offset, &source) != 0) {
 		return 1;
 	}
-	if (should_extract_file == NULL || should_extract_file(fpath)) {
+	if ((extensions & EXTENSION_HARDLINK) && should_extract_file != NULL && !extracttostdout && ftype != HARDLINK && ftype != DIRECTORY && ftype != DELETED) {
+		remember_link_target(selected);
+	}
+	if (selected) {
 		if (verbose) {
 			if (fprintf(stderr, "%s\n", fpath) < 0) {
 				perror("stderr");
 				return 1;
 			}
 		}
-		if (extracttostdout) {
-			return ftype == REGULARFILE ? extract_file_contents(lineno, stdout) : 0;
+		if (extracttostdout && ftype == REGULARFILE && fsamecontentsgiven) {
+			entry.path = fpath;
+			entry.size = fsize;
+			entry.lineno = lineno;
+			entry.offset = offset;
+			entry.checksum = fchecksum;
+			entry.checksummed = fchecksumgiven;
+			return extract_file_contents_at(&entry, STDOUT_FILENO);
+		} else if (extracttostdout && ftype == REGULARFILE && fsparsemapgiven) {
+			entry.path = fpath;
+			entry.size = fsize;
+			entry.lineno = lineno;
+			entry.contents = NULL;
+			entry.offset = -1;
+			entry.checksum = fchecksum;
+			entry.checksummed = fchecksumgiven;
+			entry.extents = fextents;
+			entry.numextents = fnumextents;
+			entry.sparsesize = fsparsesize;
+			return extract_sparse_contents(&entry, STDOUT_FILENO, 1);
+		} else if (extracttostdout) {
+			return ftype == REGULARFILE ? extract_file_contents(lineno, STDOUT_FILENO) : 0;
 		}
-		fp = NULL;
-		if (ftype != DIRECTORY && unlink(fpath) != 0 && errno != ENOENT) {
-			perror(fpath);
+		entry.path = fpath;
+		entry.type = ftype;
+		entry.linktarget = flinktargetgiven ? flinktarget : NULL;
+		entry.major = fmajor;
+		entry.minor = fminor;
+		entry.chown = ftype != DELETED && ftype != HARDLINK && resolve_owner(&entry.uid, &entry.gid);
+		entry.mode = fmode;
+		entry.mtime = fmtime;
+		entry.size = fsize;
+		entry.lineno = lineno;
+		entry.contents = NULL;
+		entry.checksum = fchecksum;
+		entry.checksummed = fchecksumgiven;
+		entry.source = NULL;
+		entry.extents = ftype == REGULARFILE && fsparsemapgiven ? fextents : NULL;
+		entry.numextents = fnumextents;
+		entry.sparsesize = fsparsesize;
+		entry.mapped = 0;
+		entry.offset = -1;
+		entry.charge = 0;
+		if (fsamecontentsgiven) {
+			entry.source = source;
+			entry.offset = offset;
+		} else if (ftype == HARDLINK && resolve_link_target(lineno, &entry) != 0) {
 			return 1;
 		}
-		switch (ftype) {
-		case REGULARFILE:
-			result = 0;
-			if ((fp = fopen(fpath, "w")) == NULL) {
-				result = 1;
-			}
-			break;
-		case DIRECTORY:
-			if ((result = mkdir(fpath, fmode)) != 0 && errno == EEXIST) {
-				if (lstat(fpath, &sb) == 0 && S_ISDIR(sb.st_mode)) {
-					result = chmod(fpath, fmode);
-				}
-			}
-			break;
-		case SYMLINK:
-			result = symlink(flinktarget, fpath);
-			break;
-		case CHARDEVICE:
-			result = mknod(fpath, S_IFCHR | fmode, makedev(fmajor, fminor));
-			break;
-		case BLOCKDEVICE:
-			result = mknod(fpath, S_IFBLK | fmode, makedev(fmajor, fminor));
-			break;
-		case FIFO:
-			result = mkfifo(fpath, fmode);
-			break;
-		case SOCKET:
-			result = mknod(fpath, S_IFSOCK | fmode, makedev(fmajor, fminor));
-			break;
-		default:
-			abort();
-			break;
+		if (numjobs > 0) {
+			(void) pthread_mutex_lock(&queuelock);
+			failed = extractfailed;
+			(void) pthread_mutex_unlock(&queuelock);
+			return failed || queue_extract_entry(lineno, &entry);
 		}
-		if (result) {
-			perror(fpath);
-			return 1;
+#ifdef	IO_URING_SUPPORT
+		if (batchextract) {
+			return batch_extract_entry(lineno, &entry);
 		}
-		if (fp) {
-			if (extract_file_contents(lineno, fp) != 0) {
-				return 1;
-			}
-			if (chmod(fpath, fmode) != 0) {
-				perror(fpath);
+#endif	/* IO_URING_SUPPORT */
+		return restore_file(&entry);
+	} else if (ftype == REGULARFILE && !fsamecontentsgiven) {
+		return skip_file_data(lineno);
+	}
+	return 0;
+}
+
+/* Extract the requested files named in the loaded index by seeking to
+   their entries (for 'x' command). */
+int extract_indexed_files(void) {
+	size_t n;
+
+	for (n = 0; n < numindexrecords; n++) {
+		if (should_extract_file(indexrecords[n].path)) {
+			if (seek_input(indexrecords[n].offset) != 0 || scan_entries(extract, indexrecords[n].lineno, 1) != 0) {
 				return 1;
 			}
 		}
-		times[0].tv_sec = 0;
-		times[0].tv_nsec = UTIME_OMIT;
-		times[1].tv_sec = fmtime;
-		times[1].tv_nsec = 0;
-		if (utimensat(AT_FDCWD, fpath, times, 0) != 0) {
-			perror(fpath);
-			return 1;
+	}
+	return 0;
+}
+
+/* Set lastrequestedline to the first line of the last entry in the loaded
+   index that matches a requested file.  A loaded index covers all of
+   standard input, so no later entry can replace it. */
+void find_last_requested_entry(void) {
+	size_t n;
+
+	for (n = numindexrecords; n-- > 0;) {
+		if (match_pattern(&requestedfiles, indexrecords[n].path) != NULL) {
+			lastrequestedline = indexrecords[n].lineno;
+			return;
 		}
-		if (lchown(fpath, fuid, fgid) != 0) {
-			perror(fpath);
+	}
+}
+
+/* Return nonzero if a requested file in the loaded index is a hard link. */
+int is_hard_link_requested(void) {
+	size_t n;
+
+	for (n = 0; n < numindexrecords; n++) {
+		if (indexrecords[n].type == HARDLINK && match_pattern(&requestedfiles, indexrecords[n].path) != NULL) {
 			return 1;
 		}
-	} else if (ftype == REGULARFILE) {
-		return skip_file_data(lineno);
 	}
 	return 0;
 }
 
 int add_requested_path(const char *file_path) {
-	if (num_requested_files == requested_files_cap && (requested_files = realloc(requested_files, (requested_files_cap += REQUESTED_FILES_GROWTH) * sizeof (*requested_files))) == NULL) {
-		(void) fprintf(stderr, "out of memory\n");
-		exit(EXIT_FAILURE);
-	}
-	requested_files[num_requested_files].path_pattern = safe_strdup(file_path);
-	requested_files[num_requested_files++].found = 0;
+	add_pattern(&requestedfiles, file_path);
 	return 0;
 }
 
-int process_stdin_lines(int (*process_line)(const char *)) {
+/* Call process_line with each nonempty line of stream, which is named
+   name. */
+int process_lines(FILE *stream, const char *name, int (*process_line)(const char *)) {
 	int error;
 	char *line;
 	size_t linecap;
@@ -829,7 +6091,7 @@ int process_stdin_lines(int (*process_line)(const char *)) {
 
 	error = 0;
 	line = NULL;
-	while (!error && (numread = getline(&line, &linecap, stdin)) != -1) {
+	while (!error && (numread = getline(&line, &linecap, stream)) != -1) {
 		if (numread > 0) {
 			if (line[numread - 1] == '\n') {
 				line[numread - 1] = '\0';
@@ -839,14 +6101,66 @@ int process_stdin_lines(int (*process_line)(const char *)) {
 			}
 		}
 	}
-	if (ferror(stdin)) {
-		perror("stdin");
+	if (ferror(stream)) {
+		perror(name);
 		error = 1;
 	}
 	free(line);
 	return error;
 }
 
+/* Add the patterns listed in the file named path, one per line, to the
+   requested files. */
+int add_requested_paths_from(const char *path) {
+	FILE *stream;
+	int error;
+
+	if ((stream = fopen(path, "r")) == NULL) {
+		perror(path);
+		return 1;
+	}
+	error = process_lines(stream, path, add_requested_path);
+	(void) fclose(stream);
+	return error;
+}
+
+/* Parse the argument of the command-line option argv[n - 1].  If suffixes
+   is nonzero, then the argument may end with K, M, or G (multiples of 1024,
+   1024^2, and 1024^3). */
+unsigned long long option_argument(int argc, char **argv, int n, int suffixes) {
+	unsigned long long value;
+	char *end;
+
+	if (n >= argc) {
+		(void) fprintf(stderr, "error: %s requires an argument\n", argv[n - 1]);
+		exit(EXIT_FAILURE);
+	}
+	errno = 0;
+	value = strtoull(argv[n], &end, 10);
+	if (suffixes && end != argv[n]) {
+		switch (*end) {
+		case 'G':
+		case 'g':
+			value *= 1024;
+			/* fall through */
+		case 'M':
+		case 'm':
+			value *= 1024;
+			/* fall through */
+		case 'K':
+		case 'k':
+			value *= 1024;
+			end++;
+			break;
+		}
+	}
+	if (errno != 0 || end == argv[n] || *end != '\0' || argv[n][0] == '-') {
+		(void) fprintf(stderr, "error: invalid argument for %s: %s\n", argv[n - 1], argv[n]);
+		exit(EXIT_FAILURE);
+	}
+	return value;
+}
+
 void help(void) {
 	(void) fprintf(stdout,
 "Usage: ptar [-h] [OPTION ...] c|x|t [PATH ...]\n\n"
@@ -868,7 +6182,9 @@ void help(void) {
 "               will be extracted.  PATHs are treated as shell wildcard\n"
 "               patterns: '*.jpg' 'pictures/2013-*.jpg' and other such\n"
 "               patterns will match archived paths the same way these\n"
-"               patterns match paths in interactive shells.\n\n"
+"               patterns match paths in interactive shells.  If the\n"
+"               archive has an index (see --index), then reading stops\n"
+"               after the last entry that matches a PATH.\n\n"
 
 "     t         List the PATHs stored in the archive from standard input.\n"
 "               This also checks whether the archive conforms to the plain\n"
@@ -878,14 +6194,60 @@ void help(void) {
 "               guarantee that extraction would succeed.  This also does\n"
 "               not verify file or metadata contents unless the archive\n"
 "               contains a recognized extension that permits such\n"
-"               verification.  Unrecognized extensions are treated\n"
-"               as errors.\n\n"
+"               verification (see --checksum).  Unrecognized extensions\n"
+"               are treated as errors.  If standard input is a regular\n"
+"               file and the archive has an index (see --index) but no\n"
+"               checksums, then only the index is read and checked.\n\n"
 
 "Options:\n\n"
 
 "     NOTE: Options must precede command letters.\n\n"
 
+"     --checksum                   Record a CRC-32C checksum of each regular\n"
+"                                  file's contents in the archive created\n"
+"                                  by the 'c' command.  The 't' and 'x'\n"
+"                                  commands verify the checksums of the\n"
+"                                  contents that they read.\n"
+"     --dedup                      Store each regular file's contents once\n"
+"                                  in the archive created by the 'c'\n"
+"                                  command: Later files with the same\n"
+"                                  contents refer to the first one, and\n"
+"                                  'x' copies the contents from the archive\n"
+"                                  (or from the first file if standard\n"
+"                                  input isn't seekable).\n"
+"     --exclude PATTERN            Don't archive files whose paths or names\n"
+"                                  match the shell wildcard PATTERN with\n"
+"                                  the 'c' command, or anything below\n"
+"                                  them.  This may be given more than once.\n"
 "     -h, --help                   Show this help message and exit.\n"
+"     --hard-links                 Archive each file with several hard\n"
+"                                  links once when creating an archive with\n"
+"                                  the 'c' command: Its later paths are\n"
+"                                  hard links to the first one, which 'x'\n"
+"                                  recreates with link(2) (or, when the\n"
+"                                  first path isn't extracted from a\n"
+"                                  regular file, from its contents).\n"
+"     --index                      Append an index of file entries to the\n"
+"                                  archive created by the 'c' command.\n"
+"                                  When such an archive is read from a\n"
+"                                  regular file, 't' reads only the index\n"
+"                                  and 'x' with PATHs seeks directly to\n"
+"                                  the matching entries.\n"
+"     --incremental                Record each file's device and inode\n"
+"                                  numbers in the archive created by the\n"
+"                                  'c' command so that later archives can\n"
+"                                  be created with --since-archive.\n"
+"     --io-uring                   Create the small regular files extracted\n"
+"                                  by the 'x' command with batches of\n"
+"                                  io_uring operations.  This helps most on\n"
+"                                  slow or network file systems.  (Ignored\n"
+"                                  with -j.)\n"
+"     -j N, --jobs N               Use N threads to open and read files\n"
+"                                  while creating an archive with the 'c'\n"
+"                                  command (entries are still written in\n"
+"                                  the order in which they're found) or to\n"
+"                                  create files while extracting with the\n"
+"                                  'x' command.\n"
 "     -n, --no-archive-metadata    Don't write global archive metadata when\n"
 "                                  creating an archive with the 'c'\n"
 "                                  command.  (NOTE: Archives created with\n"
@@ -897,6 +6259,25 @@ void help(void) {
 "                                  compliance.  This creates a way to add\n"
 "                                  files to already-existing archives\n"
 "                                  through shell redirection.)\n"
+"     --no-index                   Ignore archive indexes: read every entry\n"
+"                                  for the 't' and 'x' commands.\n"
+"     --no-io-uring                Don't use io_uring operations to stat\n"
+"                                  and read files while creating an\n"
+"                                  archive with the 'c' command, or to\n"
+"                                  create files with --io-uring.\n"
+"     --no-same-owner              Don't restore extracted files' owners.\n"
+"                                  This is the default unless you run the\n"
+"                                  'x' command as root.\n"
+"     --numeric-owner              Restore extracted files' owners from\n"
+"                                  their archived user and group IDs.  By\n"
+"                                  default, archived user and group names\n"
+"                                  that exist on this system are used\n"
+"                                  instead.\n"
+"     --one-file-system            Don't archive the contents of\n"
+"                                  directories that are on other file\n"
+"                                  systems than the PATHs given to the 'c'\n"
+"                                  command.  (The directories themselves\n"
+"                                  are archived.)\n"
 "     -o, --extract-to-stdout      Override default 'x' command behavior by\n"
 "                                  writing extracted regular files' contents\n"
 "                                  to standard output.  The file system is\n"
@@ -907,20 +6288,80 @@ void help(void) {
 "                                  archiving PATHs specified on the command\n"
 "                                  line.  (This only makes sense for the\n"
 "                                  'c' command.)\n"
-"     -u, --unbuffered             Disable standard output buffering.\n"
+"     --patterns-from-file FILE    Read additional PATHs to be extracted\n"
+"                                  from FILE, one PATH per line, after\n"
+"                                  PATHs specified on the command line.\n"
+"                                  (This only makes sense for the 'x'\n"
+"                                  command.)\n"
+"     --prefetch-bytes N           Limit the file contents that are held\n"
+"                                  in memory for -j threads to N bytes\n"
+"                                  (default: 64M).  N may end with K, M,\n"
+"                                  or G.\n"
+"     --same-owner                 Restore extracted files' owners even if\n"
+"                                  you don't run the 'x' command as root.\n"
+"     --since-archive FILE         Create an incremental archive with the\n"
+"                                  'c' command: Omit files that are\n"
+"                                  unchanged since the archive FILE was\n"
+"                                  created and record files that were\n"
+"                                  deleted since then.  This may be given\n"
+"                                  more than once to name a full archive\n"
+"                                  and the incremental archives created\n"
+"                                  after it, in order.  (Implies\n"
+"                                  --incremental.)  'x' applies deletions,\n"
+"                                  so a chain of archives can be restored\n"
+"                                  by concatenating them on standard input.\n"
+"     --sort ORDER                 Archive each directory's entries in\n"
+"                                  ORDER with the 'c' command: 'none' (the\n"
+"                                  order the file system lists them in;\n"
+"                                  the default), 'name' (for reproducible\n"
+"                                  archives), or 'inode' (which reduces\n"
+"                                  seeks on hard disks).\n"
+"     --sparse                     Store only the data of regular files\n"
+"                                  with holes in the archive created by the\n"
+"                                  'c' command, along with a map of where\n"
+"                                  the data goes.  'x' recreates the holes.\n"
+"     -u, --unbuffered             Disable standard output buffering.  The\n"
+"                                  'c' command writes each entry as soon\n"
+"                                  as it's complete.\n"
 "     -v, --verbose                Verbose output: List PATHs added or\n"
-"                                  extracted on standard error.\n\n");
+"                                  extracted on standard error, followed by\n"
+"                                  owner lookup cache statistics.\n"
+"     -z, --gzip                   Compress the archive created by the 'c'\n"
+"                                  command with gzip, using -j threads (or\n"
+"                                  one per processor).  'x' and 't'\n"
+"                                  decompress archives read from regular\n"
+"                                  files automatically and can still use\n"
+"                                  their indexes; give -z to read a\n"
+"                                  compressed archive from a pipe.  (The\n"
+"                                  member lengths that make seeking\n"
+"                                  possible are stored in a \"PT\" gzip\n"
+"                                  extra field, which is a ptar\n"
+"                                  convention: other gzip files are\n"
+"                                  decompressed from the start.  This\n"
+"                                  option is missing if ptar was built\n"
+"                                  without zlib.)\n\n");
 }
 
 int main(int argc, char **argv) {
-	int error, n;
-	char noarchivemetadata, pathsfromstdin;
+	int error, n, result;
+	char noarchivemetadata, pathsfromstdin, noindex;
+	const char *patternsfile;
 	time_t now;
 	struct tm *nowtm;
 	struct stat sb;
 	size_t index;
+	const char **sincearchives;
+	size_t numsincearchives;
 
-	pathsfromstdin = noarchivemetadata = 0;
+	pathsfromstdin = noarchivemetadata = noindex = 0;
+	patternsfile = NULL;
+	if ((sincearchives = malloc(argc * sizeof (*sincearchives))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	numsincearchives = 0;
+	select_scan_key();
+	select_crc32c();
 	for (n = 1; n < argc; n++) {
 		if (strcmp(argv[n], "-h") == 0 || strcmp(argv[n], "--help") == 0) {
 			help();
@@ -934,17 +6375,100 @@ int main(int argc, char **argv) {
 	for (n = 1; n < argc; n++) {
 		if (strcmp(argv[n], "--paths-from-stdin") == 0) {
 			pathsfromstdin = 1;
+		} else if (strcmp(argv[n], "--patterns-from-file") == 0) {
+			if (++n == argc) {
+				(void) fprintf(stderr, "error: %s requires an argument\n", argv[n - 1]);
+				exit(EXIT_FAILURE);
+			}
+			patternsfile = argv[n];
+		} else if (strcmp(argv[n], "--exclude") == 0) {
+			if (++n == argc) {
+				(void) fprintf(stderr, "error: %s requires an argument\n", argv[n - 1]);
+				exit(EXIT_FAILURE);
+			}
+			add_pattern(&excludes, argv[n]);
+		} else if (strcmp(argv[n], "--one-file-system") == 0) {
+			onefilesystem = 1;
+		} else if (strcmp(argv[n], "--sort") == 0) {
+			if (++n == argc) {
+				(void) fprintf(stderr, "error: %s requires an argument\n", argv[n - 1]);
+				exit(EXIT_FAILURE);
+			} else if (strcmp(argv[n], "none") == 0) {
+				sortorder = SORT_NONE;
+			} else if (strcmp(argv[n], "name") == 0) {
+				sortorder = SORT_NAME;
+			} else if (strcmp(argv[n], "inode") == 0) {
+				sortorder = SORT_INODE;
+			} else {
+				(void) fprintf(stderr, "error: invalid argument for %s: %s (must be one of 'none', 'name', or 'inode')\n", argv[n - 1], argv[n]);
+				exit(EXIT_FAILURE);
+			}
+		} else if (strcmp(argv[n], "--checksum") == 0) {
+			writeextensions |= EXTENSION_CHECKSUM;
+		} else if (strcmp(argv[n], "--dedup") == 0) {
+			writeextensions |= EXTENSION_DEDUP;
+		} else if (strcmp(argv[n], "--hard-links") == 0) {
+			writeextensions |= EXTENSION_HARDLINK;
+		} else if (strcmp(argv[n], "--sparse") == 0) {
+			writeextensions |= EXTENSION_SPARSE;
+		} else if (strcmp(argv[n], "--index") == 0) {
+			writeextensions |= EXTENSION_INDEX;
+		} else if (strcmp(argv[n], "--incremental") == 0) {
+			writeextensions |= EXTENSION_INCREMENTAL;
+		} else if (strcmp(argv[n], "--since-archive") == 0) {
+			if (++n == argc) {
+				(void) fprintf(stderr, "error: %s requires an argument\n", argv[n - 1]);
+				exit(EXIT_FAILURE);
+			}
+			sincearchives[numsincearchives++] = argv[n];
+			writeextensions |= EXTENSION_INCREMENTAL;
+		} else if (strcmp(argv[n], "--no-index") == 0) {
+			noindex = 1;
+		} else if (strcmp(argv[n], "--same-owner") == 0) {
+			ownermode = OWNER_SAME;
+		} else if (strcmp(argv[n], "--no-same-owner") == 0) {
+			ownermode = OWNER_NONE;
+		} else if (strcmp(argv[n], "--numeric-owner") == 0) {
+			numericowner = 1;
+		} else if (strcmp(argv[n], "--io-uring") == 0) {
+#ifdef	IO_URING_SUPPORT
+			iouringoption = 1;
+#else	/* !IO_URING_SUPPORT */
+			(void) fprintf(stderr, "error: %s isn't supported by this build of ptar\n", argv[n]);
+			exit(EXIT_FAILURE);
+#endif	/* IO_URING_SUPPORT */
+		} else if (strcmp(argv[n], "--no-io-uring") == 0) {
+#ifdef	IO_URING_SUPPORT
+			nouringoption = 1;
+#endif	/* IO_URING_SUPPORT */
+		} else if (strcmp(argv[n], "-j") == 0 || strcmp(argv[n], "--jobs") == 0) {
+			n++;
+			if ((numjobs = option_argument(argc, argv, n, 0)) < 1) {
+				(void) fprintf(stderr, "error: invalid argument for %s: %s\n", argv[n - 1], argv[n]);
+				exit(EXIT_FAILURE);
+			}
+		} else if (strcmp(argv[n], "--prefetch-bytes") == 0) {
+			n++;
+			prefetchbudget = option_argument(argc, argv, n, 1);
 		} else if (strcmp(argv[n], "-u") == 0 || strcmp(argv[n], "--unbuffered") == 0) {
 			if (setvbuf(stdout, NULL, _IONBF, 0) != 0) {
 				(void) fprintf(stderr, "error: unable to disable standard output buffering: %s\n", strerror(errno));
 				exit(EXIT_FAILURE);
 			}
+			unbuffered = 1;
 		} else if (strcmp(argv[n], "-v") == 0 || strcmp(argv[n], "--verbose") == 0) {
 			verbose = 1;
 		} else if (strcmp(argv[n], "-n") == 0 || strcmp(argv[n], "--no-archive-metadata") == 0) {
 			noarchivemetadata = 1;
 		} else if (strcmp(argv[n], "-o") == 0 || strcmp(argv[n], "--extract-to-stdout") == 0) {
 			extracttostdout = 1;
+		} else if (strcmp(argv[n], "-z") == 0 || strcmp(argv[n], "--gzip") == 0) {
+#ifdef	GZIP_SUPPORT
+			gzipoption = 1;
+#else	/* !GZIP_SUPPORT */
+			(void) fprintf(stderr, "error: %s isn't supported by this build of ptar\n", argv[n]);
+			exit(EXIT_FAILURE);
+#endif	/* GZIP_SUPPORT */
 		} else if (n == argc) {
 			(void) fprintf(stderr, "error: no command given (specify -h for help)\n");
 			exit(EXIT_FAILURE);
@@ -964,6 +6488,23 @@ int main(int argc, char **argv) {
 		}
 		stdoutdev = sb.st_dev;
 		stdoutino = sb.st_ino;
+		compile_patterns(&excludes);
+		if (posix_memalign((void **)&outbuf, 4096, OUTPUT_BUFSIZE) != 0) {
+			(void) fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+#ifdef	GZIP_SUPPORT
+		if (gzipoption) {
+			start_compression();
+		} else
+#endif	/* GZIP_SUPPORT */
+#ifdef	__linux__
+		if (S_ISREG(sb.st_mode)) {
+			write_file_contents = write_file_contents_copy_range;
+		} else if (S_ISFIFO(sb.st_mode)) {
+			write_file_contents = write_file_contents_splice;
+		}
+#endif	/* __linux__ */
 		now = time(NULL);
 		if ((nowtm = localtime(&now)) == NULL) {
 			(void) fprintf(stderr, "error: couldn't convert Epoch timestamp to broken-down time representation\n");
@@ -973,44 +6514,178 @@ int main(int argc, char **argv) {
 			(void) fprintf(stderr, "error: current date and time are too large to fit in ptar's internal buffer\n");
 			exit(EXIT_FAILURE);
 		}
+		for (index = 0; index < numsincearchives; index++) {
+			if (load_base_archive(sincearchives[index]) != 0) {
+				exit(EXIT_FAILURE);
+			}
+		}
 		if (!noarchivemetadata) {
 			write_metadata("Metadata Encoding", "utf-8");
 			write_metadata("Archive Creation Date", linkpath);
+			if (writeextensions) {
+				for (linkpath[0] = '\0', index = 0; index < NUM_EXTENSIONS; index++) {
+					if (writeextensions & (1U << index)) {
+						(void) strcat(strcat(linkpath, linkpath[0] != '\0' ? ", " : ""), extensionnames[index]);
+					}
+				}
+				write_metadata("Extensions", linkpath);
+			}
+		} else if (writeextensions) {
+			(void) fprintf(stderr, "error: --checksum, --dedup, --hard-links, --index, --incremental, --since-archive, and --sparse require archive metadata (don't specify -n)\n");
+			exit(EXIT_FAILURE);
+		}
+		if (numjobs > 0) {
+			start_jobs(prepare_queued_entries);
 		}
 		for (n++; !error && n < argc; n++) {
 			error = archive_file(argv[n]);
 		}
 		if (!error && pathsfromstdin) {
-			error = process_stdin_lines(archive_file);
+			error = process_lines(stdin, inname, archive_file);
+		}
+		if (numjobs > 0) {
+			if (!error) {
+				error = write_queued_entries(1, 0);
+			}
+			stop_jobs();
+		}
+		if (!error && differential) {
+			write_deleted_files();
+		}
+		if (!error && (writeextensions & EXTENSION_INDEX)) {
+			write_index();
+		}
+		if (filesremoved) {
+			/* the archive is complete, but it lacks those files */
+			error = 1;
+		}
+#ifdef	GZIP_SUPPORT
+		if (gzipoption) {
+			finish_compression();
+		} else
+#endif	/* GZIP_SUPPORT */
+		flush_output();
+		if (verbose) {
+			(void) fprintf(stderr, "user name cache: %lu hits, %lu misses\n", usernames.hits, usernames.misses);
+			(void) fprintf(stderr, "group name cache: %lu hits, %lu misses\n", groupnames.hits, groupnames.misses);
+			if (writeextensions & EXTENSION_DEDUP) {
+				(void) fprintf(stderr, "deduplicated contents: %lu hits, %lu misses\n", deduphits, dedupmisses);
+			}
+			if (writeextensions & EXTENSION_HARDLINK) {
+				(void) fprintf(stderr, "hard links: %lu hits, %lu misses\n", hardlinks.hits, hardlinks.misses);
+			}
 		}
 		break;
 	case 'x':
-		if (++n < argc) {
-			do {
-				error = add_requested_path(argv[n]);
-			} while (!error && ++n < argc);
+		while (!error && ++n < argc) {
+			error = add_requested_path(argv[n]);
+		}
+		if (!error && patternsfile != NULL) {
+			error = add_requested_paths_from(patternsfile);
+		}
+		if (requestedfiles.count > 0 || patternsfile != NULL) {
+			compile_patterns(&requestedfiles);
 			should_extract_file = extract_if_requested_file;
 		}
+		euid = geteuid();
+		egid = getegid();
+		if (ownermode == OWNER_DEFAULT) {
+			ownermode = euid == 0 ? OWNER_SAME : OWNER_NONE;
+		}
+		map_input();
+#ifdef	__linux__
+		if (!compressedinput && fstat(infd, &sb) == 0) {
+			if (S_ISREG(sb.st_mode)) {
+				copy_input = copy_input_copy_range;
+			} else if (S_ISFIFO(sb.st_mode)) {
+				copy_input = copy_input_splice;
+			}
+		}
+#endif	/* __linux__ */
+		if (extracttostdout && fflush(stdout) != 0) {
+			write_error();
+		}
+		if (numjobs > 0 && !extracttostdout) {
+			seekableinput = !compressedinput && fstat(infd, &sb) == 0 && S_ISREG(sb.st_mode) && lseek(infd, 0, SEEK_CUR) != -1;
+			start_jobs(restore_queued_files);
+		}
+#ifdef	IO_URING_SUPPORT
+		batchextract = iouringoption && !nouringoption && numjobs == 0 && !extracttostdout
+		    && start_uring(URING_OP(IORING_OP_UNLINKAT) | URING_OP(IORING_OP_OPENAT) | URING_OP(IORING_OP_WRITE) | URING_OP(IORING_OP_CLOSE));
+#endif	/* IO_URING_SUPPORT */
 		if (!error) {
-			error = scan_archive(extract);
+			if (should_extract_file != NULL && !noindex && (result = load_index()) >= 0) {
+				if (result == 0 && ((extensions & EXTENSION_DEDUP) || is_hard_link_requested())) {
+					/* requested files might refer to any earlier contents,
+					   or be hard links to files that aren't requested */
+					find_last_requested_entry();
+					free_index();
+					error = seek_input(0) || scan_archive(extract);
+				} else {
+					error = result || extract_indexed_files();
+				}
+			} else {
+				error = scan_archive(extract);
+			}
+		}
+		if (numjobs > 0 && !extracttostdout) {
+			error = wait_for_restored_files() || error;
+			stop_jobs();
+		}
+#ifdef	IO_URING_SUPPORT
+		error = extract_batched_files() || error;
+#endif	/* IO_URING_SUPPORT */
+		close_directories();
+		error = finish_directories() || error;
+		if (verbose && ownermode == OWNER_SAME && !numericowner) {
+			(void) fprintf(stderr, "user ID cache: %lu hits, %lu misses\n", userids.hits, userids.misses);
+			(void) fprintf(stderr, "group ID cache: %lu hits, %lu misses\n", groupids.hits, groupids.misses);
 		}
 		break;
 	case 't':
-		error = scan_archive(listfiles);
+		map_input();
+		if (!noindex && (result = load_index()) >= 0) {
+			if (result == 0 && (extensions & EXTENSION_CHECKSUM)) {
+				/* read every entry to verify its contents */
+				free_index();
+				error = seek_input(0) || scan_archive(listfiles);
+			} else {
+				error = result || list_index();
+			}
+		} else {
+			error = scan_archive(listfiles);
+		}
 		break;
 	default:
 		(void) fprintf(stderr, "error: unrecognized command: %s (must be one of 'c', 'x', or 't')\n", argv[n]);
 		error = 1;
 	}
 	clear_metadata();
-	for (index = 0; index < num_requested_files; index++) {
-		if (!requested_files[index].found) {
-			(void) fprintf(stderr, "error: no archived files matching this pattern: %s\n", requested_files[index].path_pattern);
+	for (index = 0; index < requestedfiles.count; index++) {
+		if (!requestedfiles.patterns[index].found) {
+			(void) fprintf(stderr, "error: no archived files matching this pattern: %s\n", requestedfiles.patterns[index].text);
 			error = 1;
 		}
-		free(requested_files[index].path_pattern);
 	}
-	free(requested_files);
+	free_patterns(&requestedfiles);
+	free_patterns(&excludes);
+	free(sincearchives);
+	free_base_files();
+	free_metadata();
+	free_input();
+	free_index();
+	free_owner_cache(&usernames);
+	free_owner_cache(&groupnames);
+	free_owner_cache(&userids);
+	free_owner_cache(&groupids);
+	free_dedup_files();
+	free_owner_cache(&hardlinks);
+	free(lastparent);
+	free(outbuf);
+	free(direntsbuf);
+#ifdef	IO_URING_SUPPORT
+	stop_uring();
+#endif	/* IO_URING_SUPPORT */
 	return error ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
@@ -0,0 +1,464 @@
+/*
+ * Plain Text Archive Tool Benchmark
+ * Written in 2013.  See AUTHORS for a list of authors.
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide. This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/* Generates synthetic file trees with a deterministic generator, times a
+   ptar binary's 'c', 't', and 'x' commands on each of them, and prints one
+   tab-separated line per run: the tree, the command, the number of entries
+   it handled, the archive's size, the elapsed seconds, MB/s and entries/s
+   (both relative to the elapsed time), and the command's peak RSS in KB.
+   Build and run with "make bench". */
+
+#define	_GNU_SOURCE	/* for wait4(2) */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* the sizes of the trees at scale 1 (-s multiplies the counts) */
+#ifndef	BENCH_TINY_FILES
+#define	BENCH_TINY_FILES	100000
+#endif	/* BENCH_TINY_FILES */
+#ifndef	BENCH_FILES_PER_DIR
+#define	BENCH_FILES_PER_DIR	1000
+#endif	/* BENCH_FILES_PER_DIR */
+#ifndef	BENCH_HUGE_FILES
+#define	BENCH_HUGE_FILES	3
+#endif	/* BENCH_HUGE_FILES */
+#ifndef	BENCH_HUGE_SIZE
+#define	BENCH_HUGE_SIZE	(64 * 1024 * 1024)
+#endif	/* BENCH_HUGE_SIZE */
+#ifndef	BENCH_DEEP_CHAINS
+#define	BENCH_DEEP_CHAINS	20
+#endif	/* BENCH_DEEP_CHAINS */
+#ifndef	BENCH_DEEP_LEVELS
+#define	BENCH_DEEP_LEVELS	100
+#endif	/* BENCH_DEEP_LEVELS */
+#ifndef	BENCH_SPARSE_FILES
+#define	BENCH_SPARSE_FILES	20
+#endif	/* BENCH_SPARSE_FILES */
+#ifndef	BENCH_SPARSE_SIZE
+#define	BENCH_SPARSE_SIZE	(64 * 1024 * 1024)
+#endif	/* BENCH_SPARSE_SIZE */
+#ifndef	BENCH_LONG_FILES
+#define	BENCH_LONG_FILES	1000
+#endif	/* BENCH_LONG_FILES */
+
+/* long paths are made of BENCH_LONG_LEVELS directories, each with a
+   BENCH_LONG_NAME-character name, and hold BENCH_LONG_GROUP files each */
+#define	BENCH_LONG_LEVELS	20
+#define	BENCH_LONG_NAME	150
+#define	BENCH_LONG_GROUP	100
+
+/* selective extraction requests every BENCH_SELECT_EVERY-th tiny file */
+#ifndef	BENCH_SELECT_EVERY
+#define	BENCH_SELECT_EVERY	10
+#endif	/* BENCH_SELECT_EVERY */
+
+typedef struct tree {
+	const char *name;
+	void (*generate)(unsigned long scale);
+	const char *createoption;	/* an extra option for 'c', or NULL */
+	unsigned long long entries;	/* set by generate */
+} tree_t;
+
+static unsigned long long randomstate = 0x9e3779b97f4a7c15ULL;
+static unsigned long long numentries;
+static char block[65536];
+
+void fail(const char *what) {
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+/* xorshift64*, which always generates the same sequence */
+unsigned long long next_random(void) {
+	randomstate ^= randomstate >> 12;
+	randomstate ^= randomstate << 25;
+	randomstate ^= randomstate >> 27;
+	return randomstate * 0x2545f4914f6cdd1dULL;
+}
+
+void fill_block(size_t count) {
+	unsigned long long value;
+	size_t n;
+
+	for (n = 0; n < count; n += sizeof (value)) {
+		value = next_random();
+		(void) memcpy(block + n, &value, count - n < sizeof (value) ? count - n : sizeof (value));
+	}
+}
+
+void write_block(int fd, const char *path, size_t count, off_t offset) {
+	ssize_t numwritten;
+	size_t done;
+
+	fill_block(count);
+	for (done = 0; done < count; done += numwritten) {
+		if ((numwritten = pwrite(fd, block + done, count - done, offset + done)) == -1) {
+			fail(path);
+		}
+	}
+}
+
+void make_directory(const char *path) {
+	if (mkdir(path, 0755) != 0) {
+		fail(path);
+	}
+	numentries++;
+}
+
+/* Create the regular file path with size bytes of generated contents. */
+void make_file(const char *path, unsigned long long size) {
+	unsigned long long offset;
+	size_t count;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1) {
+		fail(path);
+	}
+	for (offset = 0; offset < size; offset += count) {
+		count = size - offset < sizeof (block) ? size - offset : sizeof (block);
+		write_block(fd, path, count, offset);
+	}
+	if (close(fd) != 0) {
+		fail(path);
+	}
+	numentries++;
+}
+
+void generate_tiny(unsigned long scale) {
+	char path[64];
+	unsigned long n;
+
+	make_directory("tiny");
+	for (n = 0; n < BENCH_TINY_FILES * scale; n++) {
+		if (n % BENCH_FILES_PER_DIR == 0) {
+			(void) sprintf(path, "tiny/d%05lu", n / BENCH_FILES_PER_DIR);
+			make_directory(path);
+		}
+		(void) sprintf(path, "tiny/d%05lu/f%07lu", n / BENCH_FILES_PER_DIR, n);
+		make_file(path, next_random() % 257);
+	}
+}
+
+void generate_huge(unsigned long scale) {
+	char path[64];
+	unsigned long n;
+
+	make_directory("huge");
+	for (n = 0; n < BENCH_HUGE_FILES * scale; n++) {
+		(void) sprintf(path, "huge/f%lu", n);
+		make_file(path, BENCH_HUGE_SIZE);
+	}
+}
+
+void generate_deep(unsigned long scale) {
+	char path[PATH_MAX];
+	size_t len;
+	unsigned long chain, level;
+
+	make_directory("deep");
+	for (chain = 0; chain < BENCH_DEEP_CHAINS * scale; chain++) {
+		len = sprintf(path, "deep/c%lu", chain);
+		make_directory(path);
+		for (level = 0; level < BENCH_DEEP_LEVELS; level++) {
+			(void) sprintf(path + len, "/f");
+			make_file(path, next_random() % 1024);
+			len += sprintf(path + len, "/d%lu", level);
+			make_directory(path);
+		}
+	}
+}
+
+/* Create BENCH_SPARSE_SIZE-byte files that are holes except for three 4K
+   data extents. */
+void generate_sparse(unsigned long scale) {
+	char path[64];
+	unsigned long n;
+	int fd;
+
+	make_directory("sparse");
+	for (n = 0; n < BENCH_SPARSE_FILES * scale; n++) {
+		(void) sprintf(path, "sparse/f%lu", n);
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1 || ftruncate(fd, BENCH_SPARSE_SIZE) != 0) {
+			fail(path);
+		}
+		write_block(fd, path, 4096, 0);
+		write_block(fd, path, 4096, BENCH_SPARSE_SIZE / 2);
+		write_block(fd, path, 4096, BENCH_SPARSE_SIZE - 4096);
+		if (close(fd) != 0) {
+			fail(path);
+		}
+		numentries++;
+	}
+}
+
+/* Create files whose paths are over 3000 bytes long. */
+void generate_long(unsigned long scale) {
+	char path[PATH_MAX];
+	size_t len, grouplen;
+	unsigned long group, level, n;
+
+	make_directory("long");
+	for (group = grouplen = 0, n = 0; n < BENCH_LONG_FILES * scale; n++) {
+		if (n % BENCH_LONG_GROUP == 0) {
+			len = sprintf(path, "long/g%lu", group++);
+			make_directory(path);
+			for (level = 0; level < BENCH_LONG_LEVELS; level++) {
+				len += sprintf(path + len, "/%0*lu", BENCH_LONG_NAME, level);
+				make_directory(path);
+			}
+			grouplen = len;
+		}
+		(void) sprintf(path + grouplen, "/%0*lu", BENCH_LONG_NAME, n);
+		make_file(path, next_random() % 4096);
+	}
+}
+
+static tree_t trees[] = {
+	{"tiny", generate_tiny, NULL, 0},
+	{"huge", generate_huge, NULL, 0},
+	{"deep", generate_deep, NULL, 0},
+	{"sparse", generate_sparse, "--sparse", 0},
+	{"long", generate_long, NULL, 0},
+};
+
+double now_seconds(void) {
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Run argv in the directory dir with standard input and output redirected
+   to input and output (if they aren't NULL), and return the elapsed
+   seconds.  *maxrss is set to its peak RSS.  Exits if the command fails. */
+double run(char **argv, const char *dir, const char *input, const char *output, long *maxrss) {
+	struct rusage usage;
+	double start;
+	pid_t pid;
+	int status, fd;
+
+	(void) fflush(stdout);
+	start = now_seconds();
+	if ((pid = fork()) == -1) {
+		fail("fork");
+	} else if (pid == 0) {
+		if (output == NULL) {
+			output = "/dev/null";
+		}
+		if (chdir(dir) != 0) {
+			perror(dir);
+		} else if (input != NULL && ((fd = open(input, O_RDONLY)) == -1 || dup2(fd, STDIN_FILENO) == -1)) {
+			perror(input);
+		} else if ((fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 || dup2(fd, STDOUT_FILENO) == -1) {
+			perror(output);
+		} else {
+			(void) execv(argv[0], argv);
+			perror(argv[0]);
+		}
+		_exit(127);
+	}
+	if (wait4(pid, &status, 0, &usage) == -1) {
+		fail("wait4");
+	} else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		(void) fprintf(stderr, "error: \"%s %s\" failed in %s\n", argv[0], argv[1], dir);
+		exit(EXIT_FAILURE);
+	}
+	*maxrss = usage.ru_maxrss;
+	return now_seconds() - start;
+}
+
+void report(const char *tree, const char *command, unsigned long long entries, unsigned long long bytes, double seconds, long maxrss) {
+	(void) printf("%s\t%s\t%llu\t%llu\t%.3f\t%.1f\t%.0f\t%ld\n", tree, command, entries, bytes, seconds, bytes / 1e6 / seconds, entries / seconds, maxrss);
+	(void) fflush(stdout);
+}
+
+int remove_entry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+	if (remove(fpath) != 0) {
+		fail(fpath);
+	}
+	return 0;
+}
+
+void remove_tree(const char *path) {
+	if (nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS) != 0) {
+		fail(path);
+	}
+}
+
+/* Write the paths that selective extraction requests from the tiny tree
+   (every BENCH_SELECT_EVERY-th file along with the directories) to the
+   file path, and return their number. */
+unsigned long long write_tiny_patterns(const char *path, unsigned long scale) {
+	unsigned long long count;
+	unsigned long n;
+	FILE *file;
+
+	if ((file = fopen(path, "w")) == NULL) {
+		fail(path);
+	}
+	(void) fprintf(file, "tiny\n");
+	for (count = 1, n = 0; n < BENCH_TINY_FILES * scale; n++) {
+		if (n % BENCH_FILES_PER_DIR == 0) {
+			(void) fprintf(file, "tiny/d%05lu\n", n / BENCH_FILES_PER_DIR);
+			count++;
+		}
+		if (n % BENCH_SELECT_EVERY == 0) {
+			(void) fprintf(file, "tiny/d%05lu/f%07lu\n", n / BENCH_FILES_PER_DIR, n);
+			count++;
+		}
+	}
+	if (fclose(file) != 0) {
+		fail(path);
+	}
+	return count;
+}
+
+int main(int argc, char **argv) {
+	char ptar[PATH_MAX], dir[PATH_MAX], treedir[PATH_MAX + 8], archive[PATH_MAX + 64], outdir[PATH_MAX + 64], patterns[PATH_MAX + 16];
+	char *args[8], **globs;
+	unsigned long scale, n, numdirs, numglobs;
+	unsigned long long bytes, selected;
+	double seconds;
+	size_t t;
+	long maxrss;
+	struct stat sb;
+	int opt;
+
+	scale = 1;
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		if (opt != 's' || (scale = strtoul(optarg, NULL, 10)) == 0) {
+			(void) fprintf(stderr, "usage: %s [-s SCALE] PTAR DIR\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (argc - optind != 2) {
+		(void) fprintf(stderr, "usage: %s [-s SCALE] PTAR DIR\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (realpath(argv[optind], ptar) == NULL) {
+		fail(argv[optind]);
+	}
+	/* DIR is removed afterward, so it must be new */
+	if (mkdir(argv[optind + 1], 0755) != 0 || realpath(argv[optind + 1], dir) == NULL) {
+		fail(argv[optind + 1]);
+	}
+	(void) sprintf(treedir, "%s/trees", dir);
+	if (mkdir(treedir, 0755) != 0 || chdir(treedir) != 0) {
+		fail(treedir);
+	}
+	for (t = 0; t < sizeof (trees) / sizeof (*trees); t++) {
+		numentries = 0;
+		trees[t].generate(scale);
+		trees[t].entries = numentries;
+	}
+
+	(void) printf("tree\tcommand\tentries\tbytes\tseconds\tMB/s\tentries/s\tmaxrss_kb\n");
+	args[0] = ptar;
+	for (t = 0; t < sizeof (trees) / sizeof (*trees); t++) {
+		(void) sprintf(archive, "%s/%s.ptar", dir, trees[t].name);
+		n = 1;
+		if (trees[t].createoption != NULL) {
+			args[n++] = (char *)trees[t].createoption;
+		}
+		args[n++] = "c";
+		args[n++] = (char *)trees[t].name;
+		args[n] = NULL;
+		seconds = run(args, treedir, NULL, archive, &maxrss);
+		if (stat(archive, &sb) != 0) {
+			fail(archive);
+		}
+		bytes = sb.st_size;
+		report(trees[t].name, "c", trees[t].entries, bytes, seconds, maxrss);
+
+		args[1] = "t";
+		args[2] = NULL;
+		seconds = run(args, dir, archive, NULL, &maxrss);
+		report(trees[t].name, "t", trees[t].entries, bytes, seconds, maxrss);
+
+		(void) sprintf(outdir, "%s/x-%s", dir, trees[t].name);
+		if (mkdir(outdir, 0755) != 0) {
+			fail(outdir);
+		}
+		args[1] = "x";
+		seconds = run(args, outdir, archive, NULL, &maxrss);
+		report(trees[t].name, "x", trees[t].entries, bytes, seconds, maxrss);
+		remove_tree(outdir);
+	}
+
+	/* selective extraction of many literal paths and of many globs */
+	(void) sprintf(archive, "%s/tiny.ptar", dir);
+	if (stat(archive, &sb) != 0) {
+		fail(archive);
+	}
+	bytes = sb.st_size;
+	(void) sprintf(patterns, "%s/patterns", dir);
+	selected = write_tiny_patterns(patterns, scale);
+	(void) sprintf(outdir, "%s/x-select", dir);
+	if (mkdir(outdir, 0755) != 0) {
+		fail(outdir);
+	}
+	args[1] = "--patterns-from-file";
+	args[2] = patterns;
+	args[3] = "x";
+	args[4] = NULL;
+	seconds = run(args, outdir, archive, NULL, &maxrss);
+	report("tiny", "x-paths", selected, bytes, seconds, maxrss);
+	remove_tree(outdir);
+
+	/* one glob per directory for the files whose numbers end in 3 */
+	numdirs = (BENCH_TINY_FILES * scale + BENCH_FILES_PER_DIR - 1) / BENCH_FILES_PER_DIR;
+	if ((globs = calloc(numdirs + 5, sizeof (*globs))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+	globs[0] = ptar;
+	globs[1] = "x";
+	globs[2] = "tiny";
+	globs[3] = "tiny/d?????";
+	for (numglobs = 4, n = 0; n < numdirs; n++) {
+		if ((globs[numglobs] = malloc(32)) == NULL) {
+			(void) fprintf(stderr, "out of memory\n");
+			return EXIT_FAILURE;
+		}
+		(void) sprintf(globs[numglobs++], "tiny/d%05lu/f*3", n);
+	}
+	if (mkdir(outdir, 0755) != 0) {
+		fail(outdir);
+	}
+	seconds = run(globs, outdir, archive, NULL, &maxrss);
+	report("tiny", "x-globs", 1 + numdirs + (BENCH_TINY_FILES * scale + 6) / 10, bytes, seconds, maxrss);
+	remove_tree(outdir);
+	for (n = 4; n < numglobs; n++) {
+		free(globs[n]);
+	}
+	free(globs);
+
+	if (chdir("/") != 0) {
+		fail("/");
+	}
+	remove_tree(dir);
+	return EXIT_SUCCESS;
+}
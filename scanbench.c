@@ -0,0 +1,126 @@
+/*
+ * Metadata Key Scanner Microbenchmark
+ * Written in 2013.  See AUTHORS for a list of authors.
+ *
+ * To the extent possible under law, the author(s) have dedicated all copyright
+ * and related and neighboring rights to this software to the public domain
+ * worldwide. This software is distributed without any warranty.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along
+ * with this software. If not, see
+ * <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+/* Times each scan_key_*() function in ptar.c on typical metadata lines and
+   checks that they all agree.  Build with "make scanbench". */
+
+#define	main	ptar_main
+#include "ptar.c"
+#undef	main
+
+#ifndef	SCANBENCH_LINES
+#define	SCANBENCH_LINES	100000
+#endif	/* SCANBENCH_LINES */
+
+#ifndef	SCANBENCH_ROUNDS
+#define	SCANBENCH_ROUNDS	50
+#endif	/* SCANBENCH_ROUNDS */
+
+typedef struct scanner {
+	const char *name;
+	size_t (*scan)(const char *, size_t, char *, size_t *);
+} scanner_t;
+
+static const char *samplelines[] = {
+	"Path: src/lib/module/file.c",
+	"Type: Regular File",
+	"File Size: 48213",
+	"Permissions: 644",
+	"User Name: builder",
+	"User ID: 1000",
+	"Group Name: staff",
+	"Group ID: 50",
+	"Modification Time: 1381190400",
+	"Link Target: ../../shared/library.so.1",
+	"Index Entry: 123456 7890 48213 regularfile src/lib/module/file.c",
+	"---",
+	"not a key: because of the colon later on",
+	"Bad*Key: value",
+};
+
+double now_seconds(void) {
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+	scanner_t scanners[3];
+	size_t numscanners, n, round, *lengths, result, expected, keylen, expectedkeylen;
+	const char **lines;
+	char key[KEY_MAX + 1], expectedkey[KEY_MAX + 1], fuzz[80];
+	double start, elapsed, baseline;
+	unsigned long long checksum;
+
+	numscanners = 0;
+	scanners[numscanners].name = "scalar";
+	scanners[numscanners++].scan = scan_key_scalar;
+#ifdef	SIMD_SCAN
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		scanners[numscanners].name = "sse2";
+		scanners[numscanners++].scan = scan_key_sse2;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		scanners[numscanners].name = "avx2";
+		scanners[numscanners++].scan = scan_key_avx2;
+	}
+#endif	/* SIMD_SCAN */
+
+	/* every scanner must agree with the scalar one, including on junk */
+	srand(1);
+	for (round = 0; round < 200000; round++) {
+		for (n = 0; n < sizeof (fuzz); n++) {
+			fuzz[n] = "aZ9 -_:\t*\x80"[rand() % 10];
+		}
+		fuzz[0] = "aZ9:"[rand() % 4];
+		result = rand() % sizeof (fuzz);
+		expected = scan_key_scalar(fuzz, result, expectedkey, &expectedkeylen);
+		for (n = 1; n < numscanners; n++) {
+			if (scanners[n].scan(fuzz, result, key, &keylen) != expected || (expected != NOKEY && (keylen != expectedkeylen || strcmp(key, expectedkey) != 0))) {
+				(void) fprintf(stderr, "error: %s disagrees with scalar on \"%.*s\"\n", scanners[n].name, (int)result, fuzz);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	if ((lines = malloc(SCANBENCH_LINES * sizeof (*lines))) == NULL || (lengths = malloc(SCANBENCH_LINES * sizeof (*lengths))) == NULL) {
+		(void) fprintf(stderr, "out of memory\n");
+		return EXIT_FAILURE;
+	}
+	for (n = 0; n < SCANBENCH_LINES; n++) {
+		lines[n] = samplelines[n % (sizeof (samplelines) / sizeof (*samplelines))];
+		lengths[n] = strlen(lines[n]);
+	}
+	(void) printf("scanner\tns/line\tspeedup\n");
+	for (baseline = 0, n = 0; n < numscanners; n++) {
+		checksum = 0;
+		start = now_seconds();
+		for (round = 0; round < SCANBENCH_ROUNDS; round++) {
+			for (result = 0; result < SCANBENCH_LINES; result++) {
+				if ((expected = scanners[n].scan(lines[result], lengths[result], key, &keylen)) != NOKEY) {
+					checksum += expected + keylen + (unsigned char)key[0];
+				}
+			}
+		}
+		elapsed = now_seconds() - start;
+		if (baseline == 0) {
+			baseline = elapsed;
+		}
+		(void) printf("%s\t%.2f\t%.2fx\t(checksum %llu)\n", scanners[n].name, elapsed * 1e9 / ((double)SCANBENCH_LINES * SCANBENCH_ROUNDS), baseline / elapsed, checksum);
+	}
+	free(lines);
+	free(lengths);
+	return EXIT_SUCCESS;
+}